@@ -38,6 +38,7 @@
 #include <limits.h>
 #include <stddef.h>
 #include <signal.h>
+#include <poll.h>
 #include "linux/lguest_launcher.h"
 #include "linux/lguest_rpmsg.h"
 #include "linux/virtio_config.h"
@@ -46,6 +47,7 @@
 #include "linux/virtio_console.h"
 #include "linux/virtio_rng.h"
 #include "linux/virtio_ring.h"
+#include "linux/vhost.h"
 
 
 /*
@@ -78,6 +80,9 @@ typedef uint8_t u8;
 #endif
 /*:*/
 
+/* This one uses the kernel's u16 and u64 itself. */
+#include "linux/virtio_balloon.h"
+
 #define PAGE_PRESENT 0x7 	/* Present, RW, Execute */
 #define BRIDGE_PFX "bridge:"
 #ifndef SIOCBRADDIF
@@ -104,6 +109,10 @@ unsigned long lg_kernel_start;
  * this, and although I wouldn't recommend it, it works quite nicely here.
  */
 static bool verbose;
+
+/* --bench: report what each virtqueue did when we exit. */
+static bool bench;
+static struct timeval bench_start;
 #define verbose(args...) \
 	do { if (verbose) printf(args); } while(0)
 /*:*/
@@ -115,8 +124,13 @@ static unsigned long guest_limit, guest_max;
 /* The /dev/lguest file descriptor. */
 static int lguest_fd;
 
-/* a per-cpu variable indicating whose vcpu is currently running */
-static unsigned int __thread cpu_id;
+/* How many CPUs the Guest has, and the processes which run all but CPU 0. */
+static unsigned int nr_vcpus = 1;
+static pid_t *vcpu_pids;
+/* Each new CPU's process says it's ready on this pipe. */
+static int vcpu_ready[2];
+/* The main Launcher process, which runs CPU 0 and owns the cleanup. */
+static pid_t launcher_pid;
 
 /* This is our list of devices. */
 struct device_list {
@@ -162,8 +176,21 @@ struct device {
 	/* Does Guest want an intrrupt on empty? */
 	bool irq_on_empty;
 
+	/* Can we finish buffers in a different order than we took them? */
+	bool out_of_order;
+
+	/* Do we use the event indices instead of the ring flags? */
+	bool event_idx;
+
 	/* Device-specific data. */
 	void *priv;
+
+	/*
+	 * A device whose queues are serviced by the Host kernel (vhost) rather
+	 * than by our threads starts and stops them itself.
+	 */
+	void (*start)(struct device *dev);
+	void (*stop)(struct device *dev);
 };
 
 /* The virtqueue structure describes a queue attached to a device. */
@@ -185,12 +212,21 @@ struct virtqueue {
 	/* How many are used since we sent last irq? */
 	unsigned int pending_used;
 
+	/* The used index when we last sent an irq (for VIRTIO_RING_F_EVENT_IDX). */
+	u16 signalled_used;
+
 	/* Eventfd where Guest notifications arrive. */
 	int eventfd;
 
+	/* Eventfd which interrupts the Guest when written (or -1). */
+	int irqfd;
+
 	/* Function for the thread which is servicing this virtqueue. */
 	void (*service)(struct virtqueue *vq);
 	pid_t thread;
+
+	/* What we've done with this queue, for --bench. */
+	unsigned long long used_bufs, used_bytes;
 };
 
 /* Remember the arguments to the program so we can "reboot" */
@@ -340,6 +376,30 @@ static void *map_zeroed_pages(unsigned int num)
 	return addr;
 }
 
+/*
+ * With --ram=<file>, Guest memory comes from a shared mapping of that file
+ * instead: if the file sits on something which hands out physically
+ * contiguous memory (hugetlbfs, or a reserved memory device), the Host can
+ * map the Guest's kernel memory with 1M section entries.  We still reserve
+ * the whole range with zeroed pages first so the device pages follow on
+ * directly, and we align it to a section.
+ */
+static void *map_guest_ram(const char *filename, unsigned long mem)
+{
+	unsigned long section = 1024 * 1024;
+	int fd = open_or_die(filename, O_RDWR);
+	char *addr;
+
+	addr = map_zeroed_pages((mem + section) / getpagesize() + DEVICE_PAGES);
+	addr = (char *)(((unsigned long)addr + section - 1) & ~(section - 1));
+	if (mmap(addr, mem, PROT_READ|PROT_WRITE|PROT_EXEC,
+		 MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED)
+		err(1, "Mmapping %lu bytes of %s", mem, filename);
+	close(fd);
+
+	return addr;
+}
+
 /* Get some more pages for a device. */
 static void *get_pages(unsigned int num)
 {
@@ -665,72 +725,84 @@ static unsigned next_desc(struct vring_desc *desc,
 static void trigger_irq(struct virtqueue *vq)
 {
 	unsigned long buf[] = { LHREQ_IRQ, vq->config.irq };
+	u64 one = 1;
 
 	/* Don't inform them if nothing used. */
 	if (!vq->pending_used)
 		return;
 	vq->pending_used = 0;
 
+	/*
+	 * With event indices, the Guest tells us which used entry it wants an
+	 * interrupt for: we send one only if we've just gone past it.  Make
+	 * sure our used->idx is out before we read what they want.
+	 */
+	if (vq->dev->event_idx) {
+		u16 old = vq->signalled_used, new = vq->vring.used->idx;
+
+		mb();
+		vq->signalled_used = new;
+		if (!vring_need_event(vring_used_event(&vq->vring), new, old)
+		    && (!vq->dev->irq_on_empty
+			|| lg_last_avail(vq) != vq->vring.avail->idx))
+			return;
 	/* If they don't want an interrupt, don't send one... */
-	if (vq->vring.avail->flags & VRING_AVAIL_F_NO_INTERRUPT) {
+	} else if (vq->vring.avail->flags & VRING_AVAIL_F_NO_INTERRUPT) {
 		/* ... unless they've asked us to force one on empty. */
 		if (!vq->dev->irq_on_empty
 		    || lg_last_avail(vq) != vq->vring.avail->idx)
 			return;
 	}
 
-	/* Send the Guest an interrupt tell them we used something up. */
-	if (write(lguest_fd, buf, sizeof(buf)) != 0)
+	/*
+	 * Send the Guest an interrupt tell them we used something up.  If the
+	 * Host gave us an irqfd, poking that is cheaper than a request.
+	 */
+	if (vq->irqfd >= 0) {
+		if (write(vq->irqfd, &one, sizeof(one)) != sizeof(one))
+			err(1, "Triggering irqfd %i", vq->config.irq);
+	} else if (write(lguest_fd, buf, sizeof(buf)) != 0)
 		err(1, "Triggering irq %i", vq->config.irq);
 }
 
 /*
- * This looks in the virtqueue for the first available buffer, and converts
- * it to an iovec for convenient access.  Since descriptors consist of some
+ * These tell the Guest whether we want an LHCALL_NOTIFY when it adds buffers.
+ * With event indices, we say which avail entry should wake us: the next one.
+ * There's nothing to turn off: once it has gone past that entry it won't
+ * notify again until we ask.  Either way, after enable_notify() the caller
+ * must check the ring again, in case the Guest added something just before.
+ */
+static void enable_notify(struct virtqueue *vq)
+{
+	if (vq->dev->event_idx)
+		vring_avail_event(&vq->vring) = lg_last_avail(vq);
+	else
+		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	mb();
+}
+
+static void disable_notify(struct virtqueue *vq)
+{
+	if (!vq->dev->event_idx)
+		vq->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * This takes the first available buffer from the virtqueue, and converts it
+ * to an iovec for convenient access.  Since descriptors consist of some
  * number of output then some number of input descriptors, it's actually two
  * iovecs, but we pack them into one and note how many of each there were.
  *
- * This function waits if necessary, and returns the descriptor number found.
+ * There must be a buffer available: it returns the descriptor number found.
  */
-static unsigned wait_for_vq_desc(struct virtqueue *vq,
-				 struct iovec iov[],
-				 unsigned int *out_num, unsigned int *in_num)
+static unsigned get_vq_desc(struct virtqueue *vq,
+			    struct iovec iov[],
+			    unsigned int *out_num, unsigned int *in_num)
 {
 	unsigned int i, head, max;
 	struct vring_desc *desc;
 	u16 last_avail = lg_last_avail(vq);
 
-	/* There's nothing available? */
-	while (last_avail == vq->vring.avail->idx) {
-		u64 event;
-
-		/*
-		 * Since we're about to sleep, now is a good time to tell the
-		 * Guest about what we've used up to now.
-		 */
-		trigger_irq(vq);
-
-		/* OK, now we need to know about added descriptors. */
-		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
-
-		/*
-		 * They could have slipped one in as we were doing that: make
-		 * sure it's written, then check again.
-		 */
-		mb();
-		if (last_avail != vq->vring.avail->idx) {
-			vq->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
-			break;
-		}
-
-		/* Nothing new?  Wait for eventfd to tell us they refilled. */
-		if (read(vq->eventfd, &event, sizeof(event)) != sizeof(event))
-			errx(1, "Event read failed?");
-
-		/* We don't need to be notified again. */
-		vq->vring.used->flags |= VRING_USED_F_NO_NOTIFY;
-	}
-
 	/* Check it isn't doing very strange things with descriptor numbers. */
 	if ((u16)(vq->vring.avail->idx - last_avail) > vq->vring.num)
 		errx(1, "Guest moved used index from %u to %u",
@@ -793,6 +865,49 @@ static unsigned wait_for_vq_desc(struct virtqueue *vq,
 	return head;
 }
 
+/*
+ * This is get_vq_desc() for most devices: it waits if necessary for the Guest
+ * to give us a buffer.
+ */
+static unsigned wait_for_vq_desc(struct virtqueue *vq,
+				 struct iovec iov[],
+				 unsigned int *out_num, unsigned int *in_num)
+{
+	u16 last_avail = lg_last_avail(vq);
+
+	/* There's nothing available? */
+	while (last_avail == vq->vring.avail->idx) {
+		u64 event;
+
+		/*
+		 * Since we're about to sleep, now is a good time to tell the
+		 * Guest about what we've used up to now.
+		 */
+		trigger_irq(vq);
+
+		/* OK, now we need to know about added descriptors. */
+		enable_notify(vq);
+
+		/*
+		 * They could have slipped one in as we were doing that: check
+		 * again.
+		 */
+		if (last_avail != vq->vring.avail->idx) {
+			disable_notify(vq);
+			break;
+		}
+
+		/* Nothing new?  Wait for eventfd to tell us they refilled. */
+		if (read(vq->eventfd, &event, sizeof(event)) != sizeof(event))
+			errx(1, "Event read failed?");
+
+		/* We don't need to be notified again. */
+		disable_notify(vq);
+	}
+
+	return get_vq_desc(vq, iov, out_num, in_num);
+}
+
 /*
  * After we've used one of their buffers, we tell the Guest about it.  Sometime
  * later we'll want to send them an interrupt using trigger_irq(); note that
@@ -813,6 +928,9 @@ static void add_used(struct virtqueue *vq, unsigned int head, int len)
 	wmb();
 	vq->vring.used->idx++;
 	vq->pending_used++;
+
+	vq->used_bufs++;
+	vq->used_bytes += len;
 }
 
 /* And here's the combo meal deal.  Supersize me! */
@@ -923,6 +1041,16 @@ static void console_output(struct virtqueue *vq)
  */
 struct net_info {
 	int tunfd;
+
+	/*
+	 * If the Host has vhost-net, it moves the packets for us and these are
+	 * its file descriptor, the features it supports, and the eventfds the
+	 * Guest kicks it with and it tells us to interrupt the Guest with, for
+	 * the receive and transmit queues.
+	 */
+	int vhost_fd;
+	u64 vhost_features;
+	int kick[2], call[2];
 };
 
 static void net_output(struct virtqueue *vq)
@@ -1038,6 +1166,10 @@ static void reset_device(struct device *dev)
 	/* We're going to be explicitly killing threads, so ignore them. */
 	signal(SIGCHLD, SIG_IGN);
 
+	/* The Host kernel must let go of the queues before we clear them. */
+	if (dev->running && dev->stop)
+		dev->stop(dev);
+
 	/* Zero out the virtqueues, get rid of their threads */
 	for (vq = dev->vq; vq; vq = vq->next) {
 		if (vq->thread != (pid_t)-1) {
@@ -1048,6 +1180,7 @@ static void reset_device(struct device *dev)
 		memset(vq->vring.desc, 0,
 		       vring_size(vq->config.num, LGUEST_VRING_ALIGN));
 		lg_last_avail(vq) = 0;
+		vq->signalled_used = 0;
 	}
 	dev->running = false;
 
@@ -1055,31 +1188,69 @@ static void reset_device(struct device *dev)
 	signal(SIGCHLD, (void *)kill_launcher);
 }
 
-/*L:216
- * This actually creates the thread which services the virtqueue for a device.
+/*
+ * This creates an eventfd which will go off when the Guest does an
+ * LHCALL_NOTIFY for this vq.
  */
-static void create_thread(struct virtqueue *vq)
+static int notify_eventfd(struct virtqueue *vq)
 {
-	/*
-	 * Create stack for thread.  Since the stack grows upwards, we point
-	 * the stack pointer to the end of this region.
-	 */
-	char *stack = malloc(32768);
 	unsigned long args[] = { LHREQ_EVENTFD,
 				 vq->config.pfn*getpagesize(), 0 };
+	int fd;
 
 	/* Create a zero-initialized eventfd. */
-	vq->eventfd = eventfd(0, 0);
-	if (vq->eventfd < 0)
+	fd = eventfd(0, 0);
+	if (fd < 0)
 		err(1, "Creating eventfd");
-	args[2] = vq->eventfd;
+	args[2] = fd;
 
-	/*
-	 * Attach an eventfd to this virtqueue: it will go off when the Guest
-	 * does an LHCALL_NOTIFY for this vq.
-	 */
+	/* Attach it to this virtqueue. */
 	if (write(lguest_fd, &args, sizeof(args)) != 0)
 		err(1, "Attaching eventfd");
+	return fd;
+}
+
+/*
+ * This creates an eventfd which interrupts the Guest when written, so device
+ * threads (and vhost-net) needn't go through /dev/lguest for every interrupt.
+ * The Host keeps it until the Guest dies, so we only do this once per vq, in
+ * the main process so the fd survives the service thread.  An older Host
+ * doesn't know LHREQ_IRQFD: then we stick to LHREQ_IRQ.
+ */
+static void irq_eventfd(struct virtqueue *vq)
+{
+	static bool no_irqfd;
+	unsigned long args[] = { LHREQ_IRQFD, 0, vq->config.irq };
+	int fd;
+
+	if (vq->irqfd >= 0 || no_irqfd)
+		return;
+
+	fd = eventfd(0, 0);
+	if (fd < 0)
+		err(1, "Creating eventfd");
+	args[1] = fd;
+
+	if (write(lguest_fd, &args, sizeof(args)) != 0) {
+		if (errno != EINVAL)
+			err(1, "Attaching irqfd");
+		close(fd);
+		no_irqfd = true;
+		return;
+	}
+	vq->irqfd = fd;
+}
+
+/* This starts the thread which runs the virtqueue's service routine. */
+static void start_thread(struct virtqueue *vq)
+{
+	/*
+	 * Create stack for thread.  Since the stack grows upwards, we point
+	 * the stack pointer to the end of this region.
+	 */
+	char *stack = malloc(32768);
+
+	irq_eventfd(vq);
 
 	/*
 	 * CLONE_VM: because it has to access the Guest memory, and SIGCHLD so
@@ -1088,6 +1259,15 @@ static void create_thread(struct virtqueue *vq)
 	vq->thread = clone(do_thread, stack + 32768, CLONE_VM | SIGCHLD, vq);
 	if (vq->thread == (pid_t)-1)
 		err(1, "Creating clone");
+}
+
+/*L:216
+ * This actually creates the thread which services the virtqueue for a device.
+ */
+static void create_thread(struct virtqueue *vq)
+{
+	vq->eventfd = notify_eventfd(vq);
+	start_thread(vq);
 
 	/* We close our local copy now the child has it. */
 	close(vq->eventfd);
@@ -1116,21 +1296,72 @@ static void start_device(struct device *dev)
 			[dev->feature_len+i]);
 
 	dev->irq_on_empty = accepted_feature(dev, VIRTIO_F_NOTIFY_ON_EMPTY);
-
-	for (vq = dev->vq; vq; vq = vq->next) {
-		if (vq->service)
-			create_thread(vq);
+	dev->event_idx = accepted_feature(dev, VIRTIO_RING_F_EVENT_IDX);
+
+	if (dev->start)
+		dev->start(dev);
+	else {
+		for (vq = dev->vq; vq; vq = vq->next) {
+			if (vq->service)
+				create_thread(vq);
+		}
 	}
 	dev->running = true;
 }
 
+/*
+ * One line per virtqueue, for a script to pick up: how many buffers we
+ * handed back, how many bytes the Guest was told we used, and over how long.
+ * A net device served by vhost-net never passes through here, so it shows 0.
+ */
+static void report_bench(void)
+{
+	struct timeval now;
+	unsigned long long ns;
+	struct device *dev;
+	struct virtqueue *vq;
+	unsigned int i;
+
+	gettimeofday(&now, NULL);
+	ns = (now.tv_sec - bench_start.tv_sec) * 1000000000ULL
+		+ (now.tv_usec - bench_start.tv_usec) * 1000LL;
+	for (dev = devices.dev; dev; dev = dev->next) {
+		for (vq = dev->vq, i = 0; vq; vq = vq->next, i++)
+			fprintf(stderr, "bench dev=%s vq=%u bufs=%llu bytes=%llu"
+				" elapsed_ns=%llu\n", dev->name, i,
+				vq->used_bufs, vq->used_bytes, ns);
+	}
+}
+
 static void cleanup_devices(void)
 {
 	struct device *dev;
+	unsigned int i;
+
+	/*
+	 * The other CPUs' processes share our memory, so they share this
+	 * atexit() handler too.  If one of them exits, the SIGCHLD brings us
+	 * down (see kill_launcher()): it mustn't reset the devices under the
+	 * CPUs which are still running.
+	 */
+	if (getpid() != launcher_pid)
+		return;
+
+	if (bench)
+		report_bench();
 
 	for (dev = devices.dev; dev; dev = dev->next)
 		reset_device(dev);
 
+	/* The other CPUs go too: a restarted Guest creates them anew. */
+	for (i = 1; vcpu_pids && i < nr_vcpus; i++) {
+		if (vcpu_pids[i] > 0) {
+			kill(vcpu_pids[i], SIGTERM);
+			waitpid(vcpu_pids[i], NULL, 0);
+			vcpu_pids[i] = 0;
+		}
+	}
+
 	/* If we saved off the original terminal settings, restore them now. */
 	if (orig_term.c_lflag & (ISIG|ICANON|ECHO))
 		tcsetattr(STDIN_FILENO, TCSANOW, &orig_term);
@@ -1272,6 +1503,7 @@ static void add_virtqueue(struct device *dev, unsigned int num_descs,
 	/* Initialize the virtqueue */
 	vq->next = NULL;
 	vq->last_avail_idx = 0;
+	vq->signalled_used = 0;
 	vq->dev = dev;
 
 	/*
@@ -1280,6 +1512,7 @@ static void add_virtqueue(struct device *dev, unsigned int num_descs,
 	 */
 	vq->service = service;
 	vq->thread = (pid_t)-1;
+	vq->irqfd = -1;
 
 	/* Initialize the configuration. */
 	vq->config.num = num_descs;
@@ -1364,6 +1597,8 @@ static struct device *new_device(const char *name, u16 type)
 	dev->feature_len = 0;
 	dev->num_vq = 0;
 	dev->running = false;
+	dev->start = NULL;
+	dev->stop = NULL;
 
 	/*
 	 * Append to device list.  Prepending to a single-linked list is
@@ -1413,6 +1648,7 @@ static void setup_console(void)
 	 */
 	add_virtqueue(dev, VIRTQUEUE_NUM, console_input);
 	add_virtqueue(dev, VIRTQUEUE_NUM, console_output);
+	add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
 
 	verbose("device %u: console\n", ++devices.device_num);
 }
@@ -1549,6 +1785,149 @@ static int get_tun_device(char tapif[IFNAMSIZ])
  * packets into the Host as if they came in from a normal network card.  We
  * just shunt packets between the Guest and the tun device.
  */
+/*
+ * With vhost-net, the packets never come through here at all: the Host kernel
+ * takes them straight off the Guest's rings and puts them into the tun device,
+ * and the other way.  Its "call" eventfd is the vq's irqfd, so it interrupts
+ * the Guest directly; only on a Host without irqfds do we turn the calls into
+ * interrupts here.
+ */
+static void vhost_irq(struct virtqueue *vq)
+{
+	unsigned long buf[] = { LHREQ_IRQ, vq->config.irq };
+	u64 event;
+
+	if (read(vq->eventfd, &event, sizeof(event)) != sizeof(event))
+		errx(1, "vhost call read failed?");
+	if (write(lguest_fd, buf, sizeof(buf)) != 0)
+		err(1, "Triggering irq %i", vq->config.irq);
+}
+
+/* Try to open vhost-net; if the Host hasn't got it, we move packets ourselves. */
+static bool vhost_net_init(struct net_info *net_info)
+{
+	net_info->vhost_fd = open("/dev/vhost-net", O_RDWR);
+	if (net_info->vhost_fd < 0)
+		return false;
+
+	/* All our processes share our memory, so this one will do as owner. */
+	if (ioctl(net_info->vhost_fd, VHOST_SET_OWNER, NULL) != 0
+	    || ioctl(net_info->vhost_fd, VHOST_GET_FEATURES,
+		     &net_info->vhost_features) != 0) {
+		warn("vhost-net unusable");
+		close(net_info->vhost_fd);
+		net_info->vhost_fd = -1;
+		return false;
+	}
+	net_info->kick[0] = net_info->kick[1] = -1;
+	net_info->call[0] = net_info->call[1] = -1;
+	return true;
+}
+
+/*
+ * Once the Guest's driver is ready, we tell vhost-net where everything is:
+ * the Guest memory, the rings, the eventfds and the tun device.  Queue 0 is
+ * the receive queue and 1 the transmit queue, just as vhost-net expects.
+ */
+static void vhost_net_start(struct device *dev)
+{
+	struct net_info *net_info = dev->priv;
+	struct virtqueue *vq;
+	unsigned int i;
+	u64 features = 0;
+	struct {
+		struct vhost_memory mem;
+		struct vhost_memory_region region;
+	} mem;
+
+	/* vhost-net only cares about the features it does itself. */
+	for (i = 0; i < dev->feature_len; i++)
+		features |= (u64)get_feature_bits(dev)[dev->feature_len + i]
+			<< (i * 8);
+	features &= net_info->vhost_features;
+	if (ioctl(net_info->vhost_fd, VHOST_SET_FEATURES, &features) != 0)
+		err(1, "Setting vhost features");
+
+	/* Guest "physical" memory is one piece of ours. */
+	memset(&mem, 0, sizeof(mem));
+	mem.mem.nregions = 1;
+	mem.region.guest_phys_addr = PHYS_SDRAM;
+	mem.region.memory_size = guest_max;
+	mem.region.userspace_addr = (unsigned long)guest_base;
+	if (ioctl(net_info->vhost_fd, VHOST_SET_MEM_TABLE, &mem) != 0)
+		err(1, "Setting vhost memory");
+
+	for (vq = dev->vq, i = 0; vq; vq = vq->next, i++) {
+		struct vhost_vring_state state = { i, vq->config.num };
+		struct vhost_vring_addr addr;
+		struct vhost_vring_file file = { i, -1 };
+
+		if (ioctl(net_info->vhost_fd, VHOST_SET_VRING_NUM, &state) != 0)
+			err(1, "Setting vhost ring size");
+		state.num = lg_last_avail(vq);
+		if (ioctl(net_info->vhost_fd, VHOST_SET_VRING_BASE, &state) != 0)
+			err(1, "Setting vhost ring base");
+
+		memset(&addr, 0, sizeof(addr));
+		addr.index = i;
+		addr.desc_user_addr = (unsigned long)vq->vring.desc;
+		addr.avail_user_addr = (unsigned long)vq->vring.avail;
+		addr.used_user_addr = (unsigned long)vq->vring.used;
+		if (ioctl(net_info->vhost_fd, VHOST_SET_VRING_ADDR, &addr) != 0)
+			err(1, "Setting vhost ring address");
+
+		/*
+		 * We keep the eventfds across device resets: the Host has no
+		 * way of forgetting the one we attached to the Guest's notify.
+		 */
+		if (net_info->kick[i] < 0)
+			net_info->kick[i] = notify_eventfd(vq);
+		irq_eventfd(vq);
+		if (vq->irqfd >= 0)
+			net_info->call[i] = vq->irqfd;
+		else if (net_info->call[i] < 0) {
+			net_info->call[i] = eventfd(0, 0);
+			if (net_info->call[i] < 0)
+				err(1, "Creating eventfd");
+		}
+		file.fd = net_info->kick[i];
+		if (ioctl(net_info->vhost_fd, VHOST_SET_VRING_KICK, &file) != 0)
+			err(1, "Setting vhost kick");
+		file.fd = net_info->call[i];
+		if (ioctl(net_info->vhost_fd, VHOST_SET_VRING_CALL, &file) != 0)
+			err(1, "Setting vhost call");
+
+		/*
+		 * With an irqfd, vhost-net interrupts the Guest itself.
+		 * Otherwise a thread turns its calls into interrupts.
+		 */
+		if (vq->irqfd < 0) {
+			vq->eventfd = net_info->call[i];
+			vq->service = vhost_irq;
+			start_thread(vq);
+		}
+
+		file.fd = net_info->tunfd;
+		if (ioctl(net_info->vhost_fd, VHOST_NET_SET_BACKEND, &file) != 0)
+			err(1, "Setting vhost backend");
+	}
+}
+
+/* When the device is reset, vhost-net must stop using the rings. */
+static void vhost_net_stop(struct device *dev)
+{
+	struct net_info *net_info = dev->priv;
+	struct vhost_vring_file file;
+	unsigned int i;
+
+	for (i = 0; i < dev->num_vq; i++) {
+		file.index = i;
+		file.fd = -1;
+		if (ioctl(net_info->vhost_fd, VHOST_NET_SET_BACKEND, &file) != 0)
+			err(1, "Stopping vhost backend");
+	}
+}
+
 static void setup_tun_net(char *arg)
 {
 	struct device *dev;
@@ -1565,9 +1944,19 @@ static void setup_tun_net(char *arg)
 	dev = new_device("net", VIRTIO_ID_NET);
 	dev->priv = net_info;
 
-	/* Network devices need a recv and a send queue, just like console. */
-	add_virtqueue(dev, VIRTQUEUE_NUM, net_input);
-	add_virtqueue(dev, VIRTQUEUE_NUM, net_output);
+	/*
+	 * Network devices need a recv and a send queue, just like console.  If
+	 * vhost-net does the work, it needs no service threads of ours.
+	 */
+	if (vhost_net_init(net_info)) {
+		add_virtqueue(dev, VIRTQUEUE_NUM, NULL);
+		add_virtqueue(dev, VIRTQUEUE_NUM, NULL);
+		dev->start = vhost_net_start;
+		dev->stop = vhost_net_stop;
+	} else {
+		add_virtqueue(dev, VIRTQUEUE_NUM, net_input);
+		add_virtqueue(dev, VIRTQUEUE_NUM, net_output);
+	}
 
 	/*
 	 * We need a socket to perform the magic network ioctls to bring up the
@@ -1612,6 +2001,10 @@ static void setup_tun_net(char *arg)
 	add_feature(dev, VIRTIO_NET_F_HOST_ECN);
 	/* We handle indirect ring entries */
 	add_feature(dev, VIRTIO_RING_F_INDIRECT_DESC);
+	/* vhost-net has to understand event indices too, if it's doing the work */
+	if (net_info->vhost_fd < 0
+	    || (net_info->vhost_features & (1ULL << VIRTIO_RING_F_EVENT_IDX)))
+		add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
 	set_config(dev, sizeof(conf), &conf);
 
 	/* We don't need the socket any more; setup is done. */
@@ -1619,6 +2012,9 @@ static void setup_tun_net(char *arg)
 
 	devices.device_num++;
 
+	if (dev->start)
+		verbose("device %u: tun %s uses vhost-net\n",
+			devices.device_num, tapif);
 	if (bridging)
 		verbose("device %u: tun %s attached to bridge: %s\n",
 			devices.device_num, tapif, arg);
@@ -1628,6 +2024,39 @@ static void setup_tun_net(char *arg)
 }
 /*:*/
 
+/*
+ * How many requests the disk works on at once.  Each one is done by a worker
+ * of its own, so the Host can sort out the order to do them in.
+ */
+#define VBLK_WORKERS 16
+
+/* One request from the Guest, while a worker is busy with it. */
+struct vblk_req {
+	/* The descriptor it came in, and how much we wrote into it. */
+	unsigned int head, wlen;
+	/* The Guest's header, and where the status byte goes. */
+	struct virtio_blk_outhdr *out;
+	u8 *in;
+	/* The data buffers: the header and status aren't included. */
+	struct iovec iov[VIRTQUEUE_NUM];
+	unsigned int iov_num;
+};
+
+/*
+ * The workers and the requests they share with the disk's service thread.
+ * Each service thread makes its own, so a reset device starts afresh.
+ */
+struct vblk_pool {
+	/* The service thread writes request numbers here for the workers... */
+	int work[2];
+	/* ...and the workers hand them back here when they're done. */
+	int done[2];
+
+	/* The requests, and the ones not in use. */
+	struct vblk_req reqs[VIRTQUEUE_NUM];
+	unsigned int free[VIRTQUEUE_NUM], num_free;
+};
+
 /* This hangs off device->priv. */
 struct vblk_info {
 	/* The size of the file. */
@@ -1636,130 +2065,244 @@ struct vblk_info {
 	/* The file descriptor for the file. */
 	int fd;
 
+	/* The service thread which set up "pool" (see blk_request()). */
+	pid_t pool_owner;
+	struct vblk_pool *pool;
 };
 
-/*L:210
- * The Disk
- *
- * The disk only has one virtqueue, so it only has one thread.  It is really
- * simple: the Guest asks for a block number and we read or write that position
- * in the file.
- *
- * Before we serviced each virtqueue in a separate thread, that was unacceptably
- * slow: the Guest waits until the read is finished before running anything
- * else, even if it could have been doing useful work.
- *
- * We could have used async I/O, except it's reputed to suck so hard that
- * characters actually go missing from your code when you try to use it.
- */
-static void blk_request(struct virtqueue *vq)
+/* This is what a worker does with a request: the actual I/O. */
+static void blk_do_request(struct vblk_info *vblk, struct vblk_req *req)
 {
-	struct vblk_info *vblk = vq->dev->priv;
-	unsigned int head, out_num, in_num, wlen;
+	off64_t off = req->out->sector * 512;
 	int ret;
-	u8 *in;
-	struct virtio_blk_outhdr *out;
-	struct iovec iov[vq->vring.num];
-	off64_t off;
 
 	/*
-	 * Get the next request, where we normally wait.  It triggers the
-	 * interrupt to acknowledge previously serviced requests (if any).
+	 * The Guest only asks for a flush once the writes it cares about have
+	 * finished, so there's nothing to wait for: just sync the file.
 	 */
-	head = wait_for_vq_desc(vq, iov, &out_num, &in_num);
+	if (req->out->type == VIRTIO_BLK_T_FLUSH) {
+		ret = fdatasync(vblk->fd);
+		verbose("FLUSH: %i\n", ret);
+		*req->in = (ret == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+		req->wlen = sizeof(*req->in);
+	} else if (req->out->type & VIRTIO_BLK_T_OUT) {
+		ret = pwritev64(vblk->fd, req->iov, req->iov_num, off);
+		verbose("WRITE to sector %llu: %i\n", req->out->sector, ret);
+		*req->in = (ret >= 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+		req->wlen = sizeof(*req->in);
+	} else {
+		ret = preadv64(vblk->fd, req->iov, req->iov_num, off);
+		verbose("READ from sector %llu: %i\n", req->out->sector, ret);
+		if (ret >= 0) {
+			req->wlen = sizeof(*req->in) + ret;
+			*req->in = VIRTIO_BLK_S_OK;
+		} else {
+			req->wlen = sizeof(*req->in);
+			*req->in = VIRTIO_BLK_S_IOERR;
+		}
+	}
+}
 
-	/*
-	 * Every block request should contain at least one output buffer
-	 * (detailing the location on disk and the type of request) and one
-	 * input buffer (to hold the result).
-	 */
-	if (out_num == 0 || in_num == 0)
-		errx(1, "Bad virtblk cmd %u out=%u in=%u",
-		     head, out_num, in_num);
+/*
+ * A worker takes request numbers from the service thread, does them, and
+ * hands them back.  When the service thread goes away (eg. the device is
+ * reset), the pipe closes and so does the worker.
+ */
+static int blk_worker(void *_vblk)
+{
+	struct vblk_info *vblk = _vblk;
+	struct vblk_pool *pool = vblk->pool;
+	int work = pool->work[0], done = pool->done[1];
+	unsigned int idx;
+
+	/* We only need our own ends of the pipes. */
+	close(pool->work[1]);
+	close(pool->done[0]);
+
+	while (read(work, &idx, sizeof(idx)) == sizeof(idx)) {
+		blk_do_request(vblk, &pool->reqs[idx]);
+		if (write(done, &idx, sizeof(idx)) != sizeof(idx))
+			break;
+	}
+	return 0;
+}
 
-	out = convert(&iov[0], struct virtio_blk_outhdr);
-	in = convert(&iov[out_num+in_num-1], u8);
-	/*
-	 * For historical reasons, block operations are expressed in 512 byte
-	 * "sectors".
-	 */
-	off = out->sector * 512;
+/* The first time a service thread runs, it sets up its workers. */
+static void blk_start_workers(struct vblk_info *vblk)
+{
+	struct vblk_pool *pool;
+	unsigned int i;
+
+	pool = malloc(sizeof(*pool));
+	if (!pool)
+		err(1, "Allocating block requests");
+	if (pipe(pool->work) != 0 || pipe(pool->done) != 0)
+		err(1, "Creating block pipes");
+	/* We pick up finished requests whenever we come past. */
+	fcntl(pool->done[0], F_SETFL, O_NONBLOCK);
+
+	for (i = 0; i < VIRTQUEUE_NUM; i++)
+		pool->free[i] = i;
+	pool->num_free = VIRTQUEUE_NUM;
+
+	vblk->pool = pool;
+	vblk->pool_owner = getpid();
+
+	for (i = 0; i < VBLK_WORKERS; i++) {
+		/* Since the stack grows downwards, we point at its end. */
+		char *stack = malloc(32768);
+
+		if (clone(blk_worker, stack + 32768, CLONE_VM | SIGCHLD, vblk)
+		    == -1)
+			err(1, "Creating block worker");
+	}
+
+	/* Only the workers read work and write what's done. */
+	close(pool->work[0]);
+	close(pool->done[1]);
+}
+
+/* Tell the Guest about all the requests the workers have finished. */
+static void blk_reap(struct virtqueue *vq, struct vblk_pool *pool)
+{
+	unsigned int idx;
+
+	while (read(pool->done[0], &idx, sizeof(idx)) == sizeof(idx)) {
+		add_used(vq, pool->reqs[idx].head, pool->reqs[idx].wlen);
+		pool->free[pool->num_free++] = idx;
+	}
+}
+
+/*
+ * We've nothing to do: tell the Guest what's finished, then wait until it
+ * gives us more or a worker finishes something.  If all our requests are
+ * busy we don't want to hear from the Guest at all.
+ */
+static void blk_wait(struct virtqueue *vq, struct vblk_pool *pool)
+{
+	struct pollfd fds[2];
+	unsigned int nfds = 1;
+	u64 event;
+
+	trigger_irq(vq);
+
+	fds[0].fd = pool->done[0];
+	fds[0].events = POLLIN;
+	if (pool->num_free) {
+		/* Ask for notifications, and close the race like wait_for_vq_desc */
+		enable_notify(vq);
+		if (lg_last_avail(vq) != vq->vring.avail->idx) {
+			disable_notify(vq);
+			return;
+		}
+		fds[1].fd = vq->eventfd;
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	if (poll(fds, nfds, -1) < 0 && errno != EINTR)
+		err(1, "Waiting for block requests");
+
+	if (nfds == 2 && (fds[1].revents & POLLIN)) {
+		if (read(vq->eventfd, &event, sizeof(event)) != sizeof(event))
+			errx(1, "Event read failed?");
+	}
+	disable_notify(vq);
+}
+
+/*L:210
+ * The Disk
+ *
+ * The disk only has one virtqueue, so it only has one service thread.  It
+ * takes each request the Guest gives it, checks it, and hands it to one of a
+ * pool of workers which does the read or write with preadv/pwritev at the
+ * block's position in the file.  Requests finish in whatever order the Host
+ * gets them done, and we tell the Guest about them as they do.
+ *
+ * Before we serviced each virtqueue in a separate thread, that was unacceptably
+ * slow: the Guest waits until the read is finished before running anything
+ * else, even if it could have been doing useful work.  Doing one request at a
+ * time in that thread wasn't much better: the Guest can't keep the disk busy.
+ *
+ * We could have used Linux's native async I/O, except it only works
+ * asynchronously on O_DIRECT files, and we'd have to give up the Host's page
+ * cache to get it.
+ */
+static void blk_request(struct virtqueue *vq)
+{
+	struct vblk_info *vblk = vq->dev->priv;
+	struct vblk_pool *pool;
+	struct vblk_req *req;
+	unsigned int head, out_num, in_num, idx, i;
+	struct iovec iov[VIRTQUEUE_NUM];
+	off64_t off, len;
+
+	/* Our service thread is new if the device was reset. */
+	if (vblk->pool_owner != getpid())
+		blk_start_workers(vblk);
+	pool = vblk->pool;
+
+	blk_reap(vq, pool);
+
+	/* Nothing to do, or nothing to do it with? */
+	if (lg_last_avail(vq) == vq->vring.avail->idx || !pool->num_free) {
+		blk_wait(vq, pool);
+		return;
+	}
+
+	head = get_vq_desc(vq, iov, &out_num, &in_num);
 
 	/*
-	 * The block device implements "barriers", where the Guest indicates
-	 * that it wants all previous writes to occur before this write.  We
-	 * don't have a way of asking our kernel to do a barrier, so we just
-	 * synchronize all the data in the file.  Pretty poor, no?
+	 * Every block request should contain at least one output buffer
+	 * (detailing the location on disk and the type of request) and one
+	 * input buffer (to hold the result).
 	 */
-	if (out->type & VIRTIO_BLK_T_BARRIER)
-		fdatasync(vblk->fd);
+	if (out_num == 0 || in_num == 0)
+		errx(1, "Bad virtblk cmd %u out=%u in=%u",
+		     head, out_num, in_num);
+
+	idx = pool->free[--pool->num_free];
+	req = &pool->reqs[idx];
+	req->head = head;
+	req->out = convert(&iov[0], struct virtio_blk_outhdr);
+	req->in = convert(&iov[out_num+in_num-1], u8);
 
 	/*
 	 * In general the virtio block driver is allowed to try SCSI commands.
-	 * It'd be nice if we supported eject, for example, but we don't.
+	 * It'd be nice if we supported eject, for example, but we don't.  Nor
+	 * do we have an ID to give.
 	 */
-	if (out->type & VIRTIO_BLK_T_SCSI_CMD) {
-		fprintf(stderr, "Scsi commands unsupported\n");
-		*in = VIRTIO_BLK_S_UNSUPP;
-		wlen = sizeof(*in);
-	} else if (out->type & VIRTIO_BLK_T_OUT) {
-		/*
-		 * Write
-		 *
-		 * Move to the right location in the block file.  This can fail
-		 * if they try to write past end.
-		 */
-		if (lseek64(vblk->fd, off, SEEK_SET) != off)
-			err(1, "Bad seek to sector %llu", out->sector);
-
-		ret = writev(vblk->fd, iov+1, out_num-1);
-		verbose("WRITE to sector %llu: %i\n", out->sector, ret);
+	if (req->out->type & (VIRTIO_BLK_T_SCSI_CMD|VIRTIO_BLK_T_GET_ID)) {
+		*req->in = VIRTIO_BLK_S_UNSUPP;
+		add_used(vq, head, sizeof(*req->in));
+		pool->free[pool->num_free++] = idx;
+		return;
+	}
 
-		/*
-		 * Grr... Now we know how long the descriptor they sent was, we
-		 * make sure they didn't try to write over the end of the block
-		 * file (possibly extending it).
-		 */
-		if (ret > 0 && off + ret > vblk->len) {
-			/* Trim it back to the correct length */
-			ftruncate64(vblk->fd, vblk->len);
-			/* Die, bad Guest, die. */
-			errx(1, "Write past end %llu+%u", off, ret);
-		}
-		wlen = sizeof(*in);
-		*in = (ret >= 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+	/* The data is everything between the header and the status byte. */
+	if (req->out->type & VIRTIO_BLK_T_OUT) {
+		req->iov_num = out_num - 1;
+		memcpy(req->iov, iov + 1, req->iov_num * sizeof(iov[0]));
 	} else {
-		/*
-		 * Read
-		 *
-		 * Move to the right location in the block file.  This can fail
-		 * if they try to read past end.
-		 */
-		if (lseek64(vblk->fd, off, SEEK_SET) != off)
-			err(1, "Bad seek to sector %llu", out->sector);
-
-		ret = readv(vblk->fd, iov+1, in_num-1);
-		verbose("READ from sector %llu: %i\n", out->sector, ret);
-		if (ret >= 0) {
-			wlen = sizeof(*in) + ret;
-			*in = VIRTIO_BLK_S_OK;
-		} else {
-			wlen = sizeof(*in);
-			*in = VIRTIO_BLK_S_IOERR;
-		}
+		req->iov_num = in_num - 1;
+		memcpy(req->iov, iov + out_num, req->iov_num * sizeof(iov[0]));
 	}
 
 	/*
-	 * OK, so we noted that it was pretty poor to use an fdatasync as a
-	 * barrier.  But Christoph Hellwig points out that we need a sync
-	 * *afterwards* as well: "Barriers specify no reordering to the front
-	 * or the back."  And Jens Axboe confirmed it, so here we are:
+	 * For historical reasons, block operations are expressed in 512 byte
+	 * "sectors".  Reads past the end just come up short, but writes must
+	 * not extend the file: that's a fatal mistake.
 	 */
-	if (out->type & VIRTIO_BLK_T_BARRIER)
-		fdatasync(vblk->fd);
-
-	/* Finished that request. */
-	add_used(vq, head, wlen);
+	off = req->out->sector * 512;
+	for (i = 0, len = 0; i < req->iov_num; i++)
+		len += req->iov[i].iov_len;
+	if ((req->out->type & VIRTIO_BLK_T_OUT) && off + len > vblk->len)
+		errx(1, "Write past end %llu+%llu",
+		     (unsigned long long)off, (unsigned long long)len);
+
+	/* Off it goes to a worker. */
+	if (write(pool->work[1], &idx, sizeof(idx)) != sizeof(idx))
+		err(1, "Queueing block request");
 }
 
 /*L:198 This actually sets up a virtual block device. */
@@ -1774,6 +2317,7 @@ static void setup_block_file(const char *filename)
 
 	/* The device has one virtqueue, where the Guest places requests. */
 	add_virtqueue(dev, VIRTQUEUE_NUM, blk_request);
+	dev->out_of_order = true;
 
 	/* Allocate the room for our own bookkeeping */
 	vblk = dev->priv = malloc(sizeof(*vblk));
@@ -1781,9 +2325,15 @@ static void setup_block_file(const char *filename)
 	/* First we open the file and store the length. */
 	vblk->fd = open_or_die(filename, O_RDWR|O_LARGEFILE);
 	vblk->len = lseek64(vblk->fd, 0, SEEK_END);
+	vblk->pool_owner = 0;
+	vblk->pool = NULL;
 
-	/* We support barriers. */
-	add_feature(dev, VIRTIO_BLK_F_BARRIER);
+	/*
+	 * We support cache flushes.  We don't offer barriers: requests run in
+	 * any order, and a Guest which can flush doesn't need them.
+	 */
+	add_feature(dev, VIRTIO_BLK_F_FLUSH);
+	add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
 
 	/* Tell Guest how many sectors this device has. */
 	conf.capacity = cpu_to_le64(vblk->len / 512);
@@ -1802,20 +2352,53 @@ static void setup_block_file(const char *filename)
 		++devices.device_num, le64_to_cpu(conf.capacity));
 }
 
+/*
+ * /dev/rpmsg hands us one whole message per iovec segment, and the Guest's
+ * rpmsg buffers are each a single descriptor, so one readv() or writev() can
+ * move a whole batch of messages.  This is how many we try for at once.
+ */
+#define RPMSG_BATCH 32
+
+/*
+ * Grab the next buffer from the rpmsg virtqueue, which must be a single
+ * descriptor going in the direction we expect.
+ */
+static unsigned rpmsg_get_desc(struct virtqueue *vq, struct iovec *iov,
+			       bool in, bool wait)
+{
+	unsigned int head, out_num, in_num;
+	struct iovec tmp[vq->vring.num];
+
+	if (wait)
+		head = wait_for_vq_desc(vq, tmp, &out_num, &in_num);
+	else
+		head = get_vq_desc(vq, tmp, &out_num, &in_num);
+
+	if (out_num + in_num != 1 || in_num != in)
+		errx(1, "Bad rpmsg %s buffer: %u out, %u in",
+		     in ? "input" : "output", out_num, in_num);
+
+	*iov = tmp[0];
+	return head;
+}
+
 static void rpmsg_handle_rx(struct virtqueue *vq)
 {
 	int len;
 	int fd = (int)vq->dev->priv;
-	unsigned int head, in_num, out_num;
-	struct iovec iov[vq->vring.num];
+	unsigned int i, n, heads[RPMSG_BATCH];
+	struct iovec iov[RPMSG_BATCH];
 
-	/* Make sure there's a descriptor available. */
-	head = wait_for_vq_desc(vq, iov, &out_num, &in_num);
-	if (out_num)
-		errx(1, "Output buffers in rpmsg in queue?");
+	/* Make sure there's a descriptor available, then take any others. */
+	heads[0] = rpmsg_get_desc(vq, &iov[0], true, true);
+	for (n = 1; n < RPMSG_BATCH; n++) {
+		if (lg_last_avail(vq) == vq->vring.avail->idx)
+			break;
+		heads[n] = rpmsg_get_desc(vq, &iov[n], true, false);
+	}
 
-	/* Read into it.  This is where we usually wait. */
-	len = readv(fd, iov, in_num);
+	/* Read into them.  This is where we usually wait. */
+	len = readv(fd, iov, n);
 	if (len <= 0) {
 		/* Ran out of input? */
 		warnx("Failed to get rpmsg input, ignoring rpmsg.");
@@ -1827,30 +2410,57 @@ static void rpmsg_handle_rx(struct virtqueue *vq)
 			pause();
 	}
 
-	/* Tell the Guest we used a buffer. */
-	add_used_and_trigger(vq, head, len);
+	/*
+	 * Each filled buffer starts with a header saying how long its message
+	 * is, and the messages fill buffers in order.
+	 */
+	for (i = 0; i < n && len > 0; i++) {
+		struct rpmsg_hdr *hdr = iov[i].iov_base;
+		int used = sizeof(*hdr) + hdr->len;
+
+		if (used > iov[i].iov_len)
+			used = iov[i].iov_len;
+		add_used(vq, heads[i], used);
+		len -= used;
+	}
+
+	/* Hand back the buffers we didn't fill: they're next in line anyway. */
+	lg_last_avail(vq) -= n - i;
+
+	/* Tell the Guest we used some buffers. */
+	trigger_irq(vq);
 }
 
 static void rpmsg_handle_tx(struct virtqueue *vq)
 {
-	unsigned int head, out, in;
+	int len;
 	int fd = (int)vq->dev->priv;
-	struct iovec iov[vq->vring.num];
+	unsigned int i, n, heads[RPMSG_BATCH];
+	struct iovec iov[RPMSG_BATCH];
 
 	/* We usually wait in here, for the Guest to give us something. */
-	head = wait_for_vq_desc(vq, iov, &out, &in);
-	if (in)
-		errx(1, "Input buffers in rpmsg output queue?");
+	heads[0] = rpmsg_get_desc(vq, &iov[0], false, true);
+	for (n = 1; n < RPMSG_BATCH; n++) {
+		if (lg_last_avail(vq) == vq->vring.avail->idx)
+			break;
+		heads[n] = rpmsg_get_desc(vq, &iov[n], false, false);
+	}
 
-	int len = writev(fd, iov, out);
+	len = writev(fd, iov, n);
 	if (len <= 0)
 		err(1, "Write to rpmsg gave %i", len);
 
 	/*
-	 * We're finished with that buffer: if we're going to sleep,
+	 * We're finished with those buffers: if we're going to sleep,
 	 * wait_for_vq_desc() will prod the Guest with an interrupt.
 	 */
-	add_used(vq, head, 0);
+	for (i = 0; i < n && len > 0; i++) {
+		add_used(vq, heads[i], 0);
+		len -= iov[i].iov_len;
+	}
+
+	/* The rest get another try next time around. */
+	lg_last_avail(vq) -= n - i;
 }
 
 static void setup_rpmsg_dev(const char *channel)
@@ -1873,6 +2483,7 @@ static void setup_rpmsg_dev(const char *channel)
 	}
 
 	add_feature(dev, VIRTIO_RPMSG_F_NS);
+	add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
 }
 
 /*L:211
@@ -1932,11 +2543,393 @@ static void setup_rng(void)
 
 	/* The device has one virtqueue, where the Guest places inbufs. */
 	add_virtqueue(dev, VIRTQUEUE_NUM, rng_input);
+	add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
 
 	verbose("device %u: rng\n", devices.device_num++);
 }
+/*L:213
+ * The Balloon
+ *
+ * The balloon lets us take memory back from a running Guest: we set how many
+ * pages we'd like in its config, and its driver allocates that many and hands
+ * us their page numbers on the "inflate" queue.  We tell the Host kernel to
+ * stop mapping them for the Guest (LHREQ_RELEASE_PAGES), then throw them
+ * away with madvise(MADV_DONTNEED), which gives the memory back to the Host.
+ * Should the Guest want them back it puts them on the "deflate" queue, and
+ * then simply uses them: they fault in again, zero-filled.
+ *
+ * Guest devices have no "config changed" interrupt, so we use the statistics
+ * queue as a doorbell.  The Guest gives us a buffer of statistics and we hold
+ * onto it; when we want a new size, we hand the buffer back and the Guest
+ * wakes to send us fresh statistics, and notices the new size while it's at
+ * it.  The new size comes from the --balloon file, one line at a time, in
+ * megabytes to take from the Guest.
+ */
+struct balloon_info {
+	/* Where we read the sizes from. */
+	FILE *ctl;
+	/* Can the Host let go of pages for us?  (eg. not with --ram) */
+	bool release;
+};
+
+static void balloon_release(struct balloon_info *bi, u32 pfn, u32 num)
+{
+	unsigned long args[] = { LHREQ_RELEASE_PAGES, pfn, num };
+
+	if (!bi->release || !num)
+		return;
+
+	if (write(lguest_fd, args, sizeof(args)) != 0) {
+		if (errno != EINVAL && errno != EBUSY)
+			err(1, "Releasing balloon pages");
+		/* Old Host, or memory we can't give back: just keep it. */
+		verbose("balloon: can't release pages (%s)\n", strerror(errno));
+		bi->release = false;
+		return;
+	}
+	if (madvise(from_guest_phys((unsigned long)pfn << VIRTIO_BALLOON_PFN_SHIFT),
+		    (unsigned long)num << VIRTIO_BALLOON_PFN_SHIFT,
+		    MADV_DONTNEED) != 0)
+		err(1, "Discarding balloon pages");
+}
+
+static void balloon_inflate(struct virtqueue *vq)
+{
+	struct balloon_info *bi = vq->dev->priv;
+	unsigned int head, out_num, in_num, i, n, len = 0;
+	struct iovec iov[vq->vring.num];
+	u32 pfn, start = 0, num = 0;
+
+	head = wait_for_vq_desc(vq, iov, &out_num, &in_num);
+	if (in_num)
+		errx(1, "Input buffers in balloon?");
+
+	/* The Guest's pages are often in a row: release them in runs. */
+	for (i = 0; i < out_num; i++) {
+		for (n = 0; n + sizeof(pfn) <= iov[i].iov_len; n += sizeof(pfn)) {
+			memcpy(&pfn, iov[i].iov_base + n, sizeof(pfn));
+			if ((unsigned long)pfn << VIRTIO_BALLOON_PFN_SHIFT
+			    < PHYS_SDRAM
+			    || ((unsigned long)pfn << VIRTIO_BALLOON_PFN_SHIFT)
+			       - PHYS_SDRAM >= guest_limit)
+				errx(1, "Balloon page %#lx out of range",
+				     (unsigned long)pfn);
+			if (num && pfn == start + num) {
+				num++;
+				continue;
+			}
+			balloon_release(bi, start, num);
+			start = pfn;
+			num = 1;
+		}
+		len += iov[i].iov_len;
+	}
+	balloon_release(bi, start, num);
+
+	add_used(vq, head, len);
+}
+
+/* Pages come back by themselves: the Guest just tells us it has them. */
+static void balloon_deflate(struct virtqueue *vq)
+{
+	unsigned int head, out_num, in_num;
+	struct iovec iov[vq->vring.num];
+
+	head = wait_for_vq_desc(vq, iov, &out_num, &in_num);
+	add_used(vq, head, 0);
+}
+
+static void balloon_stats(struct virtqueue *vq)
+{
+	struct balloon_info *bi = vq->dev->priv;
+	struct virtio_balloon_config *conf = (void *)device_config(vq->dev);
+	struct virtio_balloon_stat stat;
+	unsigned int head, out_num, in_num, i, n;
+	struct iovec iov[vq->vring.num];
+	char line[32];
+
+	head = wait_for_vq_desc(vq, iov, &out_num, &in_num);
+	for (i = 0; i < out_num; i++) {
+		for (n = 0; n + sizeof(stat) <= iov[i].iov_len; n += sizeof(stat)) {
+			memcpy(&stat, iov[i].iov_base + n, sizeof(stat));
+			verbose("balloon: stat %u = %llu\n", stat.tag,
+				(unsigned long long)stat.val);
+		}
+	}
+	verbose("balloon: %u pages\n", le32_to_cpu(conf->actual));
+
+	/* Wait until they want a new size. */
+	if (!fgets(line, sizeof(line), bi->ctl))
+		errx(1, "Reading balloon size");
+	conf->num_pages = cpu_to_le32(strtoul(line, NULL, 0) * 1024 * 1024
+				      >> VIRTIO_BALLOON_PFN_SHIFT);
+
+	/* Ring the doorbell: wait_for_vq_desc() will send the interrupt. */
+	add_used(vq, head, 0);
+}
+
+/*L:212
+ * This creates the balloon device.  The size file is usually a named pipe:
+ * we open it read-write so it never reaches end-of-file when a writer goes.
+ */
+static void setup_balloon(const char *ctlname)
+{
+	struct device *dev;
+	struct balloon_info *bi = malloc(sizeof(*bi));
+	struct virtio_balloon_config conf;
+
+	bi->ctl = fdopen(open_or_die(ctlname, O_RDWR), "r");
+	if (!bi->ctl)
+		err(1, "Opening %s", ctlname);
+	bi->release = true;
+
+	dev = new_device("balloon", VIRTIO_ID_BALLOON);
+	dev->priv = bi;
+
+	add_virtqueue(dev, VIRTQUEUE_NUM, balloon_inflate);
+	add_virtqueue(dev, VIRTQUEUE_NUM, balloon_deflate);
+	add_virtqueue(dev, VIRTQUEUE_NUM, balloon_stats);
+
+	/* We must hear about pages before the Guest uses them again. */
+	add_feature(dev, VIRTIO_BALLOON_F_MUST_TELL_HOST);
+	add_feature(dev, VIRTIO_BALLOON_F_STATS_VQ);
+	add_feature(dev, VIRTIO_RING_F_EVENT_IDX);
+
+	/* The Guest keeps all its memory to start with. */
+	memset(&conf, 0, sizeof(conf));
+	set_config(dev, sizeof(conf), &conf);
+
+	verbose("device %u: balloon\n", ++devices.device_num);
+}
+
 /* That's the end of device setup. */
 
+/*L:225
+ * Snapshots
+ *
+ * Booting a Guest takes a while, so we can save one which is up and running
+ * and start it again later, in a fraction of the time.  With --save=<file>,
+ * SIGUSR1 makes us write the Guest to <file> and exit; --restore=<file>
+ * starts a Guest from it instead of the kernel.  It must have the same memory
+ * and devices (ie. command line) as when it was saved.
+ *
+ * The file is a header, the Host's state for the CPU, the Guest's exception
+ * vectors, and then all of Guest memory including the device pages, page
+ * aligned so it can be mapped straight back in.
+ */
+#define SNAPSHOT_MAGIC		"lguest-arm-snapshot-1"
+#define SNAPSHOT_CPU_OFFSET	4096
+#define SNAPSHOT_CPU_MAX	16384
+#define SNAPSHOT_VECTORS_OFFSET	(SNAPSHOT_CPU_OFFSET + SNAPSHOT_CPU_MAX)
+#define SNAPSHOT_MEM_OFFSET	(SNAPSHOT_VECTORS_OFFSET + LG_VECTOR_SIZE)
+#define SNAPSHOT_MAX_VQS	256
+
+struct snapshot_header {
+	char magic[32];
+	u64 mem;
+	u64 guest_limit;
+	/* The kernel entry point, which LHREQ_INITIALIZE still wants. */
+	u64 start;
+	u32 cpu_len;
+	u32 num_vqs;
+	struct {
+		u16 last_avail_idx;
+		u16 signalled_used;
+	} vqs[SNAPSHOT_MAX_VQS];
+};
+
+static const char *snapshot_name;
+static volatile sig_atomic_t snapshot_wanted;
+static unsigned long kernel_start;
+
+static void want_snapshot(int signal)
+{
+	snapshot_wanted = 1;
+}
+
+static void write_or_die(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t r;
+
+	while (len) {
+		r = pwrite(fd, buf, len, off);
+		if (r <= 0)
+			err(1, "Writing snapshot %s", snapshot_name);
+		buf += r;
+		len -= r;
+		off += r;
+	}
+}
+
+/*
+ * Our device threads keep running while the Guest is stopped, so before
+ * saving we stop them.  Most devices finish buffers in the order they take
+ * them, so any they've taken and not finished can simply be taken again
+ * after a restore.  The block device finishes them in any order, so we wait
+ * for it to finish them all first: with the Guest stopped, it soon does.
+ */
+static void stop_devices_for_snapshot(void)
+{
+	struct device *dev;
+	struct virtqueue *vq;
+	unsigned int tries;
+
+	for (dev = devices.dev; dev; dev = dev->next) {
+		if (!dev->running || !dev->out_of_order)
+			continue;
+		for (vq = dev->vq; vq; vq = vq->next) {
+			for (tries = 0; vq->vring.used->idx != lg_last_avail(vq);
+			     tries++) {
+				if (tries == 10000)
+					errx(1, "%s won't go idle", dev->name);
+				usleep(1000);
+			}
+		}
+	}
+
+	/* We don't care if threads die now: we're killing them. */
+	signal(SIGCHLD, SIG_IGN);
+	for (dev = devices.dev; dev; dev = dev->next) {
+		if (dev->running && dev->stop)
+			dev->stop(dev);
+		for (vq = dev->vq; vq; vq = vq->next) {
+			if (vq->thread != (pid_t)-1) {
+				kill(vq->thread, SIGTERM);
+				waitpid(vq->thread, NULL, 0);
+				vq->thread = (pid_t)-1;
+			}
+		}
+	}
+}
+
+static void __attribute__((noreturn)) save_snapshot(unsigned long mem)
+{
+	struct snapshot_header *hdr = calloc(1, sizeof(*hdr));
+	char *state = malloc(SNAPSHOT_CPU_MAX);
+	unsigned long args[] = { LHREQ_SAVECPU,
+				 (unsigned long)state, SNAPSHOT_CPU_MAX };
+	struct device *dev;
+	struct virtqueue *vq;
+	int fd, len;
+
+	stop_devices_for_snapshot();
+
+	strcpy(hdr->magic, SNAPSHOT_MAGIC);
+	hdr->mem = mem;
+	hdr->guest_limit = guest_limit;
+	hdr->start = kernel_start;
+	for (dev = devices.dev; dev; dev = dev->next) {
+		for (vq = dev->vq; vq; vq = vq->next) {
+			if (hdr->num_vqs == SNAPSHOT_MAX_VQS)
+				errx(1, "Too many virtqueues to snapshot");
+			hdr->vqs[hdr->num_vqs].last_avail_idx
+				= vq->vring.used->idx;
+			hdr->vqs[hdr->num_vqs].signalled_used
+				= vq->signalled_used;
+			hdr->num_vqs++;
+		}
+	}
+
+	len = write(lguest_fd, args, sizeof(args));
+	if (len < 0)
+		err(1, "Saving CPU state");
+	hdr->cpu_len = len;
+
+	fd = open(snapshot_name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0)
+		err(1, "Creating snapshot %s", snapshot_name);
+	write_or_die(fd, hdr, sizeof(*hdr), 0);
+	write_or_die(fd, state, len, SNAPSHOT_CPU_OFFSET);
+	write_or_die(fd, lguest_vectors, LG_VECTOR_SIZE,
+		     SNAPSHOT_VECTORS_OFFSET);
+	write_or_die(fd, guest_base, guest_limit, SNAPSHOT_MEM_OFFSET);
+	if (fsync(fd) != 0 || close(fd) != 0)
+		err(1, "Writing snapshot %s", snapshot_name);
+
+	verbose("Saved Guest to %s\n", snapshot_name);
+	exit(0);
+}
+
+/*
+ * Restoring maps Guest memory from the file, so pages come in as the Guest
+ * touches them rather than all up front; they're private, so the file is
+ * never changed and any number of Guests can start from it.
+ *
+ * The Host still sets up a new Guest from its boot parameters, and writes
+ * the kernel's initial page table while it's at it.  The Guest has long since
+ * moved on from both, so we put them in for the Host and then put back what
+ * the Guest had there.
+ */
+static void restore_snapshot(const char *name, unsigned long mem)
+{
+	struct snapshot_header *hdr = malloc(sizeof(*hdr));
+	char *state = malloc(SNAPSHOT_CPU_MAX);
+	unsigned long args[] = { LHREQ_RESTORECPU, (unsigned long)state, 0 };
+	unsigned long boot_size = 4 * getpagesize();
+	char *boot_page, *boot_pgd, *saved;
+	struct device *dev;
+	struct virtqueue *vq;
+	unsigned int i = 0;
+	int fd;
+
+	fd = open_or_die(name, O_RDONLY);
+	if (pread(fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr)
+	    || strcmp(hdr->magic, SNAPSHOT_MAGIC) != 0)
+		errx(1, "%s is not a snapshot", name);
+	if (hdr->mem != mem || hdr->guest_limit != guest_limit)
+		errx(1, "%s was saved with different memory or devices", name);
+	if (hdr->cpu_len > SNAPSHOT_CPU_MAX
+	    || pread(fd, state, hdr->cpu_len, SNAPSHOT_CPU_OFFSET)
+	       != hdr->cpu_len
+	    || pread(fd, lguest_vectors, LG_VECTOR_SIZE,
+		     SNAPSHOT_VECTORS_OFFSET) != LG_VECTOR_SIZE)
+		errx(1, "%s is truncated", name);
+
+	if (mmap(guest_base, guest_limit, PROT_READ|PROT_WRITE|PROT_EXEC,
+		 MAP_PRIVATE|MAP_FIXED, fd, SNAPSHOT_MEM_OFFSET) == MAP_FAILED)
+		err(1, "Mapping memory from %s", name);
+	close(fd);
+
+	/* Lend the Host some boot parameters and a page table. */
+	kernel_start = hdr->start;
+	boot_page = from_guest_phys(PHYS_SDRAM);
+	boot_pgd = from_guest_phys(kernel_start - PADDR_VADDR_OFF - boot_size);
+	saved = malloc(getpagesize() + boot_size);
+	memcpy(saved, boot_page, getpagesize());
+	memcpy(saved + getpagesize(), boot_pgd, boot_size);
+
+	memset(&lguest_tags, 0, sizeof(lguest_tags));
+	lguest_tags.tags_addr = from_guest_phys(BOOT_PARAMS);
+	lguest_tags.mem.flag = 1;
+	lguest_tags.mem.mem.start = PHYS_SDRAM;
+	lguest_tags.mem.mem.size = mem;
+	lguest_setup_tags(&lguest_tags);
+
+	tell_kernel(kernel_start);
+
+	memcpy(boot_page, saved, getpagesize());
+	memcpy(boot_pgd, saved + getpagesize(), boot_size);
+	free(saved);
+
+	args[2] = hdr->cpu_len;
+	if (write(lguest_fd, args, sizeof(args)) != 0)
+		err(1, "Restoring CPU state");
+
+	/* The devices pick up where they were, if the Guest had started them. */
+	for (dev = devices.dev; dev; dev = dev->next) {
+		for (vq = dev->vq; vq; vq = vq->next, i++) {
+			if (i == hdr->num_vqs)
+				errx(1, "%s has too few virtqueues", name);
+			lg_last_avail(vq) = hdr->vqs[i].last_avail_idx;
+			vq->signalled_used = hdr->vqs[i].signalled_used;
+		}
+		if (dev->desc->status & VIRTIO_CONFIG_S_DRIVER_OK)
+			start_device(dev);
+	}
+
+	verbose("Restored Guest from %s\n", name);
+}
+
 /*L:230 Reboot is pretty easy: clean up and exec() the Launcher afresh. */
 static void __attribute__((noreturn)) restart_guest(void)
 {
@@ -1958,9 +2951,13 @@ static void __attribute__((noreturn)) restart_guest(void)
 
 /*L:220
  * Finally we reach the core of the Launcher which runs the Guest, serves
- * its input and output, and finally, lays it to rest.
+ * its input and output, and finally, lays it to rest.  Each CPU of the
+ * Guest is run by its own process: the offset we read at says which one.
  */
-static void __attribute__((noreturn)) run_guest(void)
+static void __attribute__((noreturn)) vcpu_failed(unsigned int cpu,
+						   const char *what);
+
+static void __attribute__((noreturn)) run_guest(unsigned int cpu)
 {
 	for (;;) {
 		unsigned long notify_addr;
@@ -1968,21 +2965,34 @@ static void __attribute__((noreturn)) run_guest(void)
 
 		/* We read from the /dev/lguest device to run the Guest. */
 		readval = pread(lguest_fd, &notify_addr,
-				sizeof(notify_addr), cpu_id);
+				sizeof(notify_addr), cpu);
 
 		/* One unsigned long means the Guest did HCALL_NOTIFY */
 		if (readval == sizeof(notify_addr)) {
 			verbose("Notify on address %#lx\n", notify_addr);
 			handle_output(notify_addr);
+		/*
+		 * If the Guest died or wants a reboot, CPU 0 sees it too and
+		 * deals with it; the others just wait to be killed.
+		 */
+		} else if (cpu != 0 && (errno == ENOENT || errno == ERESTART)) {
+			for (;;)
+				pause();
 		/* ENOENT means the Guest died.  Reading tells us why. */
 		} else if (errno == ENOENT) {
 			char reason[1024] = { 0 };
-			pread(lguest_fd, reason, sizeof(reason)-1, cpu_id);
+			pread(lguest_fd, reason, sizeof(reason)-1, cpu);
 			errx(1, "%s", reason);
 		/* ERESTART means that we need to reboot the guest */
 		} else if (errno == ERESTART) {
 			restart_guest();
+		/* A signal: SIGUSR1 asks us to save the Guest. */
+		} else if (errno == EINTR) {
+			if (snapshot_wanted)
+				save_snapshot(lguest_tags.mem.mem.size);
 		/* Anything else means a bug or incompatible change. */
+		} else if (cpu != 0) {
+			vcpu_failed(cpu, "Running guest failed");
 		} else
 			err(1, "Running guest failed");
 	}
@@ -1996,6 +3006,63 @@ static void __attribute__((noreturn)) run_guest(void)
  * "make Host".
 :*/
 
+/*L:230
+ * An SMP Guest needs a process for each of its other CPUs.  Each one tells
+ * the kernel about its CPU itself, because the kernel remembers which task
+ * runs each CPU.  We start them one at a time, in order, and all before the
+ * Guest runs: it counts its CPUs as soon as it boots.
+ *
+ * If one fails, it just goes with _exit(): exit() would flush our shared
+ * stdio buffers a second time.  The main Launcher gets the SIGCHLD.
+ */
+static void __attribute__((noreturn)) vcpu_failed(unsigned int cpu,
+						   const char *what)
+{
+	warn("cpu %u: %s", cpu, what);
+	_exit(1);
+}
+
+static int do_vcpu(void *arg)
+{
+	unsigned int cpu = (unsigned long)arg;
+	unsigned long args[] = { LHREQ_NEWCPU };
+
+	if (pwrite(lguest_fd, args, sizeof(args), cpu) < 0)
+		vcpu_failed(cpu, "Adding cpu");
+
+	/* Tell the main Launcher we're in, so it can add the next one. */
+	write(vcpu_ready[1], "", 1);
+	run_guest(cpu);
+}
+
+static void start_vcpus(void)
+{
+	unsigned int i;
+	char c;
+
+	vcpu_pids = calloc(nr_vcpus, sizeof(*vcpu_pids));
+	if (!vcpu_pids)
+		err(1, "Allocating cpu list");
+	if (pipe(vcpu_ready) != 0)
+		err(1, "Creating pipe for cpus");
+
+	for (i = 1; i < nr_vcpus; i++) {
+		/* Since the stack grows downwards, we point at its end. */
+		char *stack = malloc(32768);
+
+		if (!stack)
+			err(1, "Allocating stack for cpu %u", i);
+		vcpu_pids[i] = clone(do_vcpu, stack + 32768,
+				     CLONE_VM | SIGCHLD, (void *)(unsigned long)i);
+		if (vcpu_pids[i] == (pid_t)-1)
+			err(1, "Creating clone for cpu %u", i);
+		if (read(vcpu_ready[0], &c, 1) != 1)
+			errx(1, "cpu %u failed to start", i);
+	}
+	close(vcpu_ready[0]);
+	close(vcpu_ready[1]);
+}
+
 static struct option opts[] = {
 	{ "verbose", 0, NULL, 'v' },
 	{ "tunnet", 1, NULL, 't' },
@@ -2003,13 +3070,22 @@ static struct option opts[] = {
 	{ "rng", 0, NULL, 'r' },
 	{ "rpmsg", 1, NULL, 'm' },
 	{ "initrd", 1, NULL, 'i' },
+	{ "ram", 1, NULL, 'R' },
+	{ "cpus", 1, NULL, 'c' },
+	{ "balloon", 1, NULL, 'B' },
+	{ "ksm", 0, NULL, 'k' },
+	{ "save", 1, NULL, 's' },
+	{ "restore", 1, NULL, 'S' },
+	{ "bench", 0, NULL, 'T' },
 	{ NULL },
 };
 static void usage(void)
 {
 	errx(1, "Usage: lguest [--verbose] "
 	     "[--tunnet=(<ipaddr>:<macaddr>|bridge:<bridgename>:<macaddr>)\n"
-	     "|--block=<filename>|--initrd=<filename>|...\n"
+	     "|--block=<filename>|--initrd=<filename>|--ram=<filename>\n"
+	     "|--cpus=<n>|--balloon=<sizefile>|--ksm\n"
+	     "|--save=<snapshot>|--restore=<snapshot>|--bench|...\n"
 	     "<mem-in-mb> vmlinux [args...]");
 }
 
@@ -2024,9 +3100,16 @@ int main(int argc, char *argv[])
 	int i, c;
 	/* If they specify an initrd file to load. */
 	const char *initrd_name = NULL;
+	/* If they want Guest memory backed by a file. */
+	const char *ram_name = NULL;
+	/* If they want the Host to merge identical Guest pages. */
+	bool ksm = false;
+	/* If they want to start from a snapshot rather than boot. */
+	const char *restore_name = NULL;
 	
 	/* Save the args: we "reboot" by execing ourselves again. */
 	main_args = argv;
+	launcher_pid = getpid();
 
 	/*
 	 * First we initialize the device list.  We keep a pointer to the last
@@ -2036,33 +3119,42 @@ int main(int argc, char *argv[])
 	devices.lastdev = NULL;
 	devices.next_irq = 1;
 
-	/* We're CPU 0.  In fact, that's the only CPU possible right now. */
-	cpu_id = 0;
-
 	/*
 	 * We need to know how much memory so we can set up the device
 	 * descriptor and memory pages for the devices as we parse the command
 	 * line.  So we quickly look through the arguments to find the amount
-	 * of memory now.
+	 * of memory now.  We let getopt_long() do the looking, so "--ram file"
+	 * is understood as well as "--ram=file": it moves the arguments which
+	 * aren't options to the end, leaving the memory size at argv[optind].
 	 */
-	for (i = 1; i < argc; i++) {
-		if (argv[i][0] != '-') {
-			mem = atoi(argv[i]) * 1024 * 1024;
-			/*
-			 * We start by mapping anonymous pages over all of
-			 * guest-physical memory range.  This fills it with 0,
-			 * and ensures that the Guest won't be killed when it
-			 * tries to access it.
-			 */
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "v", opts, NULL)) != EOF) {
+		if (c == 'R')
+			ram_name = optarg;
+	}
+	opterr = 1;
+
+	if (optind < argc) {
+		mem = atoi(argv[optind]) * 1024 * 1024;
+		/*
+		 * We start by mapping anonymous pages over all of
+		 * guest-physical memory range.  This fills it with 0,
+		 * and ensures that the Guest won't be killed when it
+		 * tries to access it.
+		 */
+		if (ram_name)
+			guest_base = map_guest_ram(ram_name, mem);
+		else
 			guest_base = map_zeroed_pages(mem / getpagesize()
 						      + DEVICE_PAGES);
-			guest_limit = mem;
-			guest_max = mem + DEVICE_PAGES*getpagesize();
-			devices.descpage = get_pages(1);
-			break;
-		}
+		guest_limit = mem;
+		guest_max = mem + DEVICE_PAGES*getpagesize();
+		devices.descpage = get_pages(1);
 	}
 
+	/* Zero tells glibc's getopt to start again from scratch. */
+	optind = 0;
+
 	/* The options are fairly straight-forward */
 	while ((c = getopt_long(argc, argv, "v", opts, NULL)) != EOF) {
 		switch (c) {
@@ -2084,6 +3176,29 @@ int main(int argc, char *argv[])
 		case 'i':
 			initrd_name = optarg;
 			break;
+		case 'R':
+			/* We already mapped it, above. */
+			break;
+		case 'c':
+			nr_vcpus = atoi(optarg);
+			if (nr_vcpus < 1)
+				errx(1, "--cpus must be at least 1");
+			break;
+		case 'B':
+			setup_balloon(optarg);
+			break;
+		case 'k':
+			ksm = true;
+			break;
+		case 's':
+			snapshot_name = optarg;
+			break;
+		case 'S':
+			restore_name = optarg;
+			break;
+		case 'T':
+			bench = true;
+			break;
 		default:
 			warnx("Unknown argument %s", argv[optind]);
 			usage();
@@ -2098,12 +3213,48 @@ int main(int argc, char *argv[])
 
 	verbose("Guest base is at %p\n", guest_base);
 
+	/*
+	 * Identical Guests have a lot of identical pages: KSM can share them
+	 * between Guests if we ask.  It only works for our own anonymous
+	 * memory, not a --ram file.
+	 */
+	if (ksm) {
+		if (ram_name)
+			errx(1, "--ksm doesn't work with --ram");
+		if (madvise(guest_base, mem, MADV_MERGEABLE) != 0)
+			err(1, "Marking Guest memory mergeable");
+	}
+
+	/*
+	 * SIGUSR1 only stops the first vCPU: the others would carry on
+	 * changing the Guest while we copied it.
+	 */
+	if ((snapshot_name || restore_name) && nr_vcpus > 1)
+		errx(1, "--save and --restore only work with --cpus=1");
+
 	/* We always have a console device */
 	setup_console();
 
+	/*
+	 * SIGUSR1 saves the Guest.  It must interrupt the read() which runs
+	 * the Guest, so no SA_RESTART.
+	 */
+	if (snapshot_name) {
+		struct sigaction act;
+
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = want_snapshot;
+		sigaction(SIGUSR1, &act, NULL);
+	}
+
+	if (restore_name) {
+		restore_snapshot(restore_name, mem);
+		goto run;
+	}
 
 	/* Now we load the kernel */
 	start = load_kernel(open_or_die(argv[optind+1], O_RDONLY));
+	kernel_start = start;
 
 	/* We create and initialise the kernel tagged list here. */
 	lguest_tags.tags_addr = from_guest_phys(BOOT_PARAMS);
@@ -2141,14 +3292,20 @@ int main(int argc, char *argv[])
 	 */
 	tell_kernel(start);
 
+run:
 	/* Ensure that we terminate if a device-servicing child dies. */
 	signal(SIGCHLD, kill_launcher);
 
 	/* If we exit via err(), this kills all the threads, restores tty. */
 	atexit(cleanup_devices);
 
+	/* The other CPUs wait in the kernel until the Guest starts them. */
+	start_vcpus();
+
+	gettimeofday(&bench_start, NULL);
+
 	/* Finally, run the Guest.  This doesn't return. */
-	run_guest();
+	run_guest(0);
 }
 /*:*/
 
@@ -9,6 +9,8 @@
 #define RET_IRQ		    0x18
 
 #define GUEST_KERNEL_START (CONFIG_VECTORS_BASE + 0x20)
+/* Where a secondary CPU of an SMP Guest starts: see lguest_secondary_start. */
+#define GUEST_SECONDARY_START (CONFIG_VECTORS_BASE + 0x24)
 
 /*
  * It seems to be safe to select 0xfff1ffff as the Guest's 
@@ -33,6 +35,14 @@
 
 #define SWITCHER_TOTAL_SIZE (1 << 21)
 
+/*
+ * Each CPU of the Guest also sees its own register page here, at the top of
+ * the Switcher's 2M: unlike the per-Host-CPU pages, this is at the same
+ * address whichever Host CPU it runs on, so "lguest_page_base" is a plain
+ * global in the Guest even when it is SMP.
+ */
+#define LGUEST_REGS_ALIAS	(SWITCHER_TOTAL_SIZE - 0x1000)
+
 
 
 
@@ -62,6 +72,22 @@ struct exception_stack {
 
  
 
+/*
+ * The paravirtual clock, in the style of kvmclock.  Each time a CPU of the
+ * Guest is about to run, the Host stamps its page with the monotonic time,
+ * and the Guest tells the time from that with no exit at all.  The Guest
+ * kernel runs in USR mode, where it can't read the cycle counter, so the
+ * clock only moves when the Host stamps it; the timer below makes sure that
+ * happens at least as often as the Guest needs.
+ *
+ * "version" is odd while the Host is in the middle of an update.
+ */
+struct lguest_clock {
+	u32 version;
+	u32 reserved;
+	u64 system_time;
+};
+
 struct lguest_regs {
 	struct pt_regs gregs;
 	unsigned long guest_pgd0;
@@ -77,16 +103,38 @@ struct lguest_regs {
 	unsigned long guest_cpuid_cachetype;
 	unsigned long guest_cpuid_tcm;
 	unsigned long guest_cpuid_tlbtype;
-	struct timespec guest_time;
+	struct lguest_clock clock;
+	/*
+	 * When the Guest wants its next timer interrupt, in lguest_clock
+	 * nanoseconds (0 for never), and the deadline the Host currently has
+	 * a timer running for (0 for none).  See guest_set_clockevent().
+	 */
+	u64 timer_deadline;
+	u64 timer_armed;
 	int guest_cpu_arch;
 	unsigned long gpgdir;
-	unsigned long irq_pending;
 	unsigned long irq_disabled;
+	/* The Guest kernel stack to use when we trap from Guest user mode. */
+	unsigned long guest_ksp;
+	/* How many CPUs the Launcher gave us: only meaningful on CPU 0. */
+	unsigned long guest_nr_cpus;
+	/* IPIs other CPUs sent us; LGUEST_IPI_IRQ says to look here. */
+	unsigned long ipis_pending;
 	DECLARE_BITMAP(irqs_pending, LGUEST_IRQS);
 	DECLARE_BITMAP(blocked_interrupts, LGUEST_IRQS);
 
 	/*undef, abt and irq stacks of guest*/
 	struct exception_stack guest_estack;
+
+	/*
+	 * The hypercall ring.  The Guest fills hcalls[] and moves hcall_prod
+	 * on; the Host runs them and moves hcall_cons on.  Both just count up,
+	 * and an entry lives at its count modulo hcall_ring_size.  The ring is
+	 * full when they are hcall_ring_size apart, and the Guest exits then.
+	 */
+	u32 hcall_prod;
+	u32 hcall_cons;
+	u32 hcall_ring_size;
 	struct hcall_args hcalls[LHCALL_RING_SIZE];
 } __attribute__((__aligned__(L1_CACHE_BYTES)));
 
@@ -108,6 +156,22 @@ struct lguest_ro_state {
 	unsigned long host_usrstack;
 };
 
+/*
+ * The Host sets bits in irqs_pending directly, whether or not the Guest has
+ * interrupts enabled; the Guest sets bits in blocked_interrupts for the lines
+ * it has masked.  Both sides can tell whether there's anything to deliver
+ * without asking the other.
+ */
+static inline bool lguest_irq_deliverable(const struct lguest_regs *regs)
+{
+	unsigned int i;
+
+	for (i = 0; i < BITS_TO_LONGS(LGUEST_IRQS); i++)
+		if (regs->irqs_pending[i] & ~regs->blocked_interrupts[i])
+			return true;
+	return false;
+}
+
 struct lg_cpu_arch {
 	/* The address of the last guest-visible pagefault (ie. cr2). */
 	unsigned long last_pagefault;
@@ -12,6 +12,10 @@
 #define LHCALL_HALT                 (HYPERCALL_START + 3)
 #define LHCALL_IDLE                 (HYPERCALL_START + 4)      
 #define LHCALL_GUEST_BUSY_WAIT      (HYPERCALL_START + 5)  
+#define LHCALL_FLUSH_ASYNC          (HYPERCALL_START + 6)
+#define LHCALL_SEND_IPI             (HYPERCALL_START + 7)
+#define LHCALL_CPU_UP               (HYPERCALL_START + 8)
+#define LHCALL_BLOCK_IRQ            (HYPERCALL_START + 9)
 #define LGUEST_SHUTDOWN_POWEROFF    1
 #define LGUEST_SHUTDOWN_RESTART     2
 
@@ -59,6 +63,7 @@
 #define LHCALL_COPY_PMD         (HYPERCALL_START + 57)
 #define LHCALL_PMD_CLEAR        (HYPERCALL_START + 58)
 #define LHCALL_SET_PTE_EXT		(HYPERCALL_START + 59)
+#define LHCALL_SET_PTE_RANGE	(HYPERCALL_START + 60)
 
 
 
@@ -74,9 +79,27 @@ static inline void lguest_hypercall(void)
 		:"i"(HYPERCALL_NUMBER) :"cc");             
 }
 
-#define LGUEST_IRQS (NR_IRQS < 32 ? NR_IRQS: 32)
-
+/*
+ * The number of virtual interrupt lines.  This sizes the bitmaps shared in
+ * struct lguest_regs, so it must not depend on the Host's or the Guest's
+ * NR_IRQS.
+ */
+#define LGUEST_IRQS 128
+
+/* The last line carries inter-processor interrupts for SMP Guests. */
+#define LGUEST_IPI_IRQ (LGUEST_IRQS - 1)
+
+/*
+ * The most lazy hypercalls the Guest can queue before it must exit.  The Host
+ * puts its own size in "hcall_ring_size" and a Guest built with a smaller
+ * ring lowers it, so both sides only need the same struct lguest_regs up to
+ * the ring.
+ */
+#ifdef CONFIG_ARM_LGUEST_HCALL_RING_ORDER
+#define LHCALL_RING_SIZE (1 << CONFIG_ARM_LGUEST_HCALL_RING_ORDER)
+#else
 #define LHCALL_RING_SIZE 64
+#endif
 struct hcall_args {
 	unsigned long arg0, arg1, arg2, arg3, arg4;
 };
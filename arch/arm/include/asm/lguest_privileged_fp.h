@@ -3,6 +3,7 @@
 
 
 
+#include <linux/percpu.h>
 #include <asm/page.h>
 struct page;
 struct thread_struct;
@@ -85,12 +86,15 @@ extern struct avm_mmu_ops avm_mmu_ops;
 
 
 
-/* In the future, We may implement lazy mode. */
+/* AVM_LAZY_MMU is set between arch_enter/leave_lazy_mmu_mode(). */
 enum avm_lazy_mode {
 	AVM_LAZY_NONE,
 	AVM_LAZY_CPU,
+	AVM_LAZY_MMU,
 };
 
+DECLARE_PER_CPU(enum avm_lazy_mode, avm_lazy_mode);
+
 enum avm_lazy_mode avm_get_lazy_mode(void);
 
 #endif  //_ASM_LGUEST_PRIVILEGED_FP_H
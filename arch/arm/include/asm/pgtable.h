@@ -341,6 +341,26 @@ static inline pte_t pte_modify(pte_t pte, pgprot_t newprot)
 /* FIXME: this is not correct */
 #define kern_addr_valid(addr)	(1)
 
+/*
+ * Natively there is nothing to batch, but a Guest wants to gather up PTE
+ * updates made between these two and hand them to the Host in one go.
+ */
+#define __HAVE_ARCH_ENTER_LAZY_MMU_MODE
+static inline void LGUEST_NATIVE(arch_enter_lazy_mmu_mode) (void)
+{
+}
+lguest_define_hook(arch_enter_lazy_mmu_mode);
+
+static inline void LGUEST_NATIVE(arch_leave_lazy_mmu_mode) (void)
+{
+}
+lguest_define_hook(arch_leave_lazy_mmu_mode);
+
+static inline void LGUEST_NATIVE(arch_flush_lazy_mmu_mode) (void)
+{
+}
+lguest_define_hook(arch_flush_lazy_mmu_mode);
+
 #include <asm-generic/pgtable.h>
 
 /*
@@ -176,12 +176,12 @@ int main(void)
   DEFINE(LGUEST_PAGES_guest_retcode, offsetof(struct lguest_pages, regs.guest_retcode));
   DEFINE(LGUEST_PAGES_guest_copro, offsetof(struct lguest_pages, regs.guest_copro));
   DEFINE(LGUEST_PAGES_guest_ctrl, offsetof(struct lguest_pages, regs.guest_ctrl));
+  DEFINE(LGUEST_PAGES_guest_ksp, offsetof(struct lguest_pages, regs.guest_ksp));
 
   DEFINE(LGUEST_PAGES_guest_cpuid_id, offsetof(struct lguest_pages, regs.guest_cpuid_id));
   DEFINE(LGUEST_PAGES_guest_cpuid_cachetype, offsetof(struct lguest_pages, regs.guest_cpuid_cachetype));
   DEFINE(LGUEST_PAGES_guest_cpuid_tcm, offsetof(struct lguest_pages, regs.guest_cpuid_tcm));
   DEFINE(LGUEST_PAGES_guest_cpuid_tlbtype, offsetof(struct lguest_pages, regs.guest_cpuid_tlbtype));
-  DEFINE(LGUEST_PAGES_guest_time, offsetof(struct lguest_pages, regs.guest_time));
   DEFINE(LGUEST_PAGES_guest_irq_disabled, offsetof(struct lguest_pages, regs.irq_disabled));
   DEFINE(LGUEST_PAGES_guest_gpgdir, offsetof(struct lguest_pages, regs.gpgdir));
   DEFINE(LGUEST_PAGES_guest_cpu_arch, offsetof(struct lguest_pages, regs.guest_cpu_arch));
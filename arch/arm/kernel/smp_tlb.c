@@ -7,6 +7,7 @@
  * it under the terms of the GNU General Public License version 2 as
  * published by the Free Software Foundation.
  */
+#include <linux/module.h>
 #include <linux/preempt.h>
 #include <linux/smp.h>
 
@@ -83,6 +84,7 @@ void flush_tlb_all(void)
 	else
 		local_flush_tlb_all();
 }
+EXPORT_SYMBOL_GPL(flush_tlb_all);
 
 void flush_tlb_mm(struct mm_struct *mm)
 {
@@ -25,11 +25,14 @@
 */
 #include <linux/uaccess.h>
 #include <linux/syscalls.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
 
 
 #include <asm/page.h>
 #include <asm/pgtable.h>
 #include "../lg.h"
+#include "../trace.h"
 
 /*
  * Note: I only test the Lguest of ARM version on Omap3530. When the Guest
@@ -93,10 +96,32 @@ static void do_hcall(struct lg_cpu *cpu, struct hcall_args *args)
 			cpu->halted = 1;
 			break;
 
+		case LHCALL_SEND_IPI:
+			/* arg1 is the mask of target CPUs, arg2 which IPI. */
+			guest_send_ipi(cpu, args->arg1, args->arg2);
+			break;
+
+		case LHCALL_BLOCK_IRQ:
+			/* A secondary CPU masks (arg2 != 0) device line arg1. */
+			guest_block_irq(cpu, args->arg1, args->arg2);
+			break;
+
+		case LHCALL_CPU_UP:
+			/* Start CPU arg1 on stack arg2 and page table arg3. */
+			guest_cpu_up(cpu, args->arg1, args->arg2, args->arg3);
+			break;
+
 		case LHCALL_GUEST_BUSY_WAIT:
 			/* The Guest needs a busy wait. */
 			break;
 
+		case LHCALL_FLUSH_ASYNC:
+			/*
+			 * The Guest is leaving lazy mode: this just gets us here
+			 * to run everything it queued in the ring.
+			 */
+			break;
+
 		case LHCALL_SEND_INTERRUPTS:
 			/*
 			 * The Guest will send this hypercall When it knows that there are some 
@@ -117,6 +142,15 @@ static void do_hcall(struct lg_cpu *cpu, struct hcall_args *args)
 			guest_set_pte(cpu, args->arg1, args->arg2, __pte(args->arg3));
 			break;
 
+		case LHCALL_SET_PTE_RANGE:
+			/*
+			 * The Guest sets a run of PTEs in one PTE page; arg3 is the
+			 * Guest-physical address of the first, arg4 how many.
+			 */
+			guest_set_pte_range(cpu, args->arg1, args->arg2,
+					    args->arg3, args->arg4);
+			break;
+
 		case LHCALL_SET_PTE_EXT:
 			/*
 			 * The Guest sets a pte entry, but We do not know top level.
@@ -153,7 +187,8 @@ static void do_hcall(struct lg_cpu *cpu, struct hcall_args *args)
 			break;
 
 		case LHCALL_SET_CLOCKEVENT:
-			guest_set_clockevent(cpu, args->arg1);
+			/* The new deadline is in the Guest's register page. */
+			guest_set_clockevent(cpu, true);
 			break;
 
 		case LHCALL_SWITCH_MM:
@@ -278,52 +313,67 @@ static void do_hcall(struct lg_cpu *cpu, struct hcall_args *args)
 	}
 }
 
+/*
+ * do_hcall() with the bookkeeping: each hypercall number gets its own count
+ * and histogram in lguest_stats.c, and a tracepoint.
+ */
+static void do_hcall_accounted(struct lg_cpu *cpu, struct hcall_args *args)
+{
+	u64 start = local_clock();
+
+	trace_lguest_hypercall(cpu->id, args->arg0, args->arg1, args->arg2,
+			       args->arg3);
+	do_hcall(cpu, args);
+	if (args->arg0 < LG_HCALL_NR)
+		lguest_account(&cpu->stats.hcalls[args->arg0],
+			       local_clock() - start);
+}
+
 /*H:124
- * Asynchronous hypercalls are easy: we just look in the array in the
- * Guest's "struct lguest_regs" to see if any new ones are marked "ready".
+ * Asynchronous hypercalls are easy: we just look in the ring in the Guest's
+ * "struct lguest_regs" for any the Guest has put there since last time.
  *
  * We are careful to do these in order: obviously we respect the order the
- * Guest put them in the ring. 
+ * Guest put them in the ring.  Our own cursor is "next_hcall"; we only tell
+ * the Guest where we are up to, we never believe its idea of it.
  */
 void do_hypercalls(struct lg_cpu *cpu)
 {
-#define NEXT_HCALL(current) \
-	((current + 1) & (LHCALL_RING_SIZE - 1))
-
-	unsigned int i;
-	struct hcall_args *hcalls = ((struct lguest_regs *)(cpu->regs_page))->hcalls;
-
-	/* We process "struct lguest_"s hcalls[] ring once. */
-	for (i = 0; i < LHCALL_RING_SIZE; i++) {
-		/*
-		 * We remember where we were up to from last time.  This makes
-		 * sure that the hypercalls are done in the order the Guest
-		 * places them in the ring.
-		 */
-		unsigned int n = cpu->next_hcall;
-
-		/* -1UL means there's no call here (yet). */
-		if(hcalls[n].arg0 == -1UL)
-			break;
-		/*
-		 * OK, we have hypercall.  Increment the "next_hcall" cursor,
-		 * and wrap back to 0 if we reach the end.
-		 */
-		
-		cpu->next_hcall = NEXT_HCALL(cpu->next_hcall);
+	struct lguest_regs *regs = cpu->regs;
+	u32 size = ACCESS_ONCE(regs->hcall_ring_size);
+	u32 prod = ACCESS_ONCE(regs->hcall_prod);
+	u32 cons = cpu->next_hcall;
+
+	/* The Guest may make the ring smaller, never bigger or odd-sized. */
+	if (!is_power_of_2(size) || size > LHCALL_RING_SIZE) {
+		kill_guest(cpu, "bad hypercall ring size %u", size);
+		return;
+	}
+	if (prod - cons > size) {
+		kill_guest(cpu, "hypercall ring overrun");
+		return;
+	}
+	if (prod - cons == size)
+		cpu->stats.hcall_ring_full++;
 
-		/* Do the hypercall, same as a normal one. */
-		do_hcall(cpu, &hcalls[n]);
+	/* Read the index before the entries it covers. */
+	rmb();
 
-		/* Mark the hypercall done. */
-		hcalls[n].arg0 = -1UL;
+	/* We run everything that's there in one pass. */
+	while (cons != prod) {
+		do_hcall_accounted(cpu, &regs->hcalls[cons & (size - 1)]);
+		cons++;
 
 		/*
 		 * Stop doing hypercalls if they want to notify the Launcher:
-		 * it needs to service this first.
+		 * it needs to service this first.  A notification which
+		 * only needs an eventfd written, we can do right here.
 		 */
-		if (cpu->pending_notify)
+		if (cpu->pending_notify && !send_notify_to_eventfd(cpu))
 			break;
 	}
+
+	cpu->next_hcall = cons;
+	regs->hcall_cons = cons;
 }
 
@@ -73,16 +73,6 @@ int copy_guest_vectors(const void __user *vectors, const unsigned long len)
 }
 
 
-/*
- * This routine supplies the Guest with time. Everytime we 
- * go back to the Guest, we call this function.
- */
-static void write_timestamp(struct lg_cpu *cpu)
-{
-	ktime_get_real_ts(&cpu->regs->guest_time);
-}
-
-
 /* This One Big lock protects all inter-guest data structures. */
 DEFINE_MUTEX(lguest_lock);
 
@@ -279,6 +269,18 @@ int run_guest(struct lg_cpu *cpu, unsigned long __user *user)
 		if (signal_pending(current))
 			return -ERESTARTSYS;
 
+		/*
+		 * A secondary CPU does nothing until the Guest's boot CPU
+		 * brings it up with LHCALL_CPU_UP, which wakes us.
+		 */
+		if (!cpu->started) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!cpu->started && !cpu->lg->dead)
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+
 		/* 
 		 * We already call this function in lguest_arch_run_guest after 
 		 * we come back from the Guest, but if the Guest sends a 
@@ -305,18 +307,21 @@ int run_guest(struct lg_cpu *cpu, unsigned long __user *user)
 		/* Tell the Guest that there are some virtual irqs.*/
 		send_interrupt_to_guest(cpu);	
 
-        /*
-		 * If the Guest asked to be stopped, we sleep.  The Guest's
-		 * clock timer will wake us.
+		/*
+		 * The Guest may have moved its timer deadline without telling
+		 * us: catch up before it runs, or sleeps.
 		 */
-		if (cpu->halted){
-			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
+		guest_set_clockevent(cpu, false);
+
+		/*
+		 * If the Guest asked to be stopped, we wait for an interrupt.
+		 * The Guest's clock timer will wake us, if nothing else.
+		 */
+		if (cpu->halted) {
+			guest_halt(cpu);
 			continue;
 		}
 
-		/*Everytime before we go return the guest, we set time for the guest */
-		write_timestamp(cpu);
 		/*
 		 * OK, now we're ready to jump into the Guest.  First we put up
 		 * the "Do Not Disturb" sign:
@@ -386,10 +391,13 @@ static int __init init(void)
 	if (err)
 		goto free_pgtables;
 
+	/* Statistics live in debugfs; they can't fail in any way we care. */
+	lguest_stats_init();
+
 	/* /dev/lguest needs to be registered. */
 	err = lguest_device_init();
 	if (err)
-		goto free_interrupts;
+		goto free_stats;
 
 	/* Finally we do some architecture-specific setup. */
 	lguest_arch_host_init(); 
@@ -398,7 +406,8 @@ static int __init init(void)
 	return 0;
 	
 
-free_interrupts:
+free_stats:
+	lguest_stats_exit();
 	free_interrupts();
 free_pgtables:
 	free_pagetables();
@@ -416,6 +425,7 @@ out:
 static void __exit fini(void)
 {
 	lguest_device_remove();
+	lguest_stats_exit();
 	free_interrupts();
 	free_pagetables();
 	unmap_switcher();
@@ -26,77 +26,156 @@
 
 
 
-/* And this is the routine when we want to set an interrupt for the Guest. */
+/*H:205
+ * And this is the routine when we want to set an interrupt for the Guest.
+ *
+ * We post it straight into the irqs_pending bitmap in the page we share with
+ * the Guest.  If the Guest has interrupts disabled, or that line blocked, it
+ * will notice for itself when it enables them and come back for it then, so
+ * there's no point knocking it out of the Guest now.
+ */
 void set_interrupt(struct lg_cpu *cpu, unsigned int irq)
 {
-	/*
-	 * Next time before the Guest runs, the Host will see if there are 
-	 * virtual irqs which the Guest need to be dealed with
-	 */
-	set_bit(irq, cpu->irqs_pending);
-	
+	set_bit(irq, cpu->regs->irqs_pending);
+	/* Pairs with the mb() in the Guest's lguest_arch_local_irq_restore(). */
+	smp_mb();
+
 	/*
 	 * Make sure it sees it; it might be asleep (eg. halted), or running
 	 * the Guest right now, in which case kick_process() will knock it out.
 	 */
-	if (!wake_up_process(cpu->tsk))
+	if (wake_up_process(cpu->tsk))
+		return;
+	if (!(cpu->regs->irq_disabled & PSR_I_BIT)
+	    && !test_bit(irq, cpu->regs->blocked_interrupts))
 		kick_process(cpu->tsk);
-
 }
 
+/*
+ * Device interrupts all go to the Guest's CPU 0, so that's the page where
+ * they're blocked and unblocked.  The other CPUs can't see it, and ask us.
+ */
+void guest_block_irq(struct lg_cpu *cpu, unsigned long irq, unsigned long block)
+{
+	struct lg_cpu *boot = &cpu->lg->cpus[0];
 
+	if (irq >= LGUEST_IRQS) {
+		kill_guest(cpu, "bad irq %lu", irq);
+		return;
+	}
 
-void send_interrupt_to_guest(struct lg_cpu *cpu)
+	if (block)
+		set_bit(irq, boot->regs->blocked_interrupts);
+	else {
+		clear_bit(irq, boot->regs->blocked_interrupts);
+		/* It may have come in while it was blocked. */
+		if (test_bit(irq, boot->regs->irqs_pending))
+			set_interrupt(boot, irq);
+	}
+}
+
+/*H:207
+ * An SMP Guest sends Inter-Processor Interrupts with LHCALL_SEND_IPI.  Each
+ * Guest CPU has one interrupt line for all of them, LGUEST_IPI_IRQ, and a word
+ * in its page saying which IPIs are waiting, which the Guest clears itself.
+ */
+void guest_send_ipi(struct lg_cpu *cpu, unsigned long mask, unsigned long ipi)
 {
-	unsigned int irq;
-    DECLARE_BITMAP(blk, LGUEST_IRQS);
-
-	memcpy(blk, cpu->regs->blocked_interrupts, sizeof(blk));
-	bitmap_andnot(blk, cpu->irqs_pending, blk, LGUEST_IRQS);
-	
-	if((irq = find_first_bit(blk, LGUEST_IRQS)) < LGUEST_IRQS){
-	    if(cpu->halted){
-		    cpu->halted = 0;
-		}
-		/* 
-		 * when the Guest see cpu->regs->irq_pending = 1, the Guest 
-		 * will come back to take pending virtual irqs.
-		 */
-		cpu->regs->irq_pending = 1;
-	} else {
-		cpu->regs->irq_pending = 0;
+	struct lguest *lg = cpu->lg;
+	unsigned int i;
+
+	if (ipi >= BITS_PER_LONG) {
+		kill_guest(cpu, "bad IPI %lu", ipi);
 		return;
 	}
 
-	
-	/* 
-	 * If the Guest' local irqs are disabled, we just do othing until
-	 * the Guest's local irqs are enabled.
-	 */
-	if(cpu->regs->irq_disabled & PSR_I_BIT){
-		return;
+	for (i = 0; i < lg->nr_cpus; i++) {
+		if (!(mask & (1UL << i)))
+			continue;
+		set_bit(ipi, &lg->cpus[i].regs->ipis_pending);
+		set_interrupt(&lg->cpus[i], LGUEST_IPI_IRQ);
 	}
+}
+
+
 
+/*
+ * Before we run the Guest we only need to know if it halted and now has an
+ * interrupt to take: the interrupts themselves are already in its page, and
+ * the Guest delivers them when it comes back in.
+ */
+void send_interrupt_to_guest(struct lg_cpu *cpu)
+{
+	if (cpu->halted && lguest_irq_deliverable(cpu->regs))
+		cpu->halted = 0;
+}
+
+/*H:210
+ * Halt polling.
+ *
+ * When the Guest goes idle waiting for a disk or a network reply, the
+ * interrupt often turns up a few microseconds later.  Going to sleep and
+ * being woken costs more than that, so we spin for a while first, watching
+ * the Guest's page for an interrupt.
+ *
+ * Each vCPU keeps its own poll window.  If we slept, but the interrupt came
+ * within halt_poll_ns, a longer poll would have caught it, so the window
+ * doubles.  If it came much later, we wasted the spin, so it halves.
+ */
+static unsigned int halt_poll_ns = 100000;
+module_param(halt_poll_ns, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns, "Longest a halted vCPU spins before sleeping");
+
+/* Where a window starts growing from. */
+#define HALT_POLL_START_NS	10000
+
+void guest_halt(struct lg_cpu *cpu)
+{
+	unsigned int max = ACCESS_ONCE(halt_poll_ns);
+	u64 start = ktime_to_ns(ktime_get()), now = start, waited;
+
+	cpu->stats.halts++;
+
+	if (cpu->halt_poll_ns > max)
+		cpu->halt_poll_ns = max;
+
+	while (now - start < cpu->halt_poll_ns) {
+		if (lguest_irq_deliverable(cpu->regs)) {
+			cpu->stats.halt_polled++;
+			return;
+		}
+		if (need_resched() || signal_pending(current))
+			break;
+		cpu_relax();
+		now = ktime_to_ns(ktime_get());
+	}
 
 	/*
-	 * when we find a virtual irq that the Guest can handle it,
-	 * we set this virtual irq bit in the member irqs_pending of 
-	 * "struct lguest_regs", the Guest can see it when the Guest
-	 * restores to run. 
+	 * set_interrupt() sets the bit before it wakes us, so checking it
+	 * after we're TASK_INTERRUPTIBLE means we can't miss one.
 	 */
-	while((irq = find_first_bit(blk, LGUEST_IRQS)) < LGUEST_IRQS){
-		set_bit(irq, cpu->regs->irqs_pending);
-		clear_bit(irq, cpu->irqs_pending);
-		clear_bit(irq,blk);
-	}
-	
-	/*All virtual irqs are sent to the Guest, there is no pending irqs now*/
-	cpu->regs->irq_pending = 0;
+	set_current_state(TASK_INTERRUPTIBLE);
+	if (!lguest_irq_deliverable(cpu->regs) && !cpu->lg->dead)
+		schedule();
+	__set_current_state(TASK_RUNNING);
+
+	if (cpu->halt_poll_ns)
+		cpu->stats.halt_poll_missed++;
+
+	waited = ktime_to_ns(ktime_get()) - start;
+	if (waited <= max) {
+		if (!cpu->halt_poll_ns)
+			cpu->halt_poll_ns = min_t(unsigned int,
+						  HALT_POLL_START_NS, max);
+		else
+			cpu->halt_poll_ns = min_t(unsigned int,
+						  cpu->halt_poll_ns * 2, max);
+	} else
+		cpu->halt_poll_ns /= 2;
 }
 
 
 
-
 int init_interrupts(void)
 {
 
@@ -119,29 +198,40 @@ void free_interrupts(void)
  * the Launcher sending interrupts for virtual devices.  The other is the Guest
  * timer interrupt.
  *
- * The Guest uses the LHCALL_SET_CLOCKEVENT hypercall to tell us how long to
- * the next timer interrupt (in nanoseconds).  We use the high-resolution timer
- * infrastructure to set a callback at that time.
+ * The Guest writes the time it wants its next timer interrupt into
+ * "timer_deadline" in its register page, as an absolute lguest_clock time,
+ * which is our monotonic clock.  We look at it every time the Guest comes
+ * back to us, and use the high-resolution timer infrastructure to set a
+ * callback at that time.  The Guest only makes an LHCALL_SET_CLOCKEVENT
+ * hypercall to hurry us up when the new deadline is earlier than
+ * "timer_armed", the one we're already waiting for, or when nothing is armed.
+ *
+ * A deadline which has already fired stays in the page until the Guest
+ * writes another, so we don't re-arm for it just because the Guest exited.
+ * But if the Guest asks ("asked" is set by the hypercall) and our timer isn't
+ * running, we start it even for the same deadline: the Guest's clock only
+ * moves when we stamp it, so it can easily come up with the same one twice.
  *
  * 0 means "turn off the clock".
  */
-void guest_set_clockevent(struct lg_cpu *cpu, unsigned long delta)
+void guest_set_clockevent(struct lg_cpu *cpu, bool asked)
 {
-	ktime_t expires;
-
-	if (unlikely(delta == 0)) {
-		/* Clock event device is shutting down. */
-		hrtimer_cancel(&cpu->hrt);
-		return;
+	u64 deadline = cpu->regs->timer_deadline;
+
+	if (deadline != cpu->timer_deadline
+	    || (asked && !hrtimer_active(&cpu->hrt))) {
+		cpu->timer_deadline = deadline;
+		if (!deadline)
+			/* Clock event device is shutting down. */
+			hrtimer_cancel(&cpu->hrt);
+		else
+			hrtimer_start(&cpu->hrt,
+				      ns_to_ktime(deadline - cpu->lg->clock_offset),
+				      HRTIMER_MODE_ABS);
 	}
 
-	/*
-	 * We use wallclock time here, so the Guest might not be running for
-	 * all the time between now and the timer interrupt it asked for.  This
-	 * is almost always the right thing to do.
-	 */
-	expires = ktime_add_ns(ktime_get_real(), delta);
-	hrtimer_start(&cpu->hrt, expires, HRTIMER_MODE_ABS);
+	/* Once the timer has gone off, the Guest must ask again. */
+	cpu->regs->timer_armed = hrtimer_active(&cpu->hrt) ? deadline : 0;
 }
 
 /* This is the function called when the Guest's timer expires. */
@@ -149,6 +239,7 @@ static enum hrtimer_restart clockdev_fn(struct hrtimer *timer)
 {
 	struct lg_cpu *cpu = container_of(timer, struct lg_cpu, hrt);
 
+	cpu->stats.timer++;
 	/* Remember the first interrupt is the timer interrupt. */
 	set_interrupt(cpu, 0);
 	return HRTIMER_NORESTART;
@@ -157,6 +248,6 @@ static enum hrtimer_restart clockdev_fn(struct hrtimer *timer)
 /* This sets up the timer for this Guest. */
 void init_clockdev(struct lg_cpu *cpu)
 {
-	hrtimer_init(&cpu->hrt, CLOCK_REALTIME, HRTIMER_MODE_ABS);
+	hrtimer_init(&cpu->hrt, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
 	cpu->hrt.function = clockdev_fn;
 }
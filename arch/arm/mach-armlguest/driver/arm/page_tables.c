@@ -25,14 +25,18 @@
 #include <linux/mm.h>
 #include <linux/types.h>
 #include <linux/spinlock.h>
-#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/module.h>
 #include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
 #include <asm/tlbflush.h>
 #include <asm/uaccess.h>
 
 #include <asm/domain.h>
 
 #include <asm/setup.h>
+#include <asm/sizes.h>
 #include <asm/mach/map.h>
 #include "../lg.h"
 #include "./page_tables_arm.h"
@@ -40,6 +44,27 @@
 
 #define SWITCHER_PGD_INDEX  pgd_index(get_switcher_addr())
 
+/*
+ * How many shadow page tables each Guest keeps.  Each one costs us 16k for
+ * the top level plus its PTE pages, but a miss means rebuilding every user
+ * mapping of the incoming process fault by fault.
+ */
+static unsigned int shadow_pgdirs = 8;
+module_param(shadow_pgdirs, uint, 0644);
+MODULE_PARM_DESC(shadow_pgdirs, "Shadow page tables cached per Guest (2-64)");
+
+/*
+ * How many shadow PTEs around a fault we fill in while we're there: see
+ * fault_around_page().  It's rounded down to a power of two, and can't be
+ * more than one PTE page; 0 or 1 turns it off.
+ */
+static unsigned int fault_around = 16;
+module_param(fault_around, uint, 0644);
+MODULE_PARM_DESC(fault_around, "Shadow PTEs filled per Guest page fault (0-512)");
+
+/* We read the Guest's PTEs for fault-around this many at a time. */
+#define FAULT_AROUND_BATCH 16
+
 /*M:008
  * We hold reference to pages, which prevents them from being swapped.
  * It'd be nice to have a callback in the "struct mm_struct" when Linux wants
@@ -311,6 +336,111 @@ static inline int fsr_fs(unsigned int fsr)
 
 
 
+/*
+ * Fill in the shadow PTE for Guest address "vaddr" from Guest PTE "gpte", if
+ * that's cheap and harmless: see fault_around_page().  Unlike demand_page(),
+ * nothing here is worth killing the Guest over; we just leave it for a real
+ * fault to sort out.
+ */
+static void prefault_pte(struct lg_cpu *cpu, pgd_t *spgd, unsigned long vaddr,
+			 pte_t gpte)
+{
+	pte_t *spte = spte_addr(cpu, spgd, vaddr);
+	unsigned long base, pfn;
+	int write;
+
+	if (pte_present(*spte) || !pte_present(gpte) || !pte_young(gpte))
+		return;
+	if (pte_pfn(gpte) >= cpu->lg->pfn_limit ||
+	    pte_pfn(gpte) < PHYS_PFN_OFFSET)
+		return;
+
+	/* Just as in demand_page(), only a dirty page may be written. */
+	write = pte_dirty(gpte) && pte_write(gpte);
+	if (!pte_dirty(gpte))
+		gpte = pte_wrprotect(gpte);
+
+	base = (unsigned long)cpu->lg->mem_base / PAGE_SIZE;
+	pfn = get_pfn(base + pte_pfn(gpte) - PHYS_PFN_OFFSET, write);
+	if (pfn == -1UL)
+		return;
+
+	set_guest_pte(spte, pfn_pte(pfn, __pgprot(pte_val(gpte) & (PAGE_SIZE - 1))),
+		      vaddr < TASK_SIZE ? PTE_EXT_NG : 0);
+	cpu->stats.prefaulted++;
+}
+
+/*H:335
+ * While we have the Guest's PTE page in hand, we may as well fill in the
+ * neighbours of the PTE we just faulted in.  When a process comes back to a
+ * shadow page table we recycled, or one whose PTE page guest_set_pgd() threw
+ * away, it would otherwise fault its working set back in one page (and one
+ * trip through the Switcher) at a time.
+ *
+ * We only take PTEs the Guest has marked young, ie. pages it has used
+ * recently, and we never set flags in the Guest's PTEs here: a page the Guest
+ * hasn't touched still faults, so its young and dirty bits stay honest.
+ */
+static void fault_around_page(struct lg_cpu *cpu, pgd_t *spgd, pgd_t *gpgd,
+			      unsigned long vaddr)
+{
+	pte_t gptes[FAULT_AROUND_BATCH];
+	unsigned long window, start, addr;
+	unsigned int i, n;
+
+	if (fault_around < 2)
+		return;
+
+	/* An aligned window never strays outside this PTE page. */
+	window = min_t(unsigned long, rounddown_pow_of_two(fault_around),
+		       PTRS_PER_PTE) * PAGE_SIZE;
+	start = vaddr & ~(window - 1);
+
+	for (addr = start; addr < start + window; addr += n * PAGE_SIZE) {
+		n = min_t(unsigned long, FAULT_AROUND_BATCH,
+			  (start + window - addr) / PAGE_SIZE);
+		/* The Guest's PTEs for one PGD entry are all in a row. */
+		__lgread(cpu, gptes, gpte_addr(cpu, gpgd, addr),
+			 n * sizeof(pte_t));
+		for (i = 0; i < n; i++)
+			prefault_pte(cpu, spgd, addr + i * PAGE_SIZE, gptes[i]);
+	}
+}
+
+/*
+ * The only hole we ever leave in direct mapped memory is a page the Guest
+ * gave to its balloon (see guest_release_pages()).  If the Guest touches it
+ * again, it has taken the page back, and we map it just as init_sptes() did.
+ */
+static bool refault_direct_page(struct lg_cpu *cpu, unsigned long vaddr)
+{
+	pgd_t *spgd = spgd_addr(cpu, 0, vaddr);
+	pte_t *spte;
+	unsigned long pfn;
+
+	if (!check_pmd(get_pmdval(spgd, vaddr))
+	    || (get_pmdval(spgd, vaddr) & PMD_TYPE_MASK) == PMD_TYPE_SECT) {
+		kill_guest(cpu, "direct mapped memory error");
+		return false;
+	}
+
+	spte = spte_addr(cpu, spgd, vaddr);
+	if (pte_present(*spte)) {
+		kill_guest(cpu, "direct mapped memory error");
+		return false;
+	}
+
+	pfn = get_pfn(((unsigned long)cpu->lg->mem_base + vaddr - PAGE_OFFSET)
+		      >> PAGE_SHIFT, 1);
+	if (pfn == -1UL) {
+		kill_guest(cpu, "failed to get page %#lx", vaddr);
+		return false;
+	}
+	set_guest_pte(spte, pfn_pte(pfn, __pgprot((GUEST_BASE_PTE_FLAGS
+			| L_PTE_DIRTY) & ~(L_PTE_RDONLY | L_PTE_XN))), 0);
+	return true;
+}
+
 /*H:330
  * (i) Looking up a page table entry when the Guest aborts.
  *
@@ -321,7 +451,7 @@ static inline int fsr_fs(unsigned int fsr)
  * knowing. If we fixed up the fault (ie. we mapped the address), this routine 
  * returns true.  Otherwise, it was a real fault and we need to tell the Guest.
  */
-bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long fsr)
+static bool demand_page(struct lg_cpu *cpu, unsigned long vaddr, unsigned long fsr)
 {
 #define SECTION_TRANSLATION_FAULT	0x5
 #define PAGE_TRANSLATION_FAULT		0x7	
@@ -356,10 +486,10 @@ bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long
 
 	/* 
 	 * Entries of Direct mapped memory have already be set up before the Guest runs,
-	 * and they should never change before the Guest exits.
+	 * and they only go away if the Guest gives the page to its balloon.
 	 */
 	if((vaddr >= PAGE_OFFSET) && (vaddr < mem_size + PAGE_OFFSET)){
-		kill_guest(cpu, "direct mapped memory error");
+		return refault_direct_page(cpu, vaddr);
 	}
 	
 	/* 
@@ -490,6 +620,9 @@ bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long
 	 */
 	lgwrite(cpu, gpte_ptr, pte_t, gpte);
 
+	/* While we're here, bring in the neighbours. */
+	fault_around_page(cpu, spgd, &gpgd, vaddr);
+
 	/*
 	 * The fault is fixed, the page table is populated, the mapping
 	 * manipulated, the result returned and the code complete.  A small
@@ -499,6 +632,20 @@ bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long
 	return true;
 }
 
+/*
+ * The CPUs of an SMP Guest can fault at the same time, and they all share the
+ * shadow page tables, so we hold the lock over the whole walk.
+ */
+bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long fsr)
+{
+	bool ret;
+
+	mutex_lock(&cpu->lg->pgdir_lock);
+	ret = demand_page(cpu, vaddr, fsr);
+	mutex_unlock(&cpu->lg->pgdir_lock);
+	return ret;
+}
+
 
 /*:*/
 
@@ -537,6 +684,35 @@ static void release_pgd(pgd_t *spgd)
 
 
 
+/*
+ * Direct mapped memory may be mapped with sections rather than PTE pages
+ * (see init_section_spgd()): then we hold a reference to each of the pages
+ * in the two sections.
+ */
+static void release_section(pmd_t pmd)
+{
+	unsigned long pfn = __phys_to_pfn(pmd_val(pmd) & SECTION_MASK);
+	unsigned int i;
+
+	for (i = 0; i < SECTION_SIZE >> PAGE_SHIFT; i++)
+		put_page(pfn_to_page(pfn + i));
+}
+
+static void release_direct_pgd(pgd_t *spgd)
+{
+	pmd_t *pmd = pmd_offset(spgd, 0);
+
+	if ((pmd_val(*pmd) & PMD_TYPE_MASK) != PMD_TYPE_SECT) {
+		release_pgd(spgd);
+		return;
+	}
+	release_section(pmd[0]);
+	release_section(pmd[1]);
+	lguest_pmd_clear(pmd);
+}
+
+
+
 /*H:445
  * We saw flush_user_mappings() twice: once from the flush_user_mappings()
  * hypercall and once in new_pgdir() when we re-used a top-level pgdir page.
@@ -555,43 +731,138 @@ static void flush_user_mappings(struct lguest *lg, int idx)
 
 
 
+/*
+ * Every shadow which has a PGD page sits on the pgdir_hash chain for the
+ * Guest top-level it shadows, so switching page tables and passing on PTE
+ * updates only look at the shadows of that one top-level.  Guest PGDs are
+ * 16k aligned, so the low bits are no use to the hash.
+ */
+static int *pgdir_hash_head(struct lguest *lg, unsigned long gpgdir)
+{
+	return &lg->pgdir_hash[hash_long(gpgdir >> 14, PGDIR_HASH_BITS)];
+}
+
+static void pgdir_hash_add(struct lguest *lg, unsigned int i)
+{
+	int *head = pgdir_hash_head(lg, lg->pgdirs[i].gpgdir);
+
+	lg->pgdirs[i].hash_next = *head;
+	*head = i;
+}
+
+static void pgdir_hash_del(struct lguest *lg, unsigned int i)
+{
+	int *pos = pgdir_hash_head(lg, lg->pgdirs[i].gpgdir);
+
+	for (; *pos >= 0; pos = &lg->pgdirs[*pos].hash_next) {
+		if (*pos == i) {
+			*pos = lg->pgdirs[i].hash_next;
+			return;
+		}
+	}
+}
+
+/* Walk "i" over the shadows of Guest top-level "gpgdir". */
+#define for_each_shadow(lg, i, gpgdir)					\
+	for (i = *pgdir_hash_head(lg, gpgdir); i >= 0;			\
+	     i = (lg)->pgdirs[i].hash_next)				\
+		if ((lg)->pgdirs[i].gpgdir == (gpgdir))
+
 /*
  * We keep several page tables.  This is a simple routine to find the page
- * table (if any) corresponding to this top-level address the Guest has given
- * us.
+ * table (if any) this CPU uses for this top-level address the Guest has
+ * given us.
+ *
+ * Each shadow belongs to one CPU.  The Switcher's PGD entry in a shadow
+ * points at the Switcher PTE page of the Host CPU it's running on, so two
+ * Guest CPUs running on different Host CPUs can't share one.  If two of the
+ * Guest's CPUs run the same process, they get a shadow each, and changes to
+ * the Guest's page table go to both.
  */
-static unsigned int find_pgdir(struct lguest *lg, unsigned long pgtable)
+static unsigned int find_pgdir(struct lg_cpu *cpu, unsigned long pgtable)
+{
+	int i;
+
+	for_each_shadow(cpu->lg, i, pgtable)
+		if (cpu->lg->pgdirs[i].cpu == cpu->id)
+			return i;
+	return cpu->lg->nr_pgdirs;
+}
+
+/* Is some CPU of this Guest running on this shadow page table right now? */
+static bool pgdir_in_use(struct lguest *lg, unsigned int idx)
 {
 	unsigned int i;
-	for (i = 0; i < ARRAY_SIZE(lg->pgdirs); i++)
-		if (lg->pgdirs[i].pgdir && lg->pgdirs[i].gpgdir == pgtable)
-			break;
-	return i;
+
+	for (i = 0; i < lg->nr_cpus; i++)
+		if (lg->cpus[i].cpu_pgd == idx)
+			return true;
+	return false;
+}
+
+/*
+ * Which shadow page table do we throw out?  An empty slot is best of all.
+ * Otherwise, a shadow whose context id the Guest has just handed to another
+ * mm is a good bet: that mm has exited or will get a fresh ASID when it next
+ * runs.  Failing that, we take the Least Recently Used one.  We never take
+ * one which a CPU is running on.
+ */
+static unsigned int pick_pgdir_victim(struct lg_cpu *cpu,
+				      unsigned long gpgdir,
+				      unsigned long context_id)
+{
+	struct lguest *lg = cpu->lg;
+	unsigned int i, victim = lg->nr_pgdirs;
+
+	for (i = 0; i < lg->nr_pgdirs; i++) {
+		if (!lg->pgdirs[i].pgdir)
+			return i;
+		if (pgdir_in_use(lg, i))
+			continue;
+		/* Another CPU's shadow of this same mm isn't stale. */
+		if (lg->pgdirs[i].context_id == context_id
+		    && lg->pgdirs[i].gpgdir != gpgdir)
+			return i;
+		if (victim == lg->nr_pgdirs
+		    || lg->pgdirs[i].last_used < lg->pgdirs[victim].last_used)
+			victim = i;
+	}
+
+	/* Everything's in use?  Just keep using the one we have. */
+	if (victim == lg->nr_pgdirs)
+		victim = cpu->cpu_pgd;
+	return victim;
 }
 
 /*H:435
- * And this is us, creating the new page directory. We do
- * not care about blank_pgdir on Lguest of ARM version.
+ * And this is us, creating the new page directory for "cpu". We do
+ * not care about blank_pgdir on Lguest of ARM version.  The kernel
+ * entries which never change are copied from shadow "from".
+ *
+ * This returns nr_pgdirs if there's nothing at all we can use: that can
+ * only happen for a CPU which hasn't got a shadow yet.
  */
 static unsigned int new_pgdir(struct lg_cpu *cpu,
+                  unsigned int from,
                   unsigned long gpgdir,
+                  unsigned long context_id,
                   int *blank_pgdir)
 {
 	unsigned int next;
 
-	/*
-	 * We pick one entry at random to throw out.  Choosing the Least
-	 * Recently Used might be better, but this is easy.
-	 */
-	next = random32() % ARRAY_SIZE(cpu->lg->pgdirs);
+	next = pick_pgdir_victim(cpu, gpgdir, context_id);
+	if (next >= cpu->lg->nr_pgdirs)
+		return cpu->lg->nr_pgdirs;
 	/* If it's never been allocated at all before, try now. */
 	if (!cpu->lg->pgdirs[next].pgdir) {
 		cpu->lg->pgdirs[next].pgdir =
 			(pgd_t *)__get_free_pages(GFP_KERNEL, 2);
 		/* If the allocation fails, just keep using the one we have */
-		if (!cpu->lg->pgdirs[next].pgdir)
+		if (!cpu->lg->pgdirs[next].pgdir) {
+			if (cpu->cpu_pgd < 0)
+				return cpu->lg->nr_pgdirs;
 			next = cpu->cpu_pgd;
-		else {
+		} else {
 			unsigned int index = pgd_index(PAGE_OFFSET);
 			unsigned int index_end = pgd_index(cpu->lg->mem_size +  PAGE_OFFSET);
 
@@ -600,15 +871,15 @@ static unsigned int new_pgdir(struct lg_cpu *cpu,
 			
 			/* We copy the entries of the Switcher, Guest Vectors, direct mapped memory */
 			memcpy((void *)&cpu->lg->pgdirs[next].pgdir[index],
-				(void *)&cpu->lg->pgdirs[cpu->cpu_pgd].pgdir[index],
+				(void *)&cpu->lg->pgdirs[from].pgdir[index],
 				(sizeof(pgd_t) * (index_end - index)));
 
 			memcpy((void *)&cpu->lg->pgdirs[next].pgdir[SWITCHER_PGD_INDEX],
-				(void *)&cpu->lg->pgdirs[cpu->cpu_pgd].pgdir[SWITCHER_PGD_INDEX],
+				(void *)&cpu->lg->pgdirs[from].pgdir[SWITCHER_PGD_INDEX],
 				sizeof(pgd_t));
 
 			memcpy((void *)&cpu->lg->pgdirs[next].pgdir[pgd_index(GUEST_VECTOR_ADDRESS)],
-				(void *)&cpu->lg->pgdirs[cpu->cpu_pgd].pgdir[pgd_index(GUEST_VECTOR_ADDRESS)],
+				(void *)&cpu->lg->pgdirs[from].pgdir[pgd_index(GUEST_VECTOR_ADDRESS)],
 				sizeof(pgd_t));
 
 			goto out;
@@ -616,10 +887,14 @@ static unsigned int new_pgdir(struct lg_cpu *cpu,
 	}
 	/* Release all the non-kernel mappings. */
 	flush_user_mappings(cpu->lg, next);
+	cpu->lg->pgdir_stats.evictions++;
+	pgdir_hash_del(cpu->lg, next);
 
 out:	
-	/* Record which Guest toplevel this shadows. */
+	/* Record which Guest toplevel this shadows, and for whom. */
 	cpu->lg->pgdirs[next].gpgdir = gpgdir;
+	cpu->lg->pgdirs[next].cpu = cpu->id;
+	pgdir_hash_add(cpu->lg, next);
 
 	return next;
 }
@@ -633,28 +908,80 @@ out:
  * Now we've seen all the page table setting and manipulation, let's see
  * what happens when the Guest changes page tables (ie. changes the top-level
  * pgdir).  This occurs on almost every context switch.
+ *
+ * A shadow is only good for the Guest toplevel *and* the context id it was
+ * built under: if the Guest hands us a known toplevel with a new context id,
+ * either its ASIDs rolled over or the page was freed and reused for a new mm.
+ * We can't tell which, so we flush its user mappings and start again.
  */
 
 void guest_switch_mm(struct lg_cpu *cpu, unsigned long pgtable,
                 unsigned long context_id)
 {
+	struct lguest *lg = cpu->lg;
 	int newpgdir, repin = 0;
 
+	mutex_lock(&lg->pgdir_lock);
+
 	/* Look to see if we have this one already. */
-	newpgdir = find_pgdir(cpu->lg, pgtable);
+	newpgdir = find_pgdir(cpu, pgtable);
 
 	/*
 	 * If not, we allocate or mug an existing one. 
 	 * On Lguest of ARM version we do not use "repin".
 	 */
-	if (newpgdir == ARRAY_SIZE(cpu->lg->pgdirs))
-		newpgdir = new_pgdir(cpu, pgtable, &repin);
+	if (newpgdir == lg->nr_pgdirs) {
+		newpgdir = new_pgdir(cpu, cpu->cpu_pgd, pgtable, context_id,
+				     &repin);
+		lg->pgdir_stats.misses++;
+	} else if (lg->pgdirs[newpgdir].context_id != context_id) {
+		flush_user_mappings(lg, newpgdir);
+		lg->pgdir_stats.misses++;
+	} else
+		lg->pgdir_stats.hits++;
+
+	lg->pgdirs[newpgdir].context_id = context_id;
+	lg->pgdirs[newpgdir].last_used = ++lg->pgdir_clock;
+
 	/* Change the current pgd index to the new one. */
 	cpu->cpu_pgd = newpgdir;
+	mutex_unlock(&lg->pgdir_lock);
+
 	cpu->regs->guest_cont_id = context_id;
 	cpu->regs->gpgdir = pgtable;
 }
 
+/*
+ * A secondary CPU needs a shadow page table of its own before it can run at
+ * all.  It starts on the Guest's kernel top-level "pgtable", with the fixed
+ * kernel entries copied from the shadow of the CPU which is bringing it up.
+ * Since there are more shadows than CPUs (see lguest_user.c), there's always
+ * one free.
+ */
+bool guest_new_cpu_pagetable(struct lg_cpu *cpu, struct lg_cpu *target,
+			     unsigned long pgtable)
+{
+	struct lguest *lg = cpu->lg;
+	unsigned int newpgdir;
+	int repin = 0;
+
+	mutex_lock(&lg->pgdir_lock);
+	newpgdir = new_pgdir(target, cpu->cpu_pgd, pgtable, 0, &repin);
+	if (newpgdir < lg->nr_pgdirs) {
+		lg->pgdirs[newpgdir].context_id = 0;
+		lg->pgdirs[newpgdir].last_used = ++lg->pgdir_clock;
+		target->cpu_pgd = newpgdir;
+	}
+	mutex_unlock(&lg->pgdir_lock);
+
+	if (newpgdir >= lg->nr_pgdirs)
+		return false;
+
+	target->regs->guest_cont_id = 0;
+	target->regs->gpgdir = pgtable;
+	return true;
+}
+
 
 /*
  *	When the Guest calls set_pte_ext, we do not know the
@@ -668,8 +995,9 @@ void release_guest_nondirect_mapped_memory(struct lguest *lg)
 	unsigned int i, j;
 	unsigned long linemap_end = lg->mem_size +  PAGE_OFFSET;
 
+	mutex_lock(&lg->pgdir_lock);
 	/* Every shadow pagetable this Guest has */
-	for (i = 0; i < ARRAY_SIZE(lg->pgdirs); i++){
+	for (i = 0; i < lg->nr_pgdirs; i++){
 		if (lg->pgdirs[i].pgdir) {
 			/* Every PGD entry except the Switcher, Guest Vectors, direct mapped memory */
 			for (j = 0; j < pgd_index(PAGE_OFFSET); j++)
@@ -683,10 +1011,89 @@ void release_guest_nondirect_mapped_memory(struct lguest *lg)
 			
 		}
 	}
+	/*
+	 * Another vCPU may be running in the Guest right now, with the old
+	 * entries in its TLB: the Switcher only flushes on the way in.  The
+	 * Launcher still maps every page we let go of, so none of them can be
+	 * reused before this.
+	 */
+	flush_tlb_all();
+	mutex_unlock(&lg->pgdir_lock);
+}
+
+
+
+
+/*H:475
+ * When the Guest gives pages to its balloon, the Launcher hands them back to
+ * the Host with madvise(MADV_DONTNEED).  That does no good while we hold a
+ * reference to each page for the Guest's direct mapping, so first the
+ * Launcher asks us to let go of them with LHREQ_RELEASE_PAGES.  If the Guest
+ * takes a page back later, refault_direct_page() maps it in again.
+ *
+ * Only a page mapped by a PTE can be dropped on its own: memory under a
+ * section entry came from the Launcher's --ram file, and isn't ours to give
+ * back anyway.
+ *
+ * Other vCPUs can still be running in the Guest with these pages in their
+ * TLBs: the Switcher only flushes on the way in.  So we clear the shadow
+ * entries a batch at a time, flush every CPU's TLB, and only then let go of
+ * the pages.
+ */
+static unsigned int put_released_pages(struct page **pages, unsigned int nr)
+{
+	flush_tlb_all();
+	while (nr)
+		put_page(pages[--nr]);
+	return 0;
 }
 
+int guest_release_pages(struct lguest *lg, unsigned long pfn, unsigned long num)
+{
+	struct lg_cpu *cpu = &lg->cpus[0];
+	unsigned long vaddr, end, direct_pages = lg->mem_size >> PAGE_SHIFT;
+	struct page *pages[64];
+	unsigned int nr = 0;
+	pgd_t *spgd;
+	pte_t *spte;
+	int err = 0;
+
+	if (pfn < PHYS_PFN_OFFSET || pfn >= lg->pfn_limit
+	    || num > lg->pfn_limit - pfn)
+		return -EINVAL;
+	pfn -= PHYS_PFN_OFFSET;
+
+	mutex_lock(&lg->pgdir_lock);
+	vaddr = PAGE_OFFSET + (pfn << PAGE_SHIFT);
+	end = PAGE_OFFSET + (min(pfn + num, direct_pages) << PAGE_SHIFT);
+	for (; vaddr < end; vaddr += PAGE_SIZE) {
+		spgd = spgd_addr(cpu, 0, vaddr);
+		if ((get_pmdval(spgd, vaddr) & PMD_TYPE_MASK) == PMD_TYPE_SECT) {
+			err = -EBUSY;
+			break;
+		}
+		if (!check_pmd(get_pmdval(spgd, vaddr)))
+			continue;
+		spte = spte_addr(cpu, spgd, vaddr);
+		if (pte_present(*spte))
+			pages[nr++] = pte_page(*spte);
+		set_guest_pte(spte, __pte(0), 0);
+		if (nr == ARRAY_SIZE(pages))
+			nr = put_released_pages(pages, nr);
+	}
+	put_released_pages(pages, nr);
+	mutex_unlock(&lg->pgdir_lock);
 
+	/*
+	 * Pages above the direct mapped memory are only reachable through
+	 * kmap() and friends.  We can't tell which shadow entries point at
+	 * them, so if any are involved we drop all of those.
+	 */
+	if (!err && pfn + num > direct_pages)
+		release_guest_nondirect_mapped_memory(lg);
 
+	return err;
+}
 
 /*H:470
  * Finally, a routine which throws away everything: all PGD entries in all
@@ -699,17 +1106,17 @@ static void release_all_pagetables(struct lguest *lg)
     unsigned long linemap_end = lg->mem_size +  PAGE_OFFSET;
 
 	/* Direct mapped PGD entries are shared by all tasks, so we release them first*/
-	for (i = 0; i < ARRAY_SIZE(lg->pgdirs); i++){
+	for (i = 0; i < lg->nr_pgdirs; i++){
 		if (lg->pgdirs[i].pgdir) {
 			for (j = pgd_index(PAGE_OFFSET); j < pgd_index(linemap_end); j++){
-				release_pgd(lg->pgdirs[i].pgdir + j);
+				release_direct_pgd(lg->pgdirs[i].pgdir + j);
 			}
 			break;
 		}
 	}
     
 	/* Every shadow pagetable this Guest has */
-	for (i = 0; i < ARRAY_SIZE(lg->pgdirs); i++){
+	for (i = 0; i < lg->nr_pgdirs; i++){
 		if (lg->pgdirs[i].pgdir) {
 			/* Every PGD entry except the Switcher's, Guest Vectors', direct mapped memory's */
 			for (j = 0; j < pgd_index(PAGE_OFFSET); j++)
@@ -736,6 +1143,28 @@ static void release_all_pagetables(struct lguest *lg)
  * is read from, and L_PTE_DIRTY when it's written to.
  *
  */
+static void set_spte(struct lg_cpu *cpu, pte_t *spte, pte_t gpte,
+		     unsigned long ext)
+{
+	/* Start by releasing the existing entry. */
+	release_pte(*spte);
+
+	/*
+	 * If they're setting this entry as YOUNG, we might as well 
+	 * put that entry they've given us in now.  
+	 */
+	if (pte_present(gpte) && pte_young(gpte)){
+		check_gpte(cpu, gpte);
+		set_guest_pte(spte, gpte_to_spte(cpu, gpte, pte_dirty(gpte)), ext);
+	} else {
+		/*
+		 * Otherwise kill it and we can handle it in guest_abort_handle
+		 * it in later.
+		 */
+		set_guest_pte(spte, __pte(0) , 0);
+	}
+}
+
 static void do_set_pte(struct lg_cpu *cpu, int idx,
 	       unsigned long vaddr, pte_t gpte, unsigned long ext)
 {
@@ -745,26 +1174,26 @@ static void do_set_pte(struct lg_cpu *cpu, int idx,
 	spmd = pmd_offset(spgd, 0);
 
 	/* If the top level isn't present, there's no entry to update. */
-	if(check_pmd(pmd_val(*spmd))){
-		/* Otherwise, start by releasing the existing entry. */
-		pte_t *spte = spte_addr(cpu, spgd, vaddr);
-		release_pte(*spte);
+	if(check_pmd(pmd_val(*spmd)))
+		set_spte(cpu, spte_addr(cpu, spgd, vaddr), gpte, ext);
+}
 
-		/*
-		 * If they're setting this entry as YOUNG, we might as well 
-		 * put that entry they've given us in now.  
-		 */
-		if (pte_present(gpte) && pte_young(gpte)){
-			check_gpte(cpu, gpte);
-			set_guest_pte(spte, gpte_to_spte(cpu, gpte, pte_dirty(gpte)), ext);
-		} else {
-			/*
-			 * Otherwise kill it and we can handle it in guest_abort_handle
-			 * it in later.
-			 */
-			set_guest_pte(spte, __pte(0) , 0);
-		}
-	}
+/*
+ * The PTEs of the Switcher and the Guest's exception vectors, and those of
+ * direct mapped memory, are set up before the Guest runs and never change.
+ */
+static bool fixed_guest_pte(struct lg_cpu *cpu, unsigned long vaddr)
+{
+	unsigned long saddr = get_switcher_addr();
+
+	if(((vaddr >= GUEST_VECTOR_ADDRESS) && (vaddr < GUEST_VECTOR_ADDRESS + PAGE_SIZE))
+			|| ((vaddr >= saddr) && (vaddr < saddr + SWITCHER_TOTAL_SIZE)))
+		return true;
+
+	if((vaddr >= PAGE_OFFSET) && (vaddr < cpu->lg->mem_size + PAGE_OFFSET))
+		return true;
+
+	return false;
 }
 
 /*H:410
@@ -782,42 +1211,108 @@ static void do_set_pte(struct lg_cpu *cpu, int idx,
 void guest_set_pte(struct lg_cpu *cpu,
 		   unsigned long gpgdir, unsigned long vaddr, pte_t gpte)
 {
-	unsigned long saddr = get_switcher_addr();
-
-
 	/* 
-	 * The PTEs of the Switcher and the Guest's exception vectors have been set 
-	 * up before the Guest is about to run.
+	 * The Switcher, the Guest's exception vectors and direct mapped
+	 * memory are never changed while the Guest runs.
 	 */
-	if(((vaddr >= GUEST_VECTOR_ADDRESS) && (vaddr < GUEST_VECTOR_ADDRESS + PAGE_SIZE))
-			|| ((vaddr >= saddr) && (vaddr < saddr + SWITCHER_TOTAL_SIZE))){
+	if (fixed_guest_pte(cpu, vaddr))
 		return;
-	}
-
-	/* 
-	 * Entries of Direct mapped memory have already be set up before the Guest runs,
-	 * and they should never change before the Guest exits.
-	 */
-	if((vaddr >= PAGE_OFFSET) && (vaddr < cpu->lg->mem_size + PAGE_OFFSET)){
-		return;
-	}
 
+	mutex_lock(&cpu->lg->pgdir_lock);
 	/*
 	 * Kernel mappings must be changed on all top levels.  Slow, but doesn't
 	 * happen often.
 	 */
 	if(vaddr >= TASK_SIZE) {
 		unsigned int i;
-		for (i = 0; i < ARRAY_SIZE(cpu->lg->pgdirs); i++)
+		for (i = 0; i < cpu->lg->nr_pgdirs; i++)
 			if (cpu->lg->pgdirs[i].pgdir)
 				do_set_pte(cpu, i, vaddr, gpte, 0);
 	} else {
-		/* Is this page table one we have a shadow for? */
-		int pgdir = find_pgdir(cpu->lg, gpgdir);
-		if (pgdir != ARRAY_SIZE(cpu->lg->pgdirs))
-			/* If so, do the update. */
-			do_set_pte(cpu, pgdir, vaddr, gpte, PTE_EXT_NG);
+		int i;
+		/*
+		 * Update every shadow of this page table: there's one for each
+		 * CPU which has run this process lately.  We needn't flush the
+		 * other CPUs' TLBs: the Switcher flushes every time a CPU goes
+		 * into the Guest, and a Guest CPU which has the old entry in
+		 * its TLB right now gets a flush IPI from the Guest itself.
+		 */
+		for_each_shadow(cpu->lg, i, gpgdir)
+			do_set_pte(cpu, i, vaddr, gpte, PTE_EXT_NG);
 	}
+	mutex_unlock(&cpu->lg->pgdir_lock);
+}
+
+/*
+ * Set "num" consecutive PTEs of shadow page table "idx", starting at vaddr.
+ * The new Guest PTEs are in "gptes".  They all live in one PTE page, so we
+ * only need to look up the shadow PTE page once.
+ */
+static void do_set_pte_range(struct lg_cpu *cpu, int idx, unsigned long vaddr,
+			     pte_t *gptes, unsigned int num, unsigned long ext)
+{
+	pgd_t *spgd = spgd_addr(cpu, idx, vaddr);
+	pte_t *spte;
+	unsigned int i;
+
+	/* If the top level isn't present, there's no entry to update. */
+	if (!check_pmd(pmd_val(*pmd_offset(spgd, 0))))
+		return;
+
+	spte = spte_addr(cpu, spgd, vaddr);
+	for (i = 0; i < num; i++, vaddr += PAGE_SIZE)
+		if (!fixed_guest_pte(cpu, vaddr))
+			set_spte(cpu, spte + i, gptes[i], ext);
+}
+
+/*H:415
+ * In lazy mode the Guest sends us a whole run of PTE updates at once: "num"
+ * consecutive PTEs from vaddr, all in the same Guest PTE page, whose new
+ * values start at Guest-physical address "gptes".  We read them in chunks and
+ * find the shadow page tables only once for the lot, rather than going
+ * through guest_set_pte() for each.
+ */
+#define PTE_RANGE_CHUNK 64
+
+void guest_set_pte_range(struct lg_cpu *cpu, unsigned long gpgdir,
+			 unsigned long vaddr, unsigned long gptes,
+			 unsigned int num)
+{
+	pte_t buf[PTE_RANGE_CHUNK];
+	unsigned int n;
+	int i;
+
+	if (num > PTRS_PER_PTE || pte_index(vaddr) + num > PTRS_PER_PTE
+	    || (vaddr & ~PAGE_MASK)) {
+		kill_guest(cpu, "bad pte range %#lx+%u", vaddr, num);
+		return;
+	}
+
+	mutex_lock(&cpu->lg->pgdir_lock);
+	while (num) {
+		n = min_t(unsigned int, num, PTE_RANGE_CHUNK);
+		__lgread(cpu, buf, gptes, n * sizeof(pte_t));
+		if (cpu->lg->dead)
+			break;
+
+		/* User mappings only go into the shadows they belong to. */
+		if (vaddr < TASK_SIZE) {
+			for_each_shadow(cpu->lg, i, gpgdir)
+				do_set_pte_range(cpu, i, vaddr, buf, n,
+						 PTE_EXT_NG);
+		/* Kernel mappings must be changed on all top levels. */
+		} else {
+			for (i = 0; i < cpu->lg->nr_pgdirs; i++)
+				if (cpu->lg->pgdirs[i].pgdir)
+					do_set_pte_range(cpu, i, vaddr, buf, n,
+							 0);
+		}
+
+		num -= n;
+		vaddr += n * PAGE_SIZE;
+		gptes += n * sizeof(pte_t);
+	}
+	mutex_unlock(&cpu->lg->pgdir_lock);
 }
 
 
@@ -853,29 +1348,27 @@ void guest_set_pgd(struct lg_cpu *cpu, unsigned long gpgdir, u32 idx, unsigned l
 		return;
 	}
 
-	/* If they're talking about a page table we have a shadow for... */
-	pgdir = find_pgdir(cpu->lg, gpgdir);
-	if (pgdir <  ARRAY_SIZE(cpu->lg->pgdirs))
-		 /* ... throw it away. */
+	/* If they're talking about a page table we have shadows for... */
+	mutex_lock(&cpu->lg->pgdir_lock);
+	for_each_shadow(cpu->lg, pgdir, gpgdir)
+		/* ... throw it away. */
 		release_pgd(cpu->lg->pgdirs[pgdir].pgdir + idx);
-	return;
+	mutex_unlock(&cpu->lg->pgdir_lock);
 }
 
 
 
 /*H:505
  * Note: ARM Linux kernel adopts "section mapped mode" for all driect mapped memory.
- * But for the Guest's shadow page tables, we cannot use section mapped mode,
- * and we have to adopt "page mapped mode". Because real physical address of memory 
- * which the Guest runs on is not necessarily to be 1M aligned.
+ * The Guest's shadow page tables can only do the same where the Launcher's
+ * memory behind a section is physically contiguous and 1M aligned (see
+ * init_section_spgd()); elsewhere we have to adopt "page mapped mode".
  * Please see linux/arch/arm/mm/mmu.c 
  */
 static unsigned long setup_gpagetables(struct lguest *lg,
 				      unsigned long mem,
 				      unsigned long initrd_size)
 {
-#define MAX_GUEST_MEMORY 128
-
 	pgd_t __user *pgdir;
 	unsigned long mem_base = (unsigned long)lg->mem_base;
 	pmd_t *pmd;
@@ -884,17 +1377,18 @@ static unsigned long setup_gpagetables(struct lguest *lg,
 	pgd_t * pgd;
 
 	pgd = (pgd_t *)get_zeroed_page(GFP_KERNEL);
+	if (!pgd)
+		return -ENOMEM;
 	pmd = pmd_offset(pgd, 0);
 	mapped_sections = mem / SECTION_SIZE;
 
-	/* should we set a maximum size limit for the Guest? */
-	if(mapped_sections > MAX_GUEST_MEMORY)
-		mapped_sections = MAX_GUEST_MEMORY;
-
 	/* Address of the Guest's kernel page table.*/
 	pgdir = (pgd_t *)((void *)lg->kstart_paddr - 4 * PAGE_SIZE);
 
-	/*we are sure that one page is enough*/	
+	/*
+	 * One page holds a section entry for every megabyte from PAGE_OFFSET
+	 * up, and guest_max_memory() made sure we stop short of the Switcher.
+	 */
 	for(i = 0; i < mapped_sections; i++ ){
 		unsigned long phys = PHYS_OFFSET + i * SECTION_SIZE;
 		*pmd++ = __pmd(phys | GUEST_GPMD_KERNEL_FLAGS);
@@ -908,7 +1402,21 @@ static unsigned long setup_gpagetables(struct lguest *lg,
 error:
 	free_page((unsigned long)pgd);
 	return ret;
-#undef MAX_GUEST_MEMORY
+}
+
+/*
+ * How much memory can we direct map for the Guest?  It has to end below the
+ * Switcher, and like ARM Linux itself (vmalloc_min in arch/arm/mm/mmu.c) we
+ * leave the Guest 128M of vmalloc space under that.  It also has to fit in
+ * the one page of section entries setup_gpagetables() writes.
+ */
+static unsigned long guest_max_memory(void)
+{
+	unsigned long max = get_switcher_addr() - SZ_128M - PAGE_OFFSET;
+
+	max = min_t(unsigned long, max,
+		    (PAGE_SIZE / sizeof(pmd_t)) * SECTION_SIZE);
+	return max & PGDIR_MASK;
 }
 
 
@@ -953,6 +1461,57 @@ static int init_sptes(struct lguest *lg, pmd_t *pmd, unsigned long addr,
 
 
 
+/*
+ * Grab the Launcher pages behind the section at Launcher address vaddr.  If
+ * they are physically contiguous and the first is 1M aligned, we keep the
+ * references and return its pfn; otherwise we drop them and return -1UL.
+ */
+static unsigned long get_section_pfn(unsigned long vaddr, struct page **pages)
+{
+	int i, got, n = SECTION_SIZE >> PAGE_SHIFT;
+	unsigned long pfn;
+
+	got = get_user_pages_fast(vaddr, n, 1, pages);
+	if (got == n) {
+		pfn = page_to_pfn(pages[0]);
+		for (i = 1; i < n; i++)
+			if (page_to_pfn(pages[i]) != pfn + i)
+				break;
+		if (i == n && !(pfn & (n - 1)))
+			return pfn;
+	}
+
+	for (i = 0; i < got; i++)
+		put_page(pages[i]);
+	return -1UL;
+}
+
+/*H:506
+ * Every PTE of direct mapped memory costs us a get_pfn(), and the Guest
+ * kernel a TLB entry per page.  If both sections behind this PGD entry are
+ * physically contiguous and aligned, we map them with section entries
+ * instead.  Returns 0 if we did, otherwise the caller falls back to PTEs.
+ */
+static int init_section_spgd(struct lguest *lg, pmd_t *pmd, unsigned long addr,
+			     struct page **pages)
+{
+	unsigned long vaddr = (unsigned long)lg->mem_base + addr - PAGE_OFFSET;
+	unsigned long pfn[2];
+
+	pfn[0] = get_section_pfn(vaddr, pages);
+	if (pfn[0] == -1UL)
+		return -1;
+	pfn[1] = get_section_pfn(vaddr + SECTION_SIZE, pages);
+	if (pfn[1] == -1UL) {
+		release_section(__pmd(__pfn_to_phys(pfn[0])));
+		return -1;
+	}
+
+	pmd[0] = __pmd(__pfn_to_phys(pfn[0]) | GUEST_SPMD_SECT_FLAGS);
+	pmd[1] = __pmd(__pfn_to_phys(pfn[1]) | GUEST_SPMD_SECT_FLAGS);
+	return 0;
+}
+
 /*
  * Setting up Guest's shadow page table entries of direct mapped memory. 
  */
@@ -960,8 +1519,14 @@ static int setup_spagetable(struct lguest *lg, unsigned long mem)
 {
 	pgd_t *spgd;
 	unsigned long addr, end;
+	struct page **pages;
 	int ret = 0;
 
+	/* Room for the pages behind one section, for init_section_spgd(). */
+	pages = (struct page **)__get_free_page(GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
 	/**/
 	addr = PAGE_OFFSET;
 	end = addr + mem;
@@ -972,14 +1537,20 @@ static int setup_spagetable(struct lguest *lg, unsigned long mem)
 		unsigned long next = pgd_addr_end(addr, end);
 		pmd_t *pmd = pmd_offset(spgd, addr);
 
-		ret = init_sptes(lg, pmd, addr, next);
-		if(ret){
-			goto error;
+		if (next - addr == PGDIR_SIZE
+		    && init_section_spgd(lg, pmd, addr, pages) == 0) {
+			lg->direct_sections += 2;
+		} else {
+			ret = init_sptes(lg, pmd, addr, next);
+			if(ret){
+				goto error;
+			}
 		}
 		addr = next;
 	} while (spgd++, addr != end);
 
 error:
+	free_page((unsigned long)pages);
 	return ret;
 }
 
@@ -1032,18 +1603,33 @@ int init_guest_pagetable(struct lguest *lg)
 	}
 	if(!mem_size)
 		return -ENOMEM;
+	if (mem_size > guest_max_memory())
+		return -E2BIG;
+
+	/* Size this Guest's cache of shadow page tables. */
+	lg->nr_pgdirs = clamp(shadow_pgdirs, 2U, 64U);
+	lg->pgdirs = kcalloc(lg->nr_pgdirs, sizeof(*lg->pgdirs), GFP_KERNEL);
+	if (!lg->pgdirs)
+		return -ENOMEM;
+	mutex_init(&lg->pgdir_lock);
 
 	/*
 	 * We start on the first shadow page table, and give it a blank PGD page.
 	 */
 	lg->pgdirs[0].gpgdir = setup_gpagetables(lg, mem_size, initrd_size);
-	if (IS_ERR_VALUE(lg->pgdirs[0].gpgdir))
-		return lg->pgdirs[0].gpgdir;
+	if (IS_ERR_VALUE(lg->pgdirs[0].gpgdir)) {
+		ret = lg->pgdirs[0].gpgdir;
+		goto free_pgdirs;
+	}
 	lg->pgdirs[0].pgdir = (pgd_t *)__get_free_pages(GFP_KERNEL, 2); 
-	if (!lg->pgdirs[0].pgdir)
-		return -ENOMEM;
+	if (!lg->pgdirs[0].pgdir) {
+		ret = -ENOMEM;
+		goto free_pgdirs;
+	}
 
 	memset((void *)lg->pgdirs[0].pgdir, 0, PAGE_SIZE << 2);
+	memset(lg->pgdir_hash, 0xff, sizeof(lg->pgdir_hash));
+	pgdir_hash_add(lg, 0);
 	
 	lg->mem_size = mem_size;
 
@@ -1054,9 +1640,15 @@ int init_guest_pagetable(struct lguest *lg)
 	ret = setup_spagetable(lg, mem_size);
 	if(ret){
 		release_all_pagetables(lg);
-		return ret;
+		free_pages((unsigned long)lg->pgdirs[0].pgdir, 2);
+		goto free_pgdirs;
 	}
 	return 0;
+
+free_pgdirs:
+	kfree(lg->pgdirs);
+	lg->pgdirs = NULL;
+	return ret;
 }
 
 
@@ -1071,15 +1663,22 @@ void free_guest_pagetable(struct lguest *lg)
 {
 	unsigned int i;
 
+	if (!lg->pgdirs)
+		return;
+
 	/* Throw away all page table pages. */
 	release_all_pagetables(lg);
 	/* Now free the top levels: free_page() can handle 0 just fine. */
-	for (i = 0; i < ARRAY_SIZE(lg->pgdirs); i++){
+	for (i = 0; i < lg->nr_pgdirs; i++){
         if(lg->pgdirs[i].pgdir){
             free_pages((unsigned long)lg->pgdirs[i].pgdir, 2);
             lg->pgdirs[i].pgdir = NULL;
         }
     }
+
+	kfree(lg->pgdirs);
+	lg->pgdirs = NULL;
+	lg->nr_pgdirs = 0;
 }
 
 /*H:480
@@ -1117,6 +1716,14 @@ void map_switcher_in_guest(struct lg_cpu *cpu, struct lguest_pages *pages)
 				__pgprot((GUEST_BASE_PTE_FLAGS | L_PTE_DIRTY) & ~L_PTE_RDONLY));
 	index = PTRS_PER_PTE + pte_index((unsigned long)pages);
 	set_guest_pte(&switcher_pte_page[index], regs_pte, 0);
+
+	/*
+	 * The Guest's own idea of where its registers are is the same on every
+	 * Host CPU: the top page of the Switcher's 2M, LGUEST_REGS_ALIAS.  That
+	 * lets the CPUs of an SMP Guest share one "lguest_page_base".
+	 */
+	index = PTRS_PER_PTE + pte_index(get_switcher_addr() + LGUEST_REGS_ALIAS);
+	set_guest_pte(&switcher_pte_page[index], regs_pte, 0);
 }
 
 
@@ -1222,6 +1829,10 @@ __init int init_pagetables(struct page **switcher_page, unsigned int pages)
 {
 	unsigned int i;
 
+	/* The pages for each CPU mustn't run into LGUEST_REGS_ALIAS. */
+	if ((pages + 2 * nr_cpu_ids) * PAGE_SIZE > LGUEST_REGS_ALIAS)
+		return -E2BIG;
+
 	for_each_possible_cpu(i) {
 		switcher_pte_page(i) = (pte_t *)get_zeroed_page(GFP_KERNEL);
 		if (!switcher_pte_page(i)) {
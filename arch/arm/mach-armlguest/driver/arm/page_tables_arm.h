@@ -23,6 +23,11 @@
 	(PMD_SECT_WT | PMD_TYPE_SECT | PMD_SECT_AP_WRITE | PMD_DOMAIN(DOMAIN_KERNEL))
 
 
+/* Shadow section entries for the Guest's direct mapped memory. */
+#define GUEST_SPMD_SECT_FLAGS \
+	(PMD_SECT_WT | PMD_TYPE_SECT | PMD_SECT_AP_WRITE | PMD_SECT_AP_READ \
+	 | PMD_DOMAIN(DOMAIN_KERNEL))
+
 #define GUEST_BASE_PTE_FLAGS (L_PTE_PRESENT | L_PTE_YOUNG | L_PTE_MT_WRITETHROUGH \
 		| L_PTE_RDONLY | L_PTE_XN)
 
@@ -26,6 +26,7 @@
 #include <linux/lguest.h>
 #include <linux/lguest_launcher.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
 #include <asm/param.h>
 #include <asm/page.h>
 #include <asm/pgtable.h>
@@ -38,6 +39,9 @@
 #include <asm/mach-types.h>
 #include "../lg.h"
 
+#define CREATE_TRACE_POINTS
+#include "../trace.h"
+
 extern int cpu_architecture(void);
 /*
  * The Host and the Guest communicate with each other by two ways. one is 
@@ -149,25 +153,51 @@ static void run_guest_once(struct lg_cpu *cpu, struct lguest_pages *pages)
 
 /*:*/
 
+/*
+ * This supplies the Guest with time: every time we go back to the Guest, we
+ * stamp its lguest_clock with the monotonic time, so it can tell the time
+ * without asking.  We do it here, with interrupts off, as late as we can.
+ */
+static void write_clock(struct lg_cpu *cpu)
+{
+	struct lguest_clock *clock = &cpu->regs->clock;
+
+	clock->version++;
+	wmb();
+	clock->system_time = ktime_to_ns(ktime_get()) + cpu->lg->clock_offset;
+	wmb();
+	clock->version++;
+}
+
 /*H:040
  * Interrupts are disabled: we own the CPU.
  */
 void lguest_arch_run_guest(struct lg_cpu *cpu)
 {
+	write_clock(cpu);
+
 	/*
 	 * Now we actually run the Guest.  It will return when something
 	 * interesting happens, and we can examine its registers to see what it
 	 * was doing.
 	 */
+	trace_lguest_entry(cpu->id, cpu->regs->gregs.ARM_pc);
 	run_guest_once(cpu, lguest_pages(raw_smp_processor_id()));
+	trace_lguest_exit(cpu->id, cpu->regs->guest_retcode,
+			  cpu->regs->gregs.ARM_pc);
 }
 
 
 
-/*H:050 Once we've re-enabled interrupts, we look at why the Guest exited. */
+/*H:050
+ * Once we've re-enabled interrupts, we look at why the Guest exited.  We also
+ * time how long we take about it, for the statistics in lguest_stats.c.
+ */
 void lguest_arch_handle_return(struct lg_cpu *cpu)
 {
 		bool ret;
+		enum lg_exit_reason reason;
+		u64 start = local_clock();
 
 		switch(cpu->regs->guest_retcode){
 			case RET_UNF:
@@ -175,6 +205,7 @@ void lguest_arch_handle_return(struct lg_cpu *cpu)
 				 * The Guest encounters a undefined instruction. We do nothing here, 
 				 * and let the Guest handle it.
 				 */
+				reason = LG_EXIT_UNDEF;
 				break;
 
 			case RET_HCALL:
@@ -182,6 +213,7 @@ void lguest_arch_handle_return(struct lg_cpu *cpu)
 				 * The Guest send a hypercall to the Host.
 				 */
 				do_hypercalls(cpu);
+				reason = LG_EXIT_HCALL;
 				break;
 
 			case RET_PABT:
@@ -190,14 +222,18 @@ void lguest_arch_handle_return(struct lg_cpu *cpu)
 				 */
 				ret = guest_abort_handler(cpu, cpu->regs->gregs.ARM_r0, 
 											cpu->regs->gregs.ARM_r1 | FSR_LNX_PF);
+				trace_lguest_abort(cpu->id, cpu->regs->gregs.ARM_r0,
+						   cpu->regs->gregs.ARM_r1 | FSR_LNX_PF, ret);
 				/*
 				 * (ret == false) means that the Host cannot solve it, the Guest will handle it.
 				 * Otherwise, the problem is solved.
 				 */
 				if(ret == false){
 					cpu->regs->gregs.ARM_r4 = 1;
+					reason = LG_EXIT_GUEST_FAULT;
 				} else {
 					cpu->regs->gregs.ARM_r4 = 0;
+					reason = LG_EXIT_SHADOW_FAULT;
 				}
 				break;
 
@@ -206,14 +242,18 @@ void lguest_arch_handle_return(struct lg_cpu *cpu)
 				 * A data abort happened
 				 */
 				ret = guest_abort_handler(cpu, cpu->regs->gregs.ARM_r0, cpu->regs->gregs.ARM_r1);
+				trace_lguest_abort(cpu->id, cpu->regs->gregs.ARM_r0,
+						   cpu->regs->gregs.ARM_r1, ret);
 				/*
 				 * (ret == false) means that the Host cannot solve it, the Guest will handle it.
 				 * Otherwise, the problem is solved.
 				 */
 				if(ret == false){
 					cpu->regs->gregs.ARM_r4 = 1;
+					reason = LG_EXIT_GUEST_FAULT;
 				} else {
 					cpu->regs->gregs.ARM_r4 = 0;
+					reason = LG_EXIT_SHADOW_FAULT;
 				}
 				break;
 
@@ -224,17 +264,21 @@ void lguest_arch_handle_return(struct lg_cpu *cpu)
 				 * should now be run, then return to run the Guest again.
 				 */
 				cond_resched();
+				reason = LG_EXIT_IRQ;
 				break;
 
 			case RET_GSYSCALL:
 				/*
 				 * The Guest kernel receive a system call, we need to do nothing here.
 				 */
+				reason = LG_EXIT_SYSCALL;
 				break;
 			default:
 				kill_guest(cpu, "don't know why guest come back, return code %ld\n", cpu->regs->guest_retcode);					
+				return;
 		}
-		return;
+
+		lguest_account(&cpu->stats.exits[reason], local_clock() - start);
 }
 
 
@@ -267,19 +311,17 @@ void __init lguest_arch_host_init(void)
 /*L:030
  * lguest_arch_setup_regs()
  * The Guest set r0, r1, r2, r9 and cspr for the Guest to start,
- * and set some members of "struct lguest_regs"
+ * and set some members of "struct lguest_regs".  Only CPU 0 boots the
+ * kernel: the others get their starting registers from guest_cpu_up().
  */
 void lguest_arch_setup_regs(struct lg_cpu *cpu, unsigned long start)
 {
 	struct lguest_regs *regs = cpu->regs;
-
-	struct hcall_args *hcalls = regs->hcalls;
-	int i;
 	unsigned int gcopro;
 
+	/* The hypercall ring mustn't squeeze the Switcher's stack too far. */
+	BUILD_BUG_ON(SPARE_SIZE < 1024);
 
-    /* Set up the Guest's page tables to map low level vectors of the Guest */
-	map_vectors_in_guest(cpu, GUEST_VECTOR_ADDRESS);
 
 	/* Switcher code will set domain register for the Guest according to this value */
 	regs->guest_domain = (domain_val(DOMAIN_USER, DOMAIN_MANAGER) | \
@@ -289,23 +331,28 @@ void lguest_arch_setup_regs(struct lg_cpu *cpu, unsigned long start)
 
 
 
-	/* r0  = cp#15 control register */
-	regs->gregs.ARM_r0 = cr_alignment; 
 	regs->guest_ctrl = cr_alignment;
-	/* r1  = machine ID. please see linux/arch/arm/include/asm/mach-types.h*/
-	regs->gregs.ARM_r1 = MACH_TYPE_ARMLGUEST;
-	/* r2  = atags pointer */
-	regs->gregs.ARM_r2 = 0x80000100;
-	/* r9  = processor ID*/
-	regs->gregs.ARM_r9 = GUEST_PROCESSOR_ID;
-
-	/* 
-	 * The address of the Guest startup entry.
-	 * Please see linux/arch/arm/mach-armlguest/kernel/lguest-entry-armv.S
-	 */
-	regs->gregs.ARM_pc = GUEST_KERNEL_START;
-
-	regs->gregs.ARM_cpsr = PSR_F_BIT | PSR_I_BIT | SVC_MODE;
+	if (cpu->id == 0) {
+		/* Set up the Guest's page tables to map low level vectors of the Guest */
+		map_vectors_in_guest(cpu, GUEST_VECTOR_ADDRESS);
+
+		/* r0  = cp#15 control register */
+		regs->gregs.ARM_r0 = cr_alignment; 
+		/* r1  = machine ID. please see linux/arch/arm/include/asm/mach-types.h*/
+		regs->gregs.ARM_r1 = MACH_TYPE_ARMLGUEST;
+		/* r2  = atags pointer */
+		regs->gregs.ARM_r2 = 0x80000100;
+		/* r9  = processor ID*/
+		regs->gregs.ARM_r9 = GUEST_PROCESSOR_ID;
+
+		/* 
+		 * The address of the Guest startup entry.
+		 * Please see linux/arch/arm/mach-armlguest/kernel/lguest-entry-armv.S
+		 */
+		regs->gregs.ARM_pc = GUEST_KERNEL_START;
+
+		regs->gregs.ARM_cpsr = PSR_F_BIT | PSR_I_BIT | SVC_MODE;
+	}
 
 	
 	/* 
@@ -340,9 +387,43 @@ void lguest_arch_setup_regs(struct lg_cpu *cpu, unsigned long start)
 	/*
 	 * initialize the hypercall structure.
 	 */
-	page_table_guest_hcall_init(cpu);
-	for (i = 0; i < LHCALL_RING_SIZE; i++) {
-		hcalls[i].arg0 = 0xffffffff;	
+	if (cpu->id == 0)
+		page_table_guest_hcall_init(cpu);
+	cpu->next_hcall = 0;
+	regs->hcall_prod = regs->hcall_cons = 0;
+	regs->hcall_ring_size = LHCALL_RING_SIZE;
+}
+
+/*L:035
+ * guest_cpu_up()
+ * The Guest's boot CPU starts a secondary CPU "id" with LHCALL_CPU_UP.  The
+ * new CPU gets its own shadow of the Guest's kernel page table, and begins at
+ * GUEST_SECONDARY_START in SVC mode with its kernel stack pointer in r0.
+ * The vectors page is shared by every shadow, so it's already mapped.
+ */
+void guest_cpu_up(struct lg_cpu *cpu, unsigned long id, unsigned long sp,
+		  unsigned long pgtable)
+{
+	struct lg_cpu *target;
+
+	if (id == 0 || id >= cpu->lg->nr_cpus || cpu->lg->cpus[id].started) {
+		kill_guest(cpu, "bad CPU_UP of cpu %lu", id);
+		return;
 	}
+	target = &cpu->lg->cpus[id];
+
+	if (!guest_new_cpu_pagetable(cpu, target, pgtable)) {
+		kill_guest(cpu, "no page table for cpu %lu", id);
+		return;
+	}
+
+	target->regs->gregs.ARM_pc = GUEST_SECONDARY_START;
+	target->regs->gregs.ARM_r0 = sp;
+	target->regs->gregs.ARM_cpsr = PSR_F_BIT | PSR_I_BIT | SVC_MODE;
+
+	/* Its registers must be there before it runs: see run_guest(). */
+	smp_wmb();
+	target->started = 1;
+	wake_up_process(target->tsk);
 }
 
@@ -6,6 +6,7 @@
 #include <linux/init.h>
 #include <linux/stringify.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
 #include <linux/hrtimer.h>
 #include <linux/err.h>
 
@@ -22,6 +23,71 @@ int init_pagetables(struct page **switcher_page, unsigned int pages);
 struct pgdir {
 	unsigned long gpgdir;
 	pgd_t *pgdir;
+	/* Which of the Guest's CPUs runs on this shadow: see guest_switch_mm(). */
+	unsigned int cpu;
+	/* The Guest's context id (ASID) this shadow was last used with. */
+	unsigned long context_id;
+	/* When we last switched to it: used to pick the LRU victim. */
+	unsigned long last_used;
+	/* The next shadow on the same pgdir_hash chain, or -1. */
+	int hash_next;
+};
+
+/* Shadows are found by Guest top-level through a small hash table. */
+#define PGDIR_HASH_BITS 5
+
+/* How well our cache of shadow page tables is doing. */
+struct pgdir_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/* Why the Guest came back to us: see lguest_arch_handle_return(). */
+enum lg_exit_reason {
+	LG_EXIT_UNDEF,
+	LG_EXIT_HCALL,
+	/* An abort we fixed by filling in the shadow page tables. */
+	LG_EXIT_SHADOW_FAULT,
+	/* An abort the Guest has to handle itself. */
+	LG_EXIT_GUEST_FAULT,
+	LG_EXIT_IRQ,
+	LG_EXIT_SYSCALL,
+	LG_EXIT_NR
+};
+
+/* Hypercall numbers are all below this: see asm/lguest_hcall.h. */
+#define LG_HCALL_NR 64
+
+/*
+ * Handling times go in power-of-two buckets: bucket 0 is under 256ns,
+ * bucket n is [2^(n+7), 2^(n+8)) ns, and the last one catches the rest.
+ */
+#define LG_HIST_BUCKETS 16
+
+struct lg_exit_stat {
+	u64 count;
+	u64 total_ns;
+	u32 hist[LG_HIST_BUCKETS];
+};
+
+/*
+ * Only the vCPU's own thread writes these, so they need no lock; debugfs
+ * readers may see a slightly torn snapshot, which is fine for statistics.
+ */
+struct lg_cpu_stats {
+	struct lg_exit_stat exits[LG_EXIT_NR];
+	struct lg_exit_stat hcalls[LG_HCALL_NR];
+	/* Virtual timer expiries, and times the Guest went idle. */
+	unsigned long timer;
+	unsigned long halts;
+	/* Shadow PTEs filled in around a fault: see fault_around_page(). */
+	unsigned long prefaulted;
+	/* Halts ended by an interrupt while polling, and polls which slept. */
+	unsigned long halt_polled;
+	unsigned long halt_poll_missed;
+	/* Exits forced by the Guest filling its lazy hypercall ring. */
+	unsigned long hcall_ring_full;
 };
 
 
@@ -67,22 +133,41 @@ struct lg_cpu {
 
 	int cpu_pgd; /* Which pgd this cpu is currently using */
 
+	/* Has the Guest brought this CPU up yet?  CPU 0 is up from the start. */
+	int started;
+
 	/* If a hypercall was asked for, this points to the arguments. */
 	struct hcall_args *hcall;
 	u32 next_hcall;
 
-	/* Virtual clock device */
+	/* Virtual clock device, and the deadline we last set it for. */
 	struct hrtimer hrt;
+	u64 timer_deadline;
 
-	/* Did the Guest tell us to halt? */
+	/* Did the Guest tell us to halt?  And how long to poll when it does. */
 	int halted;
+	unsigned int halt_poll_ns;
 
-	/* Pending virtual interrupts */
-	DECLARE_BITMAP(irqs_pending, LGUEST_IRQS);
+	/* Where the time goes: see lguest_stats.c. */
+	struct lg_cpu_stats stats;
 
 	struct lg_cpu_arch arch;
 };
 
+/*
+ * What LHREQ_SAVECPU hands the Launcher for a snapshot, and LHREQ_RESTORECPU
+ * takes back.  The Launcher keeps it without looking inside.
+ */
+struct lg_cpu_state {
+	/* sizeof(struct lg_cpu_state), so a different Host can tell. */
+	u32 size;
+	u32 halted;
+	u32 next_hcall;
+	/* The Guest's clock when it was saved. */
+	u64 guest_time;
+	struct lguest_regs regs;
+};
+
 struct lg_eventfd {
 	unsigned long addr;
 	struct eventfd_ctx *event;
@@ -109,19 +194,43 @@ struct lguest {
 	unsigned long kernel_address;
 	unsigned long kstart_paddr;
 
-	struct pgdir pgdirs[4];
+	/*
+	 * The cache of shadow page tables: nr_pgdirs entries, and a clock
+	 * which is bumped every time we switch, for the LRU.
+	 */
+	struct pgdir *pgdirs;
+	unsigned int nr_pgdirs;
+	unsigned long pgdir_clock;
+	/* Chains of shadows, by the Guest top-level they shadow. */
+	int pgdir_hash[1 << PGDIR_HASH_BITS];
+	struct pgdir_stats pgdir_stats;
+	/* The CPUs of an SMP Guest share the above: this protects them. */
+	struct mutex pgdir_lock;
 
 	unsigned long noirq_start, noirq_end;
 
 	unsigned int stack_pages;
 	u32 tsc_khz;
 
+	/*
+	 * The Guest's clock runs this many nanoseconds ahead of the Host's:
+	 * only a Guest restored from a snapshot has one.
+	 */
+	s64 clock_offset;
+
 	struct lg_eventfd_map *eventfds;
+	/* Eventfds which raise an interrupt when signalled: see attach_irqfd. */
+	struct list_head irqfds;
 
 	unsigned long mem_size;
+	/* How many sections of direct mapped memory have section entries. */
+	unsigned int direct_sections;
 
 	/* Dead? */
 	const char *dead;
+
+	/* Our directory under /sys/kernel/debug/lguest. */
+	struct dentry *debugfs;
 };
 
 extern struct mutex lguest_lock;
@@ -157,7 +266,10 @@ int run_guest(struct lg_cpu *cpu, unsigned long __user *user);
 unsigned int interrupt_pending(struct lg_cpu *cpu, bool *more);
 void set_interrupt(struct lg_cpu *cpu, unsigned int irq);
 void send_interrupt_to_guest(struct lg_cpu *cpu);
-void guest_set_clockevent(struct lg_cpu *cpu, unsigned long delta);
+void guest_halt(struct lg_cpu *cpu);
+void guest_block_irq(struct lg_cpu *cpu, unsigned long irq, unsigned long block);
+void guest_send_ipi(struct lg_cpu *cpu, unsigned long mask, unsigned long ipi);
+void guest_set_clockevent(struct lg_cpu *cpu, bool asked);
 bool send_notify_to_eventfd(struct lg_cpu *cpu);
 void init_clockdev(struct lg_cpu *cpu);
 bool check_syscall_vector(struct lguest *lg);
@@ -170,10 +282,15 @@ int init_guest_pagetable(struct lguest *lg);
 void free_guest_pagetable(struct lguest *lg);
 void guest_switch_mm(struct lg_cpu *cpu, unsigned long pgtable,
                 unsigned long context_id);
+bool guest_new_cpu_pagetable(struct lg_cpu *cpu, struct lg_cpu *target,
+			     unsigned long pgtable);
 void guest_set_pgd(struct lg_cpu *cpu, unsigned long gpgdir, u32 i, unsigned long gpmd);
 void guest_set_pmd(struct lguest *lg, unsigned long gpgdir, u32 i);
 void guest_set_pte(struct lg_cpu *cpu, unsigned long gpgdir,
 		   unsigned long vaddr, pte_t val);
+void guest_set_pte_range(struct lg_cpu *cpu, unsigned long gpgdir,
+			 unsigned long vaddr, unsigned long gptes,
+			 unsigned int num);
 void map_switcher_in_guest(struct lg_cpu *cpu, struct lguest_pages *pages);
 bool guest_abort_handler(struct lg_cpu *cpu, unsigned long vaddr, unsigned long fsr);
 unsigned long guest_pa(struct lg_cpu *cpu, unsigned long vaddr);
@@ -182,6 +299,7 @@ int init_vectors_pte(unsigned long addr, unsigned long gvector_addr);
 void map_vectors_in_guest(struct lg_cpu *cpu, unsigned long gvector_addr);
 void free_vectors_pte(void);
 void release_guest_nondirect_mapped_memory(struct lguest *lg);
+int guest_release_pages(struct lguest *lg, unsigned long pfn, unsigned long num);
 
 /*arm/init.c*/
 int copy_guest_vectors(const void __user *vectors, const unsigned long len);
@@ -197,6 +315,8 @@ void lguest_arch_handle_return(struct lg_cpu *cpu);
 int lguest_arch_init_hypercalls(struct lg_cpu *cpu);
 int lguest_arch_do_hcall(struct lg_cpu *cpu, struct hcall_args *args);
 void lguest_arch_setup_regs(struct lg_cpu *cpu, unsigned long start);
+void guest_cpu_up(struct lg_cpu *cpu, unsigned long id, unsigned long sp,
+		  unsigned long pgtable);
 
 /* <arch>/switcher.S: */
 extern char start_switcher_text[], end_switcher_text[], switch_to_guest[];
@@ -208,6 +328,14 @@ void lguest_device_remove(void);
 /* hypercalls.c: */
 void do_hypercalls(struct lg_cpu *cpu);
 
+/* lguest_stats.c: */
+void lguest_account(struct lg_exit_stat *stat, u64 ns);
+int lguest_stats_init(void);
+void lguest_stats_exit(void);
+void lguest_stats_add_guest(struct lguest *lg);
+void lguest_stats_add_cpu(struct lg_cpu *cpu);
+void lguest_stats_remove_guest(struct lguest *lg);
+
 
 
 /*L:035
@@ -11,13 +11,29 @@
 #include <linux/mod_devicetable.h>
 #include <linux/radix-tree.h>
 #include <linux/mutex.h>
-#include <linux/skbuff.h>
+#include <linux/rcupdate.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
 #include <linux/lguest_rpmsg.h>
 
 /* vim: set ts=8 sts=8 sw=8 noet: */
 
 #define RPMSG_NS_ADDR 53
 
+/*
+ * The largest message rpmsg will carry, header included.  This mirrors
+ * RPMSG_BUF_SIZE, which virtio_rpmsg_bus keeps to itself.
+ */
+#define LGR_MSG_SIZE 512
+
+/*
+ * Received messages are packed back-to-back into a per-channel ring, each
+ * one a struct rpmsg_hdr followed by its payload.  64k holds a full rx
+ * virtqueue's worth of maximum-sized messages with room to spare.
+ */
+#define LGR_RX_RING_SIZE (64 * 1024)
+
 static unsigned long timeout_delay;
 
 struct lgr_channel;
@@ -25,7 +41,8 @@ struct lgr_channel;
 static void receive_message(struct rpmsg_channel *rpdev, void *data,
 		int len, void *priv, u32 src);
 
-static int enqueue_rx_message(struct lgr_channel *lgr, struct rpmsg_hdr *msg);
+static int enqueue_rx_message(struct lgr_channel *lgr,
+		struct rpmsg_hdr *hdr, const void *data);
 
 static struct lgr_endpoint *translate_guest_address(struct lgr_channel *lgr,
 		u32 guest_addr);
@@ -42,10 +59,21 @@ struct lgr_channel {
 	/* A radix tree mapping guest-side rpmsg addresses to endpoints. */
 	struct radix_tree_root guest_epts;
 
-	/* Reads waiting for a message to arrive. */
+	/* Reads (and pollers) waiting for a message to arrive. */
 	wait_queue_head_t rx_waiters;
-	/* The queue of messages that have not been returned to userspace. */
-	struct sk_buff_head rx_queue;
+	/* Messages that have not been returned to userspace yet. */
+	struct kfifo rx_ring;
+	/* Serializes producers into rx_ring; taken from the rx interrupt. */
+	spinlock_t rx_lock;
+	/* Serializes readers out of rx_ring. */
+	struct mutex rx_mutex;
+	/* Messages we threw away because rx_ring was full. */
+	unsigned long rx_dropped;
+
+	/* Serializes writers, and protects tx_buf. */
+	struct mutex tx_mutex;
+	/* Where a message from userspace is staged before we send it. */
+	u8 tx_buf[LGR_MSG_SIZE];
 
 	/* The driver that gets probed by the rpmsg bus. */
 	struct rpmsg_driver channel_driver;
@@ -129,13 +157,8 @@ static int rpdrv_probe(struct rpmsg_channel *rpdev)
 	struct device_driver *drv = rpdev->dev.driver;
 	struct lgr_channel *lgr = 
 		container_of(drv, struct lgr_channel, channel_driver.drv);
-	struct rpmsg_hdr *hdr;
-	struct rpmsg_ns_msg *ns;
-
-	char msg[sizeof(*hdr) + sizeof(*ns)];
-
-	hdr = (struct rpmsg_hdr *)msg;
-	ns = (struct rpmsg_ns_msg *)hdr->data;
+	struct rpmsg_hdr hdr;
+	struct rpmsg_ns_msg ns;
 
 	/*
 	 * Capture the channel - getting this pointer is the whole point
@@ -153,17 +176,17 @@ static int rpdrv_probe(struct rpmsg_channel *rpdev)
 
 	/* Send a name-service message advertising the requested channel. */
 
-	memcpy(ns->name, lgr->id_table[0].name, RPMSG_NAME_SIZE);
-	ns->addr = rpdev->dst;
-	ns->flags = RPMSG_NS_CREATE;
+	memcpy(ns.name, lgr->id_table[0].name, RPMSG_NAME_SIZE);
+	ns.addr = rpdev->dst;
+	ns.flags = RPMSG_NS_CREATE;
 
-	hdr->len = sizeof(*ns);
-	hdr->flags = 0;
-	hdr->src = rpdev->src;
-	hdr->dst = RPMSG_NS_ADDR;
-	hdr->reserved = 0;
+	hdr.len = sizeof(ns);
+	hdr.flags = 0;
+	hdr.src = rpdev->src;
+	hdr.dst = RPMSG_NS_ADDR;
+	hdr.reserved = 0;
 
-	return enqueue_rx_message(lgr, hdr);
+	return enqueue_rx_message(lgr, &hdr, &ns);
 }
 
 static void rpdrv_remove(struct rpmsg_channel *rpdev)
@@ -175,22 +198,33 @@ static void rpdrv_remove(struct rpmsg_channel *rpdev)
 	 */
 }
 
-/* Enqueue the rpmsg message @msg into the RX message queue. */
-static int enqueue_rx_message(struct lgr_channel *lgr, struct rpmsg_hdr *msg)
+/*
+ * Append the header @hdr and its @hdr->len bytes of payload at @data to the
+ * RX ring.  This is called from the rpmsg receive callback, which runs in
+ * interrupt context, so it neither allocates nor sleeps: the payload is
+ * copied straight out of the virtqueue buffer into the ring, once.
+ */
+static int enqueue_rx_message(struct lgr_channel *lgr,
+		struct rpmsg_hdr *hdr, const void *data)
 {
-	struct sk_buff *skb;
-	size_t len = msg->len + sizeof(*msg);
-
-	skb = alloc_skb(len, GFP_KERNEL);
-	if (!skb)
-		return -ENOMEM;
-
-	memcpy(skb_put(skb, len), msg, len);
+	unsigned long flags;
+	int rc = 0;
+
+	spin_lock_irqsave(&lgr->rx_lock, flags);
+	/* A message goes in whole or not at all. */
+	if (kfifo_avail(&lgr->rx_ring) < sizeof(*hdr) + hdr->len) {
+		lgr->rx_dropped++;
+		rc = -ENOBUFS;
+	} else {
+		kfifo_in(&lgr->rx_ring, hdr, sizeof(*hdr));
+		kfifo_in(&lgr->rx_ring, data, hdr->len);
+	}
+	spin_unlock_irqrestore(&lgr->rx_lock, flags);
 
-	skb_queue_tail(&lgr->rx_queue, skb);
-	wake_up_interruptible(&lgr->rx_waiters);
+	if (!rc)
+		wake_up_interruptible(&lgr->rx_waiters);
 
-	return 0;
+	return rc;
 }
 
 static void receive_message(struct rpmsg_channel *rpdev, void *data,
@@ -198,8 +232,7 @@ static void receive_message(struct rpmsg_channel *rpdev, void *data,
 {
 	struct lgr_endpoint *ept = priv;
 	struct lgr_channel *lgr;
-	char msg_buf[512];
-	struct rpmsg_hdr *hdr = (struct rpmsg_hdr *)msg_buf;
+	struct rpmsg_hdr hdr;
 
 	if (!priv) {
 		/*
@@ -220,15 +253,17 @@ static void receive_message(struct rpmsg_channel *rpdev, void *data,
 
 	lgr = ept->channel;
 
-	hdr->len = min((ARRAY_SIZE(msg_buf) - sizeof(*hdr)), (size_t)len);
-	hdr->flags = 0;
-	hdr->src = src;
+	hdr.len = len;
+	hdr.flags = 0;
+	hdr.src = src;
 	/* Reverse-translate dest address. */
-	hdr->dst = ept->guest_addr;
-	hdr->reserved = 0;
-	memcpy(hdr->data, data, hdr->len);
+	hdr.dst = ept->guest_addr;
+	hdr.reserved = 0;
 
-	WARN_ON(enqueue_rx_message(lgr, hdr));
+	/* Userspace isn't keeping up: the sender will have to retry. */
+	if (enqueue_rx_message(lgr, &hdr, data) && printk_ratelimit())
+		dev_warn(&rpdev->dev, "RX ring full, dropped message (%lu)\n",
+			 lgr->rx_dropped);
 }
 
 static int initialize_driver(struct lgr_channel *lgr, const char __user *channel)
@@ -264,10 +299,18 @@ static int lgr_open(struct inode *inode, struct file *file)
 		return -ENOMEM;
 	}
 
+	if (kfifo_alloc(&lgr->rx_ring, LGR_RX_RING_SIZE, GFP_KERNEL)) {
+		pr_err("Could not allocate RX ring\n");
+		kfree(lgr);
+		return -ENOMEM;
+	}
+
 	/* Initialize struct. */
 
 	mutex_init(&lgr->lock);
-	skb_queue_head_init(&lgr->rx_queue);
+	spin_lock_init(&lgr->rx_lock);
+	mutex_init(&lgr->rx_mutex);
+	mutex_init(&lgr->tx_mutex);
 	init_waitqueue_head(&lgr->rx_waiters);
 	init_completion(&lgr->driver_probed);
 	INIT_RADIX_TREE(&lgr->guest_epts, GFP_KERNEL);
@@ -276,65 +319,95 @@ static int lgr_open(struct inode *inode, struct file *file)
 	return 0;
 }
 
-static ssize_t lgr_read(struct file *file, char __user *user, size_t size,loff_t*o)
+/* Wait for our driver to be probed, if that hasn't happened yet. */
+static int lgr_wait_probed(struct lgr_channel *lgr)
 {
-	struct lgr_channel *lgr = file->private_data;
-	struct sk_buff *skb;
-	ssize_t rc = 0;
+	long rc;
 
-	if (unlikely(!lgr->initialized)) {
-		rc = wait_for_completion_interruptible_timeout(
-				&lgr->driver_probed, timeout_delay);
-		if (rc < 0)
-			return rc;
-		else if (rc == 0)
-			return -ETIME;
-	}
-
-	if (wait_event_interruptible(lgr->rx_waiters,
-			(skb = skb_dequeue(&lgr->rx_queue))))
-		return -ERESTARTSYS;
-
-	rc = min(size, skb->len);
+	if (likely(lgr->initialized))
+		return 0;
 
-	if (copy_to_user(user, skb->data, rc)) {
-		dev_err(&lgr->channel->dev, "%s: copy_to_user failed", __func__);
-		rc = -EFAULT;
-	}
+	rc = wait_for_completion_interruptible_timeout(
+			&lgr->driver_probed, timeout_delay);
+	if (rc < 0)
+		return rc;
+	else if (rc == 0)
+		return -ETIME;
 
-	kfree_skb(skb);
-	return rc;
+	return 0;
 }
 
-static ssize_t lgr_write(struct file *file, const char __user *in,
-		     size_t size, loff_t *off)
+/*
+ * Each iovec segment receives exactly one message, so one readv() can drain
+ * a whole batch (a plain read() is just a single segment).  We only sleep for
+ * the first message: after that we return as soon as the ring runs dry.  A
+ * message too big for its segment is truncated, as it always has been.
+ */
+static ssize_t lgr_aio_read(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
 {
+	struct file *file = iocb->ki_filp;
 	struct lgr_channel *lgr = file->private_data;
-	char message_buf[512];
-	ssize_t rc = 0;
-	size_t len;
-	struct rpmsg_hdr *hdr = (struct rpmsg_hdr *)message_buf;
-	struct lgr_endpoint *ept;
+	ssize_t total = 0;
+	unsigned long seg;
+	int rc;
 
-	if (unlikely(!lgr->initialized)) {
-		/* Wait for our driver to be probed. */
-		rc = wait_for_completion_interruptible_timeout(
-				&lgr->driver_probed, timeout_delay);
-		if (rc < 0)
-			return rc;
-		else if (rc == 0)
-			return -ETIME;
-	}
+	rc = lgr_wait_probed(lgr);
+	if (rc)
+		return rc;
+
+	if (mutex_lock_interruptible(&lgr->rx_mutex))
+		return -ERESTARTSYS;
 
-	len = min(sizeof(message_buf), size);
+	for (seg = 0; seg < nr_segs; seg++) {
+		struct rpmsg_hdr hdr;
+		unsigned int len, want, copied = 0;
 
-	if (copy_from_user(message_buf, in, len))
-		return -EFAULT;
+		if (kfifo_is_empty(&lgr->rx_ring)) {
+			if (total)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				rc = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(lgr->rx_waiters,
+					!kfifo_is_empty(&lgr->rx_ring))) {
+				rc = -ERESTARTSYS;
+				break;
+			}
+		}
 
-	hdr->len = len - sizeof(*hdr);
+		/* Messages only ever go in whole, so the header is there. */
+		kfifo_out_peek(&lgr->rx_ring, &hdr, sizeof(hdr));
+		len = sizeof(hdr) + hdr.len;
+		want = min_t(size_t, len, iov[seg].iov_len);
 
-	if (mutex_lock_killable(&lgr->lock))
-		return -ERESTARTSYS;
+		rc = kfifo_to_user(&lgr->rx_ring, iov[seg].iov_base, want,
+				   &copied);
+
+		/* Never leave part of a message behind in the ring. */
+		for (; copied < len; copied++)
+			kfifo_skip(&lgr->rx_ring);
+
+		if (rc)
+			break;
+		total += want;
+	}
+
+	mutex_unlock(&lgr->rx_mutex);
+	return total ? total : rc;
+}
+
+/*
+ * Send the message staged in lgr->tx_buf on behalf of the Guest.  Its
+ * addresses are the Guest's, so they get translated to our endpoints first.
+ * Called with lgr->tx_mutex held.
+ */
+static int lgr_send(struct lgr_channel *lgr, bool nonblock)
+{
+	struct rpmsg_hdr *hdr = (struct rpmsg_hdr *)lgr->tx_buf;
+	struct lgr_endpoint *ept;
+	int rc;
 
 	/* Translate inbound name-service messages. */
 
@@ -344,12 +417,12 @@ static ssize_t lgr_write(struct file *file, const char __user *in,
 
 		/* Paranoia. */
 		if (hdr->len != sizeof(*ns))
-			return -EINVAL;	
+			return -EINVAL;
 
 		ns_ept = translate_guest_address(lgr, ns->addr);
 		if (IS_ERR_OR_NULL(ns_ept))
 			return ns_ept ? PTR_ERR(ns_ept) : -EFAULT;
-		
+
 		/*
 		 * If this is a name-service create, mark this endpoint struct
 		 * as being assigned to the name service, so we can clean it up
@@ -360,7 +433,7 @@ static ssize_t lgr_write(struct file *file, const char __user *in,
 		 */
 		if (!(ns->flags & RPMSG_NS_DESTROY)) {
 			ns_ept->is_ns_ept = true;
-			memcpy(ept->ns_name, ns->name, RPMSG_NAME_SIZE);
+			memcpy(ns_ept->ns_name, ns->name, RPMSG_NAME_SIZE);
 		} else {
 			ns_ept->is_ns_ept = false;
 		}
@@ -377,14 +450,83 @@ static ssize_t lgr_write(struct file *file, const char __user *in,
 
 	hdr->src = ept->host_addr;
 
-	rc = rpmsg_send_offchannel(lgr->channel, hdr->src, hdr->dst, 
+	if (!nonblock)
+		return rpmsg_send_offchannel(lgr->channel, hdr->src, hdr->dst,
+				hdr->data, hdr->len);
+
+	/* No free virtqueue buffer means "try again later" to a poller. */
+	rc = rpmsg_trysend_offchannel(lgr->channel, hdr->src, hdr->dst,
 			hdr->data, hdr->len);
+	return rc == -ENOMEM ? -EAGAIN : rc;
+}
 
+/*
+ * The mirror image of lgr_aio_read(): each iovec segment is one complete
+ * message, header included, so one writev() sends a whole batch.
+ */
+static ssize_t lgr_aio_write(struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct file *file = iocb->ki_filp;
+	struct lgr_channel *lgr = file->private_data;
+	struct rpmsg_hdr *hdr = (struct rpmsg_hdr *)lgr->tx_buf;
+	ssize_t total = 0;
+	unsigned long seg;
+	int rc;
+
+	rc = lgr_wait_probed(lgr);
 	if (rc)
 		return rc;
-	else
-		return len;
 
+	if (mutex_lock_killable(&lgr->tx_mutex))
+		return -ERESTARTSYS;
+
+	for (seg = 0; seg < nr_segs; seg++) {
+		size_t len = iov[seg].iov_len;
+
+		if (len < sizeof(*hdr) || len > LGR_MSG_SIZE) {
+			rc = -EMSGSIZE;
+			break;
+		}
+
+		if (copy_from_user(lgr->tx_buf, iov[seg].iov_base, len)) {
+			rc = -EFAULT;
+			break;
+		}
+
+		hdr->len = len - sizeof(*hdr);
+
+		rc = lgr_send(lgr, file->f_flags & O_NONBLOCK);
+		if (rc)
+			break;
+		total += len;
+	}
+
+	mutex_unlock(&lgr->tx_mutex);
+	return total ? total : rc;
+}
+
+/*
+ * We're readable whenever there's a message in the ring.  Writes only ever
+ * wait for a free virtqueue buffer, so we always call ourselves writable once
+ * the channel is up.
+ */
+static unsigned int lgr_poll(struct file *file, poll_table *wait)
+{
+	struct lgr_channel *lgr = file->private_data;
+	unsigned int mask;
+
+	/* rpdrv_probe() queues a message, so this also wakes us for that. */
+	poll_wait(file, &lgr->rx_waiters, wait);
+
+	if (!lgr->initialized)
+		return 0;
+
+	mask = POLLOUT | POLLWRNORM;
+	if (!kfifo_is_empty(&lgr->rx_ring))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
 }
 
 static long lgr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
@@ -477,11 +619,22 @@ static int lgr_close(struct inode *inode, struct file *file)
 
 	}
 
-	mutex_destroy(&lgr->lock);
 	complete_all(&lgr->driver_probed);
 	if (lgr->driver_registered)
 		unregister_rpmsg_driver(&lgr->channel_driver);
 
+	/*
+	 * Nothing can probe us or find our endpoints any more, but a receive
+	 * callback could still be running from the virtqueue interrupt, which
+	 * uses the ring.  Wait for it before we free anything.
+	 */
+	synchronize_sched();
+
+	mutex_destroy(&lgr->lock);
+	mutex_destroy(&lgr->rx_mutex);
+	mutex_destroy(&lgr->tx_mutex);
+	kfifo_free(&lgr->rx_ring);
+
 	kfree(lgr);
 
 	return 0;
@@ -490,8 +643,11 @@ static int lgr_close(struct inode *inode, struct file *file)
 static struct file_operations lguest_rpmsg_fops = {
 	.owner		= THIS_MODULE,
 	.open		= lgr_open,
-	.read		= lgr_read,
-	.write		= lgr_write,
+	.read		= do_sync_read,
+	.aio_read	= lgr_aio_read,
+	.write		= do_sync_write,
+	.aio_write	= lgr_aio_write,
+	.poll		= lgr_poll,
 	.unlocked_ioctl	= lgr_ioctl,
 	.release	= lgr_close,
 };
@@ -0,0 +1,208 @@
+/*
+ * Where does a Guest's time go?  Every return from the Switcher and every
+ * hypercall is counted and timed per vCPU, and the totals are shown under
+ * /sys/kernel/debug/lguest/<launcher pid>/: one file per vCPU, and "all"
+ * summing them for the whole Guest.  "all" also shows how the shadow pgdir
+ * cache is doing, and how much Guest memory has section mappings.
+ *
+ * For the order of events rather than totals, see the tracepoints in
+ * trace.h.
+ */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include "lg.h"
+
+static struct dentry *lguest_debugfs;
+
+static const char *exit_names[LG_EXIT_NR] = {
+	[LG_EXIT_UNDEF]		= "undef",
+	[LG_EXIT_HCALL]		= "hcall",
+	[LG_EXIT_SHADOW_FAULT]	= "shadow_fault",
+	[LG_EXIT_GUEST_FAULT]	= "guest_fault",
+	[LG_EXIT_IRQ]		= "irq",
+	[LG_EXIT_SYSCALL]	= "syscall",
+};
+
+/* Count one event which took @ns nanoseconds of Host time. */
+void lguest_account(struct lg_exit_stat *stat, u64 ns)
+{
+	int bucket = fls64(ns) - 8;
+
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket >= LG_HIST_BUCKETS)
+		bucket = LG_HIST_BUCKETS - 1;
+
+	stat->count++;
+	stat->total_ns += ns;
+	stat->hist[bucket]++;
+}
+
+static void add_stat(struct lg_exit_stat *sum, const struct lg_exit_stat *s)
+{
+	unsigned int i;
+
+	sum->count += s->count;
+	sum->total_ns += s->total_ns;
+	for (i = 0; i < LG_HIST_BUCKETS; i++)
+		sum->hist[i] += s->hist[i];
+}
+
+static void show_stat(struct seq_file *m, const char *name, unsigned int nr,
+		      const struct lg_exit_stat *s)
+{
+	unsigned int i;
+
+	if (!s->count)
+		return;
+
+	seq_printf(m, "%-12s %3u %10llu %12llu", name, nr,
+		   (unsigned long long)s->count,
+		   (unsigned long long)s->total_ns);
+	for (i = 0; i < LG_HIST_BUCKETS; i++)
+		seq_printf(m, " %u", s->hist[i]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * Sum vCPUs @first to @last inclusive, and print the result.  A whole
+ * struct lg_cpu_stats is too big for the stack, so we add up one line at a
+ * time.
+ */
+static void show_cpus(struct seq_file *m, struct lguest *lg,
+		      unsigned int first, unsigned int last)
+{
+	struct lg_exit_stat sum;
+	unsigned long timer = 0, halts = 0, prefaulted = 0;
+	unsigned long halt_polled = 0, halt_poll_missed = 0, ring_full = 0;
+	unsigned int i, j;
+
+	for (i = first; i <= last; i++) {
+		timer += lg->cpus[i].stats.timer;
+		halts += lg->cpus[i].stats.halts;
+		prefaulted += lg->cpus[i].stats.prefaulted;
+		halt_polled += lg->cpus[i].stats.halt_polled;
+		halt_poll_missed += lg->cpus[i].stats.halt_poll_missed;
+		ring_full += lg->cpus[i].stats.hcall_ring_full;
+	}
+	seq_printf(m, "timer %lu\nhalts %lu\nprefaulted %lu\n",
+		   timer, halts, prefaulted);
+	seq_printf(m, "halt_polled %lu\nhalt_poll_missed %lu\n",
+		   halt_polled, halt_poll_missed);
+	seq_printf(m, "hcall_ring_full %lu\n", ring_full);
+	if (first == last)
+		seq_printf(m, "halt_poll_ns %u\n", lg->cpus[first].halt_poll_ns);
+
+	seq_puts(m, "# event        nr      count     total_ns histogram"
+		 " (<256ns, then doubling)\n");
+	for (j = 0; j < LG_EXIT_NR; j++) {
+		memset(&sum, 0, sizeof(sum));
+		for (i = first; i <= last; i++)
+			add_stat(&sum, &lg->cpus[i].stats.exits[j]);
+		show_stat(m, exit_names[j], 0, &sum);
+	}
+	for (j = 0; j < LG_HCALL_NR; j++) {
+		memset(&sum, 0, sizeof(sum));
+		for (i = first; i <= last; i++)
+			add_stat(&sum, &lg->cpus[i].stats.hcalls[j]);
+		show_stat(m, "lhcall", j, &sum);
+	}
+}
+
+static int cpu_stats_show(struct seq_file *m, void *v)
+{
+	struct lg_cpu *cpu = m->private;
+
+	show_cpus(m, cpu->lg, cpu->id, cpu->id);
+	return 0;
+}
+
+static int guest_stats_show(struct seq_file *m, void *v)
+{
+	struct lguest *lg = m->private;
+
+	/* These belong to the whole Guest, not a vCPU, so they are only here. */
+	seq_printf(m, "pgdir_hits %lu\npgdir_misses %lu\npgdir_evictions %lu\n",
+		   lg->pgdir_stats.hits, lg->pgdir_stats.misses,
+		   lg->pgdir_stats.evictions);
+	seq_printf(m, "direct_sections %u\n", lg->direct_sections);
+	show_cpus(m, lg, 0, lg->nr_cpus - 1);
+	return 0;
+}
+
+static int cpu_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cpu_stats_show, inode->i_private);
+}
+
+static int guest_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, guest_stats_show, inode->i_private);
+}
+
+static const struct file_operations cpu_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= cpu_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations guest_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= guest_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Statistics are a nicety: if debugfs isn't there, or something here fails,
+ * the Guest runs just the same, so none of these return errors.
+ */
+void lguest_stats_add_guest(struct lguest *lg)
+{
+	char name[16];
+
+	if (IS_ERR_OR_NULL(lguest_debugfs))
+		return;
+
+	snprintf(name, sizeof(name), "%d", task_pid_nr(current));
+	lg->debugfs = debugfs_create_dir(name, lguest_debugfs);
+	if (IS_ERR_OR_NULL(lg->debugfs)) {
+		lg->debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("all", 0400, lg->debugfs, lg, &guest_stats_fops);
+}
+
+void lguest_stats_add_cpu(struct lg_cpu *cpu)
+{
+	char name[16];
+
+	if (!cpu->lg->debugfs)
+		return;
+
+	snprintf(name, sizeof(name), "vcpu%u", cpu->id);
+	debugfs_create_file(name, 0400, cpu->lg->debugfs, cpu,
+			    &cpu_stats_fops);
+}
+
+void lguest_stats_remove_guest(struct lguest *lg)
+{
+	debugfs_remove_recursive(lg->debugfs);
+	lg->debugfs = NULL;
+}
+
+int __init lguest_stats_init(void)
+{
+	lguest_debugfs = debugfs_create_dir("lguest", NULL);
+	return 0;
+}
+
+void lguest_stats_exit(void)
+{
+	debugfs_remove_recursive(lguest_debugfs);
+}
@@ -10,6 +10,7 @@
 #include <linux/sched.h>
 #include <linux/eventfd.h>
 #include <linux/file.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/module.h>
 #include "lg.h"
@@ -179,6 +180,137 @@ static int attach_eventfd(struct lguest *lg, const unsigned long __user *input)
 	return err;
 }
 
+/*L:053
+ * Going the other way, a device thread which has finished with some buffers
+ * needs to interrupt the Guest.  It could write LHREQ_IRQ to /dev/lguest
+ * each time, but that's a system call and a copy_from_user() for every
+ * completion, and vhost-net (which lives in the kernel) can't do it at all.
+ *
+ * So the Launcher can also hand us an eventfd with LHREQ_IRQFD, along with an
+ * interrupt number.  We hang ourselves off the eventfd's wait queue, just as
+ * if we were poll()ing it, and whenever anyone signals it we raise that
+ * interrupt straight from the wakeup.  This is the same trick KVM plays in
+ * virt/kvm/eventfd.c, without the routing tables.
+ */
+struct lg_irqfd {
+	struct lguest *lg;
+	struct eventfd_ctx *eventfd;
+	unsigned int irq;
+	wait_queue_t wait;
+	poll_table pt;
+	struct list_head list;
+};
+
+/*
+ * This is called with the eventfd's wait queue lock held and interrupts off,
+ * which is fine: set_interrupt() only sets a bit and wakes or kicks the
+ * Launcher.  Device interrupts all go to CPU 0.
+ *
+ * We don't bother reading the count back out of the eventfd: it would take
+ * 2^64 signals to fill it, and POLLHUP (the file being closed) doesn't matter
+ * since we hold our own reference until the Guest goes away.
+ */
+static int irqfd_wakeup(wait_queue_t *wait, unsigned mode, int sync, void *key)
+{
+	struct lg_irqfd *irqfd = container_of(wait, struct lg_irqfd, wait);
+
+	if ((unsigned long)key & POLLIN)
+		set_interrupt(&irqfd->lg->cpus[0], irqfd->irq);
+	return 0;
+}
+
+static void irqfd_ptable_queue_proc(struct file *file, wait_queue_head_t *wqh,
+				    poll_table *pt)
+{
+	struct lg_irqfd *irqfd = container_of(pt, struct lg_irqfd, pt);
+
+	add_wait_queue(wqh, &irqfd->wait);
+}
+
+static int attach_irqfd(struct lguest *lg, const unsigned long __user *input)
+{
+	unsigned long fd, irq;
+	struct lg_irqfd *irqfd, *tmp;
+	struct file *file;
+	unsigned int events;
+	int err;
+
+	if (get_user(fd, input) != 0)
+		return -EFAULT;
+	input++;
+	if (get_user(irq, input) != 0)
+		return -EFAULT;
+	if (irq >= LGUEST_IRQS)
+		return -EINVAL;
+
+	irqfd = kzalloc(sizeof(*irqfd), GFP_KERNEL);
+	if (!irqfd)
+		return -ENOMEM;
+	irqfd->lg = lg;
+	irqfd->irq = irq;
+	init_waitqueue_func_entry(&irqfd->wait, irqfd_wakeup);
+	init_poll_funcptr(&irqfd->pt, irqfd_ptable_queue_proc);
+
+	file = eventfd_fget(fd);
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto free;
+	}
+
+	irqfd->eventfd = eventfd_ctx_fileget(file);
+	if (IS_ERR(irqfd->eventfd)) {
+		err = PTR_ERR(irqfd->eventfd);
+		goto put_file;
+	}
+
+	/* One eventfd, one interrupt: anything else is a Launcher bug. */
+	mutex_lock(&lguest_lock);
+	list_for_each_entry(tmp, &lg->irqfds, list) {
+		if (tmp->eventfd == irqfd->eventfd) {
+			mutex_unlock(&lguest_lock);
+			err = -EBUSY;
+			goto put_ctx;
+		}
+	}
+	list_add_tail(&irqfd->list, &lg->irqfds);
+	mutex_unlock(&lguest_lock);
+
+	/*
+	 * Polling adds us to the wait queue.  If it was signalled before we
+	 * got there, we'd never hear about it, so check now.
+	 */
+	events = file->f_op->poll(file, &irqfd->pt);
+	if (events & POLLIN)
+		set_interrupt(&lg->cpus[0], irq);
+
+	/* The eventfd_ctx reference keeps it alive: we're done with the file. */
+	fput(file);
+	return 0;
+
+put_ctx:
+	eventfd_ctx_put(irqfd->eventfd);
+put_file:
+	fput(file);
+free:
+	kfree(irqfd);
+	return err;
+}
+
+/* Called from close(): unhook each irqfd so no wakeup can find it again. */
+static void release_irqfds(struct lguest *lg)
+{
+	struct lg_irqfd *irqfd, *tmp;
+	u64 cnt;
+
+	list_for_each_entry_safe(irqfd, tmp, &lg->irqfds, list) {
+		eventfd_ctx_remove_wait_queue(irqfd->eventfd, &irqfd->wait,
+					      &cnt);
+		eventfd_ctx_put(irqfd->eventfd);
+		list_del(&irqfd->list);
+		kfree(irqfd);
+	}
+}
+
 /*L:050
  * Sending an interrupt is done by writing LHREQ_IRQ and an interrupt
  * number to /dev/lguest.
@@ -199,6 +331,118 @@ static int user_send_irq(struct lg_cpu *cpu, const unsigned long __user *input)
 	return 0;
 }
 
+/*
+ * The Launcher is about to give some Guest pages back to the Host (see
+ * guest_release_pages()): LHREQ_RELEASE_PAGES, a page number and a count.
+ */
+static int user_release_pages(struct lguest *lg,
+			      const unsigned long __user *input)
+{
+	unsigned long pfn, num;
+
+	if (get_user(pfn, input) != 0)
+		return -EFAULT;
+	input++;
+	if (get_user(num, input) != 0)
+		return -EFAULT;
+	return guest_release_pages(lg, pfn, num);
+}
+
+/*L:057
+ * A snapshot of a Guest is its memory, which the Launcher saves for itself,
+ * plus what only we know about each CPU: its register page and a little
+ * more.  LHREQ_SAVECPU copies that out to a buffer the Launcher gives us, and
+ * LHREQ_RESTORECPU puts it back into a freshly initialized Guest.
+ *
+ * Only the task which runs a CPU may do either, so we know it isn't running.
+ */
+static int save_cpu(struct lg_cpu *cpu, const unsigned long __user *input)
+{
+	unsigned long buf, len;
+	struct lg_cpu_state *state;
+	int err = sizeof(*state);
+
+	if (get_user(buf, input) != 0)
+		return -EFAULT;
+	input++;
+	if (get_user(len, input) != 0)
+		return -EFAULT;
+	if (current != cpu->tsk)
+		return -EPERM;
+	if (len < sizeof(*state))
+		return -ENOSPC;
+
+	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+	state->size = sizeof(*state);
+	state->halted = cpu->halted;
+	state->next_hcall = cpu->next_hcall;
+	state->guest_time = ktime_to_ns(ktime_get()) + cpu->lg->clock_offset;
+	memcpy(&state->regs, cpu->regs, sizeof(state->regs));
+
+	if (copy_to_user((void __user *)buf, state, sizeof(*state)) != 0)
+		err = -EFAULT;
+	kfree(state);
+	return err;
+}
+
+/*
+ * The saved registers describe the Guest, but a few fields describe the Host
+ * it ran on, and those we keep.  The Guest's clock carries on from when it
+ * was saved, however long ago: that's lg->clock_offset.  And the Guest was
+ * using its own page table, not the boot one initialize() gave it.
+ */
+static int restore_cpu(struct lg_cpu *cpu, const unsigned long __user *input)
+{
+	unsigned long buf, len;
+	struct lg_cpu_state *state;
+	struct lguest_regs *regs = cpu->regs;
+	int err = 0;
+
+	if (get_user(buf, input) != 0)
+		return -EFAULT;
+	input++;
+	if (get_user(len, input) != 0)
+		return -EFAULT;
+	if (current != cpu->tsk)
+		return -EPERM;
+	if (len != sizeof(*state))
+		return -EINVAL;
+
+	state = kmalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
+	if (copy_from_user(state, (void __user *)buf, sizeof(*state)) != 0) {
+		err = -EFAULT;
+		goto out;
+	}
+	if (state->size != sizeof(*state)
+	    || state->regs.hcall_cons != state->next_hcall) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	state->regs.guest_cpuid_id = regs->guest_cpuid_id;
+	state->regs.guest_cpuid_cachetype = regs->guest_cpuid_cachetype;
+	state->regs.guest_cpuid_tcm = regs->guest_cpuid_tcm;
+	state->regs.guest_cpuid_tlbtype = regs->guest_cpuid_tlbtype;
+	state->regs.guest_nr_cpus = regs->guest_nr_cpus;
+	state->regs.timer_armed = 0;
+	memcpy(regs, &state->regs, sizeof(*regs));
+
+	cpu->halted = state->halted;
+	cpu->next_hcall = state->next_hcall;
+	hrtimer_cancel(&cpu->hrt);
+	cpu->timer_deadline = 0;
+	cpu->lg->clock_offset = state->guest_time - ktime_to_ns(ktime_get());
+
+	guest_switch_mm(cpu, regs->gpgdir, regs->guest_cont_id);
+out:
+	kfree(state);
+	return err;
+}
+
 /*L:040
  * Once our Guest is initialized, the Launcher makes it run by reading
  * from /dev/lguest.
@@ -254,8 +498,9 @@ static ssize_t read(struct file *file, char __user *user, size_t size,loff_t*o)
 
 
 /*L:025
- * This initializes CPU0.  For the moment, a Guest is only
- * uniprocessor, so "id" is always 0.
+ * This initializes a CPU.  CPU 0 is set up by LHREQ_INITIALIZE and starts
+ * running the Guest kernel straight away; the others are added by
+ * LHREQ_NEWCPU and sit idle until the Guest's CPU 0 brings them up.
  */
 static int lg_cpu_start(struct lg_cpu *cpu, unsigned id, unsigned long start_ip)
 {
@@ -266,7 +511,6 @@ static int lg_cpu_start(struct lg_cpu *cpu, unsigned id, unsigned long start_ip)
 	/* Set up this CPU's id, and pointer back to the lguest struct. */
 	cpu->id = id;
 	cpu->lg = container_of((cpu - id), struct lguest, cpus[0]);
-	cpu->lg->nr_cpus++;
 
 	/* Each CPU has a timer it can set. */
 	init_clockdev(cpu);
@@ -309,10 +553,58 @@ static int lg_cpu_start(struct lg_cpu *cpu, unsigned id, unsigned long start_ip)
 	 */
 	cpu->last_pages = NULL;
 
+	/*
+	 * Secondary CPUs get a shadow page table when the Guest starts them
+	 * (see guest_cpu_up()).  Until then they have none.
+	 */
+	if (id) {
+		cpu->cpu_pgd = -1;
+		cpu->started = 0;
+	} else
+		cpu->started = 1;
+
+	/*
+	 * Everything's ready: now other CPUs of the Guest may look at this
+	 * one.  The Guest learns how many CPUs it has from CPU 0's registers.
+	 */
+	smp_wmb();
+	cpu->lg->nr_cpus++;
+	cpu->lg->cpus[0].regs->guest_nr_cpus = cpu->lg->nr_cpus;
+
+	lguest_stats_add_cpu(cpu);
+
 	/* No error == success. */
 	return 0;
 }
 
+/*
+ * The Launcher adds secondary CPUs one at a time, in order, each from the
+ * thread which will run it: the offset of the write is the new CPU's id.
+ * This must happen before the Guest boots far enough to count its CPUs.
+ *
+ * A CPU keeps its own shadow page table, so we need at least one more
+ * shadow than we have CPUs, or a context switch would have nowhere to go.
+ */
+static int new_cpu(struct lguest *lg, unsigned int id)
+{
+	int err;
+
+	/* We have room for NR_CPUS, however many shadows the Guest asked for. */
+	if (id >= ARRAY_SIZE(lg->cpus))
+		return -EINVAL;
+
+	mutex_lock(&lguest_lock);
+	if (id != lg->nr_cpus)
+		err = -EINVAL;
+	else if (id + 1 >= lg->nr_pgdirs)
+		err = -ENOSPC;
+	else
+		err = lg_cpu_start(&lg->cpus[id], id, 0);
+	mutex_unlock(&lguest_lock);
+
+	return err ? err : sizeof(unsigned long);
+}
+
 /*L:020
  * The initialization write supplies 3 pointer sized (32 or 64 bit) values (in
  * addition to the LHREQ_INITIALIZE value).  These are:
@@ -360,6 +652,7 @@ static int initialize(struct file *file, const unsigned long __user *input)
 		goto free_lg;
 	}
 	lg->eventfds->num = 0;
+	INIT_LIST_HEAD(&lg->irqfds);
 
 	/* Populate the easy fields of our "struct lguest" */
 	lg->mem_base = (void __user *)args[0];
@@ -375,6 +668,7 @@ static int initialize(struct file *file, const unsigned long __user *input)
 	if (err)
 		goto free_eventfds;
 
+	lguest_stats_add_guest(lg);
 
     err = lg_cpu_start(&lg->cpus[0], 0, args[2]);
     if (err)
@@ -391,6 +685,7 @@ static int initialize(struct file *file, const unsigned long __user *input)
 	return sizeof(args);
 
 free_gtable:
+	lguest_stats_remove_guest(lg);
 	free_guest_pagetable(lg);
 free_eventfds:
 	kfree(lg->eventfds);
@@ -408,9 +703,8 @@ unlock:
  * writes of other values to send interrupts or set up receipt of notifications.
  *
  * Note that we overload the "offset" in the /dev/lguest file to indicate what
- * CPU number we're dealing with.  Currently this is always 0 since we only
- * support uniprocessor Guests, but you can see the beginnings of SMP support
- * here.
+ * CPU number we're dealing with.  For LHREQ_NEWCPU that's the CPU being
+ * created; everything else must name a CPU which already exists.
  */
 static ssize_t write(struct file *file, const char __user *in,
 		     size_t size, loff_t *off)
@@ -434,7 +728,15 @@ static ssize_t write(struct file *file, const char __user *in,
 
 	/* If you haven't initialized, you must do that first. */
 	if (req != LHREQ_INITIALIZE) {
-		if (!lg || (cpu_id >= lg->nr_cpus))
+		if (!lg)
+			return -EINVAL;
+		/* A new CPU is the only one which doesn't exist yet. */
+		if (req == LHREQ_NEWCPU) {
+			if (lg->dead)
+				return -ENOENT;
+			return new_cpu(lg, cpu_id);
+		}
+		if (cpu_id >= lg->nr_cpus)
 			return -EINVAL;
 		cpu = &lg->cpus[cpu_id];
 
@@ -451,6 +753,14 @@ static ssize_t write(struct file *file, const char __user *in,
 		return user_send_irq(cpu, input);
 	case LHREQ_EVENTFD:
 		return attach_eventfd(lg, input);
+	case LHREQ_IRQFD:
+		return attach_irqfd(lg, input);
+	case LHREQ_RELEASE_PAGES:
+		return user_release_pages(lg, input);
+	case LHREQ_SAVECPU:
+		return save_cpu(cpu, input);
+	case LHREQ_RESTORECPU:
+		return restore_cpu(cpu, input);
 	default:
 		return -EINVAL;
 	}
@@ -480,6 +790,16 @@ static int close(struct inode *inode, struct file *file)
 	 */
 	mutex_lock(&lguest_lock);
 
+	/* Take away the statistics before what they point at. */
+	lguest_stats_remove_guest(lg);
+
+	/*
+	 * Unhook the irqfds before the CPUs they would interrupt go away.  The
+	 * Launcher threads are all gone by now, but an in-kernel user like
+	 * vhost might still be signalling.
+	 */
+	release_irqfds(lg);
+
 	/* Free up the shadow page tables for the Guest. */
 	free_guest_pagetable(lg);
 
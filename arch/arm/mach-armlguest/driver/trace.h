@@ -0,0 +1,119 @@
+#if !defined(_TRACE_LGUEST_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LGUEST_H
+
+#include <linux/tracepoint.h>
+#include <asm/lguest.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lguest
+
+/*
+ * Tracepoints for the world switch, so perf can line up Host time with what
+ * the Guest was doing.  Entry and exit bracket each trip through the
+ * Switcher; the others say what we did about an exit.
+ */
+TRACE_EVENT(lguest_entry,
+	TP_PROTO(unsigned int vcpu_id, unsigned long pc),
+	TP_ARGS(vcpu_id, pc),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	vcpu_id		)
+		__field(	unsigned long,	pc		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu_id	= vcpu_id;
+		__entry->pc		= pc;
+	),
+
+	TP_printk("vcpu %u pc 0x%08lx", __entry->vcpu_id, __entry->pc)
+);
+
+#define lguest_exit_reasons				\
+	{ RET_GSYSCALL,	"SYSCALL" },			\
+	{ RET_UNF,	"UNDEF" },			\
+	{ RET_HCALL,	"HCALL" },			\
+	{ RET_PABT,	"PABT" },			\
+	{ RET_DABT,	"DABT" },			\
+	{ RET_IRQ,	"IRQ" }
+
+TRACE_EVENT(lguest_exit,
+	TP_PROTO(unsigned int vcpu_id, unsigned long retcode, unsigned long pc),
+	TP_ARGS(vcpu_id, retcode, pc),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	vcpu_id		)
+		__field(	unsigned long,	retcode		)
+		__field(	unsigned long,	pc		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu_id	= vcpu_id;
+		__entry->retcode	= retcode;
+		__entry->pc		= pc;
+	),
+
+	TP_printk("vcpu %u reason %s pc 0x%08lx", __entry->vcpu_id,
+		  __print_symbolic(__entry->retcode, lguest_exit_reasons),
+		  __entry->pc)
+);
+
+TRACE_EVENT(lguest_hypercall,
+	TP_PROTO(unsigned int vcpu_id, unsigned long nr, unsigned long a1,
+		 unsigned long a2, unsigned long a3),
+	TP_ARGS(vcpu_id, nr, a1, a2, a3),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	vcpu_id		)
+		__field(	unsigned long,	nr		)
+		__field(	unsigned long,	a1		)
+		__field(	unsigned long,	a2		)
+		__field(	unsigned long,	a3		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu_id	= vcpu_id;
+		__entry->nr		= nr;
+		__entry->a1		= a1;
+		__entry->a2		= a2;
+		__entry->a3		= a3;
+	),
+
+	TP_printk("vcpu %u nr %lu a1 0x%lx a2 0x%lx a3 0x%lx",
+		  __entry->vcpu_id, __entry->nr,
+		  __entry->a1, __entry->a2, __entry->a3)
+);
+
+TRACE_EVENT(lguest_abort,
+	TP_PROTO(unsigned int vcpu_id, unsigned long vaddr, unsigned long fsr,
+		 bool handled),
+	TP_ARGS(vcpu_id, vaddr, fsr, handled),
+
+	TP_STRUCT__entry(
+		__field(	unsigned int,	vcpu_id		)
+		__field(	unsigned long,	vaddr		)
+		__field(	unsigned long,	fsr		)
+		__field(	bool,		handled		)
+	),
+
+	TP_fast_assign(
+		__entry->vcpu_id	= vcpu_id;
+		__entry->vaddr		= vaddr;
+		__entry->fsr		= fsr;
+		__entry->handled	= handled;
+	),
+
+	TP_printk("vcpu %u vaddr 0x%08lx fsr 0x%lx %s", __entry->vcpu_id,
+		  __entry->vaddr, __entry->fsr,
+		  __entry->handled ? "shadow" : "guest")
+);
+
+#endif /* _TRACE_LGUEST_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
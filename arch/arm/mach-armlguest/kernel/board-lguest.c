@@ -28,6 +28,8 @@
 #include <linux/lguest_launcher.h>
 #include <linux/virtio_console.h>
 #include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
 
 #include <asm/kmap_types.h>
 #include <asm/lguest_hcall.h>
@@ -258,31 +260,93 @@ struct cpu_user_fns lguest_user_fns __initdata = {
 
 
 
+/*
+ * The timer and IPI lines belong to each CPU, but device interrupts always
+ * go to CPU 0, and only CPU 0 can see the page where they're blocked.  The
+ * other CPUs ask the Host to do it for them.
+ */
+static bool lguest_remote_irq(unsigned int irq)
+{
+#ifdef CONFIG_SMP
+	return irq != 0 && irq != LGUEST_IPI_IRQ && smp_processor_id() != 0;
+#else
+	return false;
+#endif
+}
+
 static void disable_lguest_irq(struct irq_data *data)
 {
 	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+
+	if (lguest_remote_irq(data->irq)) {
+		immediate_hcall(data->irq, 1, 0, LHCALL_BLOCK_IRQ);
+		return;
+	}
 	set_bit(data->irq, lgregs->blocked_interrupts);
 }
 
 
-static void enable_lguest_irq(struct irq_data *data)
+/*
+ * Unblocking a line only needs a trip to the Host if an interrupt on it is
+ * already waiting for us and we could take it now.
+ */
+static void lguest_unblock_irq(unsigned int irq)
 {
 	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
-	clear_bit(data->irq, lgregs->blocked_interrupts);
-	if(!(lgregs->irq_disabled & PSR_I_BIT))
+	clear_bit(irq, lgregs->blocked_interrupts);
+	mb();
+	if(!(lgregs->irq_disabled & PSR_I_BIT) && test_bit(irq, lgregs->irqs_pending))
 		immediate_hcall(0, 2, 0,LHCALL_SEND_INTERRUPTS);
 }
 
+static void enable_lguest_irq(struct irq_data *data)
+{
+	if (lguest_remote_irq(data->irq)) {
+		immediate_hcall(data->irq, 0, 0, LHCALL_BLOCK_IRQ);
+		return;
+	}
+	lguest_unblock_irq(data->irq);
+}
+
 
 
+/*
+ * The time according to the Host's stamp in our register page.  The caller
+ * must keep us on one CPU: each CPU has its own page at the same address.
+ */
+static u64 lguest_clock_now(void)
+{
+	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+	const struct lguest_clock *clock = &lgregs->clock;
+	u32 version;
+	u64 now;
+
+	do {
+		version = clock->version;
+		rmb();
+		now = clock->system_time;
+		rmb();
+	} while (unlikely((version & 1) || version != clock->version));
+
+	return now;
+}
+
 /*
  * We also need a "struct clock_event_device": Linux asks us to set it to go
  * off some time in the future.  Actually, James Morris figured all this out, I
  * just applied the patch.
+ *
+ * We turn the delay into a deadline in the Host's clock and leave it in our
+ * register page, where the Host looks every time we exit.  Only if the Host
+ * isn't already going to interrupt us before then do we have to exit now to
+ * tell it.
  */
 static int lguest_clockevent_set_next_event(unsigned long delta,
                                            struct clock_event_device *evt)
 {
+	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+	u64 deadline;
+
 	/* FIXME: I don't think this can ever happen, but James tells me he had
 	 * to put this code in.  Maybe we should remove it now.  Anyone? */
 	if (delta < LG_CLOCK_MIN_DELTA) {
@@ -291,7 +355,13 @@ static int lguest_clockevent_set_next_event(unsigned long delta,
 				 __func__, delta);
 			return -ETIME;
 	}
-	immediate_hcall(delta,0,0,LHCALL_SET_CLOCKEVENT);
+
+	/* Interrupts are off in here, so we stay on this CPU. */
+	deadline = lguest_clock_now() + delta;
+	lgregs->timer_deadline = deadline;
+
+	if (!lgregs->timer_armed || deadline < lgregs->timer_armed)
+		immediate_hcall(0,0,0,LHCALL_SET_CLOCKEVENT);
 	return 0;
 }
 
@@ -304,7 +374,8 @@ static void lguest_clockevent_set_mode(enum clock_event_mode mode,
 	switch (mode) {
 		case CLOCK_EVT_MODE_UNUSED:
 		case CLOCK_EVT_MODE_SHUTDOWN:
-			/* A 0 argument shuts the clock down. */
+			/* A 0 deadline shuts the clock down. */
+			((struct lguest_regs *)lguest_page_base)->timer_deadline = 0;
 			immediate_hcall(0,0,0,LHCALL_SET_CLOCKEVENT);
 			break;
 		case CLOCK_EVT_MODE_ONESHOT:
@@ -318,6 +389,9 @@ static void lguest_clockevent_set_mode(enum clock_event_mode mode,
 }
 
 
+/* Each CPU has its own timer, which the Host keeps for it. */
+static DEFINE_PER_CPU(struct clock_event_device, lguest_clockevents);
+
 static struct clock_event_device lguest_clockevent = {
 	.name                   = "lguest",
 	.features               = CLOCK_EVT_FEAT_ONESHOT,
@@ -331,49 +405,42 @@ static struct clock_event_device lguest_clockevent = {
 };
 
 /*
- * we read the time value given by the Host.
+ * Each CPU's page is stamped separately, so two readings on different CPUs
+ * can disagree: one CPU may not have been back to the Host for a while.  Linux tends to come
+ * apart under the stress of time travel, so we never hand out a time earlier
+ * than one we've handed out before.
  */
+static atomic64_t lguest_clock_last = ATOMIC64_INIT(0);
+
 static cycle_t lguest_clock_read(struct clocksource *cs)
 {
-	unsigned long sec, nsec;
-	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+	u64 now, last, old;
 
+	preempt_disable_notrace();
+	now = lguest_clock_now();
+	preempt_enable_notrace();
 
-	/*
-	 * Since the time is in two parts (seconds and nanoseconds), we risk
-	 * reading it just as it's changing from 99 & 0.999999999 to 100 and 0,
-	 * and getting 99 and 0.  As Linux tends to come apart under the stress
-	 * of time travel, we must be careful:
-	 */
-	do {
-		/* First we read the seconds part. */
-		sec = lgregs->guest_time.tv_sec;
-		/*
-		 * This read memory barrier tells the compiler and the CPU that
-		 * this can't be reordered: we have to complete the above
-		 * before going on.
-		 */
-		rmb();
-		/* Now we read the nanoseconds part. */
-		nsec = lgregs->guest_time.tv_nsec;
-		/* Make sure we've done that. */
-		rmb();
-		/* Now if the seconds part has changed, try again. */
-	} while (unlikely(lgregs->guest_time.tv_sec != sec));
-
-
-	/* Our lguest clock is in real nanoseconds. */
-	return sec*1000000000ULL + nsec;
+	last = atomic64_read(&lguest_clock_last);
+	while (now > last) {
+		old = atomic64_cmpxchg(&lguest_clock_last, last, now);
+		if (old == last)
+			return now;
+		last = old;
+	}
+	return last;
 }
 
 
 
-/* This is the fallback clocksource: lower priority than the TSC clocksource. */
+/*
+ * Our lguest clock is in real nanoseconds, and reading it costs no exits, so
+ * it's the best clocksource we have.
+ */
 static struct clocksource lguest_clock = {
 	.name       = "lguest",
-	.rating     = 250,
+	.rating     = 400,
 	.read       = lguest_clock_read,
-	.mask       = CLOCKSOURCE_MASK(32),
+	.mask       = CLOCKSOURCE_MASK(64),
 	.mult       = 1 << 10,
 	.shift      = 10,
 	.flags      = CLOCK_SOURCE_IS_CONTINUOUS,
@@ -389,9 +456,11 @@ static irqreturn_t lguest_timer_interrupt(int irq, void *dev_id)
 {
 	unsigned long flags;
 
+	struct clock_event_device *evt = &__get_cpu_var(lguest_clockevents);
+
 	/* Don't interrupt us while this is running. */
 	local_irq_save(flags);
-	lguest_clockevent.event_handler(&lguest_clockevent);
+	evt->event_handler(evt);
 	local_irq_restore(flags);
 	return IRQ_HANDLED;
 }
@@ -400,7 +469,7 @@ static irqreturn_t lguest_timer_interrupt(int irq, void *dev_id)
 
 static struct irqaction lguest_timer_irq = {
 	.name       = "lguest",
-	.flags      = IRQF_DISABLED | IRQF_TIMER | IRQF_IRQPOLL,
+	.flags      = IRQF_DISABLED | IRQF_TIMER | IRQF_IRQPOLL | IRQF_PERCPU,
 	.handler    = lguest_timer_interrupt,
 };
 
@@ -409,6 +478,28 @@ static struct irqaction lguest_timer_irq = {
 
 extern void lguest_setup_irq(unsigned int irq);
 
+/*
+ * Register this CPU's clock event device and let its timer interrupt in.
+ * The boot CPU does this from lguest_timer_init(), the others from
+ * platform_secondary_init().
+ */
+void __cpuinit lguest_clockevent_init(void)
+{
+	unsigned int cpu = smp_processor_id();
+	struct clock_event_device *evt = &per_cpu(lguest_clockevents, cpu);
+
+	*evt = lguest_clockevent;
+	/*
+	 * We can't set cpumask in the initializer: damn C limitations!  Set it
+	 * here and register our timer device. 
+	 */
+	evt->cpumask = cpumask_of(cpu);
+	clockevents_register_device(evt);
+
+	/* Finally, we unblock the timer interrupt. */
+	lguest_unblock_irq(0);
+}
+
 /*
  * At some point in the boot process, we get asked to set up our timing
  * infrastructure.  The kernel doesn't expect timer interrupts before this, but
@@ -420,21 +511,15 @@ static void __init lguest_timer_init(void)
 	int ret;
 
 	lguest_setup_irq(0);
+	/* Every CPU gets its own timer interrupts on line 0. */
+	irq_set_handler(0, handle_percpu_irq);
 
 	/* Set up the timer interrupt (0) to go to our simple timer routine */
     ret = setup_irq(0, &lguest_timer_irq);
 
-	/* 
-	 * We can't set cpumask in the initializer: damn C limitations!  Set it
-	 * here and register our timer device. 
-	 */
-	lguest_clockevent.cpumask = cpumask_of(0);
-	clockevents_register_device(&lguest_clockevent);
-
 	clocksource_register(&lguest_clock);
 
-    /* Finally, we unblock the timer interrupt. */
-	enable_lguest_irq(0);
+	lguest_clockevent_init();
 }
 
 
@@ -463,7 +548,7 @@ struct irq_chip * lguest_irq_controller(void)
 static void __init lguest_init_irq(void)
 {
 	int i;
-	for (i = 0; i < LGUEST_IRQS; i++) {
+	for (i = 0; i < LGUEST_IRQS && i < NR_IRQS; i++) {
 		irq_set_chip_and_handler(i, &lguest_irq_chip, handle_level_irq);
 		irq_set_status_flags(i, IRQF_VALID);
 	}
@@ -22,6 +22,8 @@
 #include <linux/interrupt.h>
 #include <linux/virtio_console.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/highmem.h>
 
 #include <asm/linkage.h>
 #include <asm/exception.h>
@@ -34,6 +36,9 @@
 #include <asm/system.h>
 #include <asm/unified.h>
 #include <asm/mmu_context.h>
+#ifdef CONFIG_SMP
+#include <asm/smp.h>
+#endif
 
 #include <asm/cacheflush.h>
 
@@ -83,8 +88,9 @@ static int lguest_guest_start = 0;
 
 
 /* 
- * lguest_page_base is the address of the first page of struct lguest_pages.
- * It is passed to the Guest when coming back from the Host. 
+ * lguest_page_base is the address of our "struct lguest_regs".  Every CPU
+ * sees its own one at this same address (LGUEST_REGS_ALIAS), so it's only
+ * set once, in lguest_kernel_start.
  * lguest_switcher_addr is the Switcher address.
  * please see lguest-entry-armv.S and lguest-entry-common.S 
  */
@@ -110,70 +116,78 @@ void do_guest_set_pte(pte_t *ptep, pte_t pte, unsigned long ext)
 }
 
 
-#define NEXT_HCALL(current) \
-			((current + 1) & (LHCALL_RING_SIZE - 1))
-
-
-
 /*
  * setup_hcall() is pretty simple: We have a ring buffer which is located in the first page of
  * "struct lguest_pages" to stored hypercalls which the Host will run though next time we 
  * do a normal hypercall. Please see linux/arch/arm/include/asm/lguest.h 
- * Each entry in the ring has 5 slots for the hypercall arguments, and a "command" word which 
- * indicates what the Host should do for the Guest, and once the Host has finished with it, 
- * the Host will set it to -1UL, which means this is an empty entry. The other four slots store
- * arguments of this hypercall. At present, A hypercall has at most 3 arguments.
+ * Each entry in the ring has 5 slots: a "command" word which indicates what
+ * the Host should do for the Guest, and four arguments.  Only
+ * LHCALL_SET_PTE_RANGE uses all four.
+ *
+ * We put the entry at hcall_prod and move it on; the Host moves hcall_cons
+ * on as it runs them.  The Host empties the ring every time we come out, so
+ * it's only full if we've queued a whole ring's worth since the last exit.
  */
 static int setup_hcalls(unsigned long arg1, unsigned long arg2, 
-				unsigned long arg3, unsigned long call)
+				unsigned long arg3, unsigned long arg4,
+				unsigned long call)
 {
-	static unsigned int next_call;
-	int ret = 0;
 	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
-	struct hcall_args *hcalls = lgregs->hcalls;
+	struct hcall_args *hcall;
 	unsigned long flags;
+	u32 size, prod;
+	int ret = 0;
 
 	/*
 	 * Disable interrupts if not already disabled: we don't want an
 	 * interrupt handler making a hypercall while we're already doing
-	 * one!
+	 * one!  That also keeps us on this CPU.
 	 */
 	flags = lgregs->irq_disabled;
 	lgregs->irq_disabled = PSR_I_BIT;
-	hcalls[next_call].arg0 = call;
-	hcalls[next_call].arg1 = arg1;
-	hcalls[next_call].arg2 = arg2;
-	hcalls[next_call].arg3 = arg3;
-	hcalls[next_call].arg4 = 0;
+
+	/* A Host with a bigger ring than ours has to use ours. */
+	size = lgregs->hcall_ring_size;
+	if (unlikely(size > LHCALL_RING_SIZE))
+		lgregs->hcall_ring_size = size = LHCALL_RING_SIZE;
+
+	prod = lgregs->hcall_prod;
+	hcall = &lgregs->hcalls[prod & (size - 1)];
+	hcall->arg0 = call;
+	hcall->arg1 = arg1;
+	hcall->arg2 = arg2;
+	hcall->arg3 = arg3;
+	hcall->arg4 = arg4;
+	/* The Host must see the entry before it sees the index move. */
 	wmb();
-	next_call = NEXT_HCALL(next_call);
-	if(hcalls[next_call].arg0 != -1UL){
-		/* 
-		 * This means that the Table is full, and we
-		 * should return to the Host immediately.
-		 */
+	lgregs->hcall_prod = ++prod;
+
+	/* If the ring is full now, we should return to the Host immediately. */
+	if (prod - lgregs->hcall_cons >= size)
 		ret = 1;
-	}
+
 	/*
 	 * restore irq flags. 
 	 */
 	lgregs->irq_disabled = flags;
 
-    return ret;
+	return ret;
 }
 
 
+static void lguest_flush_pte_batch(void);
+
 /*
- * Here, I may disappoint you. In fact, The lazy hypercall has not 
- * been implemented by now. The Guest will immediately return to 
- * the Host when this function is called. 
- * The lazy hypercall should really be implemented in the future.
+ * A lazy hypercall only goes into the ring when we are in lazy mode (see
+ * lguest_arch_enter_lazy_mmu_mode() below); the Host will run it the next
+ * time we trap.  Otherwise we return to the Host immediately.
  */
-void lazy_hcall(unsigned long arg1, unsigned long arg2, 
-					unsigned long arg3, unsigned long call)
+static void lazy_hcall4(unsigned long arg1, unsigned long arg2,
+			unsigned long arg3, unsigned long arg4,
+			unsigned long call)
 {
 	int ret;
-	ret = setup_hcalls(arg1, arg2, arg3, call);
+	ret = setup_hcalls(arg1, arg2, arg3, arg4, call);
 	/* 
 	 * "ret != 0" means the ring buffer is full, and the Guest should 
 	 * immediately return to the Host.  As for avm_get_lazy_mode, please see 
@@ -183,11 +197,23 @@ void lazy_hcall(unsigned long arg1, unsigned long arg2,
 		lguest_hypercall();
 }
 
+/*
+ * The Host runs the ring in order, so any run of PTEs we are still
+ * gathering has to go in ahead of the next hypercall.
+ */
+void lazy_hcall(unsigned long arg1, unsigned long arg2, 
+					unsigned long arg3, unsigned long call)
+{
+	lguest_flush_pte_batch();
+	lazy_hcall4(arg1, arg2, arg3, 0, call);
+}
+
 /* This will immediately take us back to the Host */
 void immediate_hcall(unsigned long arg1, unsigned long arg2, 
 			unsigned long arg3, unsigned long call)
 {
-	setup_hcalls(arg1, arg2, arg3, call);
+	lguest_flush_pte_batch();
+	setup_hcalls(arg1, arg2, arg3, 0, call);
 	lguest_hypercall();
 }
 
@@ -209,6 +235,21 @@ void lguest_halt(void)
 	immediate_hcall(0, 0, 0, LHCALL_HALT);
 }
 
+#ifdef CONFIG_SMP
+/*
+ * All the IPIs come in on LGUEST_IPI_IRQ: the Host sets a bit in
+ * "ipis_pending" for each one sent to this CPU (see guest_send_ipi()).
+ */
+static void lguest_do_IPI(struct lguest_regs *lgregs, struct pt_regs *regs)
+{
+	unsigned long pending = xchg(&lgregs->ipis_pending, 0);
+	int ipi;
+
+	for_each_set_bit(ipi, &pending, BITS_PER_LONG)
+		handle_IPI(ipi, regs);
+}
+#endif
+
 /* 
  * The Guest interrupt handler. Everytime we come back from the Host, 
  * this function will be called to check if there are some virtual 
@@ -225,27 +266,43 @@ asmlinkage void __exception lguest_do_virtual_IRQ(struct pt_regs *regs)
 	if(lgregs->irq_disabled & PSR_I_BIT)
 		return;
 
+again:
 	/* Before we handle irqs, We disable local irqs */
 	lgregs->irq_disabled = PSR_I_BIT;
-	memcpy(blk, lgregs->blocked_interrupts, sizeof(blk));
-	bitmap_andnot(blk, lgregs->irqs_pending, blk, LGUEST_IRQS);
-
 
-	/* We find out irqs which we can handle now */
-	while((irq = find_first_bit(blk, LGUEST_IRQS)) < LGUEST_IRQS){
-		clear_bit(irq, lgregs->irqs_pending);
-		/* Find one, and we do it*/
-		asm_do_IRQ(irq, regs);
-		clear_bit(irq, blk);
+	/*
+	 * The Host can post more interrupts into our shared page while we're
+	 * handling these, so we keep going until there are none we can take:
+	 * there's no need to go back to the Host to get them.
+	 */
+	while (lguest_irq_deliverable(lgregs)) {
+		bitmap_andnot(blk, lgregs->irqs_pending,
+			      lgregs->blocked_interrupts, LGUEST_IRQS);
+
+		/* We find out irqs which we can handle now */
+		while((irq = find_first_bit(blk, LGUEST_IRQS)) < LGUEST_IRQS){
+			clear_bit(irq, lgregs->irqs_pending);
+			/* Find one, and we do it*/
+#ifdef CONFIG_SMP
+			if (irq == LGUEST_IPI_IRQ)
+				lguest_do_IPI(lgregs, regs);
+			else
+#endif
+				asm_do_IRQ(irq, regs);
+			clear_bit(irq, blk);
+		}
 	}
 
-	/* Enable local irqs after we are done*/
+	/*
+	 * Enable local irqs after we are done.  The Host doesn't kick us out
+	 * for an interrupt it posts while they're disabled, so we look again
+	 * once they're on: as in lguest_arch_local_irq_restore(), the mb()
+	 * pairs with the one in the Host's set_interrupt().
+	 */
 	lgregs->irq_disabled = 0;
-
-	/* If there are some pending irqs,we should go back to Host go get them  */
-	if(lgregs->irq_pending){
-		immediate_hcall(0, 1, 0,LHCALL_SEND_INTERRUPTS);
-	}
+	mb();
+	if (lguest_irq_deliverable(lgregs))
+		goto again;
 }
 
 
@@ -262,6 +319,79 @@ void lguest_switch_to(unsigned long tp, unsigned long domain)
 
 
 
+/*G:034
+ * fork(), munmap() and mprotect() walk a whole page of PTEs at a time, and
+ * wrap the walk in arch_enter_lazy_mmu_mode()/arch_leave_lazy_mmu_mode().
+ * Telling the Host about every PTE separately means it has to find the
+ * shadow page table and walk down to the PTE again for each one.  Instead,
+ * while we're in lazy mode, we remember a run of consecutive PTEs in the
+ * same PTE page, and tell the Host about the whole run with a single
+ * LHCALL_SET_PTE_RANGE: it reads the new values straight out of our PTE page.
+ *
+ * The run lives in a per-cpu variable, so lguest_arch_enter_lazy_mmu_mode()
+ * disables preemption until we leave lazy mode again.
+ */
+struct lguest_pte_batch {
+	unsigned long pgdir;	/* Physical address of the mm's pgd */
+	unsigned long addr;	/* Virtual address of the first PTE */
+	pte_t *ptep;		/* The first PTE */
+	unsigned int num;	/* How many PTEs in the run */
+};
+static DEFINE_PER_CPU(struct lguest_pte_batch, lguest_pte_batch);
+
+/*
+ * Hand whatever run of PTEs we have gathered to the Host.  With
+ * CONFIG_HIGHPTE the PTE page may only be kmapped, so __pa() won't do to
+ * find it.
+ */
+static void lguest_flush_pte_batch(void)
+{
+	struct lguest_pte_batch *b;
+	unsigned long pa;
+
+	if (avm_get_lazy_mode() != AVM_LAZY_MMU)
+		return;
+
+	b = &__get_cpu_var(lguest_pte_batch);
+	if (b->num == 1) {
+		lazy_hcall4(b->pgdir, b->addr, pte_val(*b->ptep), 0,
+			    LHCALL_SET_PTE);
+	} else if (b->num) {
+		pa = page_to_phys(kmap_atomic_to_page(b->ptep))
+			+ ((unsigned long)b->ptep & ~PAGE_MASK);
+		lazy_hcall4(b->pgdir, b->addr, pa, b->num,
+			    LHCALL_SET_PTE_RANGE);
+	}
+	b->num = 0;
+}
+
+/* Tell the Host a PTE changed, batching it up if we are in lazy mode. */
+static void lguest_pte_update(struct mm_struct *mm, unsigned long addr,
+			      pte_t *ptep, pte_t pteval)
+{
+	struct lguest_pte_batch *b;
+
+	if (avm_get_lazy_mode() != AVM_LAZY_MMU) {
+		lazy_hcall(__pa(mm->pgd), addr, (unsigned long)pteval,
+			   LHCALL_SET_PTE);
+		return;
+	}
+
+	b = &__get_cpu_var(lguest_pte_batch);
+	/* Does this carry on the current run?  If not, send that one off. */
+	if (b->num && (b->pgdir != __pa(mm->pgd)
+		       || b->ptep + b->num != ptep
+		       || b->addr + b->num * PAGE_SIZE != addr))
+		lguest_flush_pte_batch();
+
+	if (!b->num) {
+		b->pgdir = __pa(mm->pgd);
+		b->addr = addr;
+		b->ptep = ptep;
+	}
+	b->num++;
+}
+
 /* 
  * The Guest set a pte entry. it will go back to the Host and let the Host
  * set the relative shodow pagetable entry of the Guest. 
@@ -274,7 +404,7 @@ static void lguest_set_pte_at(struct mm_struct *mm, unsigned long addr, pte_t *p
 		ext = PTE_EXT_NG;
 	}
 	do_guest_set_pte(ptep, pteval, ext);
-	lazy_hcall(__pa(mm->pgd), addr, (unsigned long)pteval, LHCALL_SET_PTE);
+	lguest_pte_update(mm, addr, ptep, pteval);
 }
 
 
@@ -285,7 +415,37 @@ static void lguest_set_pte_at(struct mm_struct *mm, unsigned long addr, pte_t *p
 void lguest_pte_clear(struct mm_struct *mm, unsigned long addr, pte_t *ptep)
 {
 	do_guest_set_pte(ptep, __pte(0), 0);
-	lazy_hcall(__pa(mm->pgd), addr, 0, LHCALL_SET_PTE);
+	lguest_pte_update(mm, addr, ptep, __pte(0));
+}
+
+/*
+ * Entering lazy mode just means lazy_hcall() stops trapping.  When we leave,
+ * we send off the last run of PTEs and, if that left anything in the ring,
+ * make one trip to the Host to run it.
+ */
+static void lguest_arch_enter_lazy_mmu_mode(void)
+{
+	preempt_disable();
+	__get_cpu_var(avm_lazy_mode) = AVM_LAZY_MMU;
+}
+
+static void lguest_arch_flush_lazy_mmu_mode(void)
+{
+	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+
+	if (avm_get_lazy_mode() != AVM_LAZY_MMU)
+		return;
+	lguest_flush_pte_batch();
+	/* The Host empties the ring whenever we trap, so this means idle. */
+	if (lgregs->hcall_prod != lgregs->hcall_cons)
+		immediate_hcall(0, 0, 0, LHCALL_FLUSH_ASYNC);
+}
+
+static void lguest_arch_leave_lazy_mmu_mode(void)
+{
+	lguest_arch_flush_lazy_mmu_mode();
+	__get_cpu_var(avm_lazy_mode) = AVM_LAZY_NONE;
+	preempt_enable();
 }
 
 
@@ -423,21 +583,24 @@ static void lguest_arch_local_irq_restore(unsigned long x)
 	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
 
 	lgregs->irq_disabled = x;
-	/* If there are still some pending irqs, the Guest go back to the Host*/
-	if((!(lgregs->irq_disabled & PSR_I_BIT)) && (lgregs->irq_pending))
+	if (x & PSR_I_BIT)
+		return;
+
+	/*
+	 * The Host only kicks us out for an interrupt when it sees we have them
+	 * enabled, so it mustn't miss our store above, nor we its store to
+	 * irqs_pending.  If one we can take is waiting, we go back to the Host:
+	 * we get it delivered on the way back in.
+	 */
+	mb();
+	if (lguest_irq_deliverable(lgregs))
 		immediate_hcall(0, 5, 0, LHCALL_SEND_INTERRUPTS);
 }
 
 /* Enable local irqs*/
 static void lguest_arch_local_irq_enable(void)
 {
-	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
-
-	lgregs->irq_disabled = 0;
-
-	/* If there are still some pending irqs, the Guest go back to the Host*/
-	if(lgregs->irq_pending)
-		immediate_hcall(0, 6, 0, LHCALL_SEND_INTERRUPTS);
+	lguest_arch_local_irq_restore(0);
 }
 
 /* Interrupts go off... */
@@ -832,10 +995,15 @@ static int lguest___get_cpu_architecture(void)
 	return lgregs->guest_cpu_arch;
 }
 
-/* We do nothing here.*/
+/*
+ * There's no TCM for the Guest, but this is where the native kernel counts
+ * its CPUs: the Host tells us how many we have (see platsmp.c).
+ */
 static void lguest_cpu_tcm_init(void)
 {
-
+#ifdef CONFIG_SMP
+	smp_init_cpus();
+#endif
 }
 
 /* We do nothing here.*/
@@ -1008,6 +1176,9 @@ __init void lguest_init(void)
 	SET_HOOK(pmd_clear);
 	SET_HOOK(pte_clear);
 	SET_HOOK(set_pte_at);
+	SET_HOOK(arch_enter_lazy_mmu_mode);
+	SET_HOOK(arch_leave_lazy_mmu_mode);
+	SET_HOOK(arch_flush_lazy_mmu_mode);
 
 	/* arch/arm/include/asm/proc-fns.h */
 	SET_HOOK(cpu_get_pgd);
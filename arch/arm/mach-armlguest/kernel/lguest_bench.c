@@ -0,0 +1,240 @@
+/*
+ * How much does it cost to be a Guest?  Reading
+ * /sys/kernel/debug/lguest_bench times the things the Host does for us over
+ * and over, and prints one line per test:
+ *
+ *	<test> samples=<n> total_ns=<ns> min_ns=<ns> avg_ns=<ns> max_ns=<ns>
+ *
+ * so a script can compare runs against each other.  "iterations=" on the
+ * kernel command line (as lguest_bench.iterations=) sets how many samples
+ * each test takes.
+ *
+ * The tests are:
+ *	hcall		an immediate hypercall which does nothing.
+ *	hcall_lazy32	32 hypercalls queued in the ring, then one flush.
+ *	shadow_fault	first write to a page the Host hasn't mapped for us yet.
+ *	switch_mm	switching between two page tables the Host has cached.
+ *	timer_irq	how late our timer interrupt arrives after its deadline.
+ *
+ * Device throughput is measured from userspace (eg. dd to /dev/vda), with
+ * the Launcher's --bench option counting what its backends did.
+ */
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <linux/mm_types.h>
+#include <asm/lguest_hcall.h>
+#include <asm/pgtable.h>
+#include <asm/memory.h>
+#include <asm/div64.h>
+
+extern void immediate_hcall(unsigned long arg1, unsigned long arg2,
+			    unsigned long arg3, unsigned long call);
+
+extern void lazy_hcall(unsigned long arg1, unsigned long arg2,
+		       unsigned long arg3, unsigned long call);
+
+static unsigned int iterations = 1000;
+module_param(iterations, uint, 0644);
+
+/* Half a ring, so the ring never fills up and makes us flush early. */
+#define LAZY_BATCH	32
+
+struct bench_result {
+	unsigned long samples;
+	u64 total_ns, min_ns, max_ns;
+};
+
+static inline u64 bench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void bench_record(struct bench_result *r, u64 ns)
+{
+	if (!r->samples || ns < r->min_ns)
+		r->min_ns = ns;
+	if (ns > r->max_ns)
+		r->max_ns = ns;
+	r->total_ns += ns;
+	r->samples++;
+}
+
+static void bench_show(struct seq_file *m, const char *name,
+		       const struct bench_result *r)
+{
+	u64 avg = r->total_ns;
+
+	if (r->samples)
+		do_div(avg, r->samples);
+	seq_printf(m, "%s samples=%lu total_ns=%llu min_ns=%llu avg_ns=%llu"
+		   " max_ns=%llu\n", name, r->samples,
+		   (unsigned long long)r->total_ns,
+		   (unsigned long long)r->min_ns, (unsigned long long)avg,
+		   (unsigned long long)r->max_ns);
+}
+
+/* LHCALL_FLUSH_ASYNC does nothing but bring us to the Host and back. */
+static void bench_hcall(struct bench_result *r)
+{
+	unsigned int i;
+	u64 start;
+
+	for (i = 0; i < iterations; i++) {
+		start = bench_now();
+		immediate_hcall(0, 0, 0, LHCALL_FLUSH_ASYNC);
+		bench_record(r, bench_now() - start);
+	}
+}
+
+static void bench_hcall_lazy(struct bench_result *r)
+{
+	unsigned int i, j;
+	u64 start;
+
+	for (i = 0; i < iterations; i++) {
+		preempt_disable();
+		start = bench_now();
+		arch_enter_lazy_mmu_mode();
+		for (j = 0; j < LAZY_BATCH; j++)
+			lazy_hcall(0, 0, 0, LHCALL_FLUSH_ASYNC);
+		arch_leave_lazy_mmu_mode();
+		bench_record(r, bench_now() - start);
+		preempt_enable();
+	}
+}
+
+/*
+ * A fresh vmalloc() area is mapped in our page tables but not yet in the
+ * Host's shadow, so the first write to it is a shadow fault.  The Host fills
+ * in the neighbours of a faulting page too, so later writes nearby mostly
+ * aren't faults at all: we only time the first one.  vfree() tells the Host
+ * to drop the mapping again.
+ */
+static void bench_shadow_fault(struct bench_result *r)
+{
+	unsigned int i;
+	char *area;
+	u64 start;
+
+	for (i = 0; i < iterations; i++) {
+		area = vmalloc(PAGE_SIZE);
+		if (!area)
+			return;
+		start = bench_now();
+		ACCESS_ONCE(area[0]) = 1;
+		bench_record(r, bench_now() - start);
+		vfree(area);
+	}
+}
+
+/*
+ * We flip between the kernel's page table and our own, which the Host keeps
+ * shadows for, and finish on our own.
+ */
+static void bench_switch_mm(struct bench_result *r)
+{
+	struct mm_struct *mm = current->active_mm;
+	unsigned int i;
+	u64 start;
+
+	for (i = 0; i < iterations; i++) {
+		preempt_disable();
+		start = bench_now();
+		immediate_hcall(virt_to_phys(init_mm.pgd), init_mm.context.id,
+				(unsigned long)&init_mm, LHCALL_SWITCH_MM);
+		immediate_hcall(virt_to_phys(mm->pgd), mm->context.id,
+				(unsigned long)mm, LHCALL_SWITCH_MM);
+		bench_record(r, bench_now() - start);
+		preempt_enable();
+	}
+}
+
+/*
+ * The timer interrupt is one the Host injects itself, when the hrtimer it
+ * set for our deadline fires; the Launcher's device interrupts take the same
+ * path from set_interrupt() on.
+ */
+struct bench_timer {
+	struct hrtimer timer;
+	struct completion done;
+	u64 late_ns;
+};
+
+static enum hrtimer_restart bench_timer_fn(struct hrtimer *timer)
+{
+	struct bench_timer *bt = container_of(timer, struct bench_timer, timer);
+
+	bt->late_ns = ktime_to_ns(ktime_sub(ktime_get(),
+					    hrtimer_get_expires(timer)));
+	complete(&bt->done);
+	return HRTIMER_NORESTART;
+}
+
+static void bench_timer_irq(struct bench_result *r)
+{
+	struct bench_timer bt;
+	unsigned int i;
+
+	hrtimer_init_on_stack(&bt.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bt.timer.function = bench_timer_fn;
+	for (i = 0; i < iterations; i++) {
+		init_completion(&bt.done);
+		hrtimer_start(&bt.timer, ns_to_ktime(50 * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+		wait_for_completion(&bt.done);
+		bench_record(r, bt.late_ns);
+	}
+	destroy_hrtimer_on_stack(&bt.timer);
+}
+
+static const struct {
+	const char *name;
+	void (*run)(struct bench_result *r);
+} benches[] = {
+	{ "hcall",		bench_hcall },
+	{ "hcall_lazy32",	bench_hcall_lazy },
+	{ "shadow_fault",	bench_shadow_fault },
+	{ "switch_mm",		bench_switch_mm },
+	{ "timer_irq",		bench_timer_irq },
+};
+
+static int lguest_bench_show(struct seq_file *m, void *v)
+{
+	struct bench_result r;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		memset(&r, 0, sizeof(r));
+		benches[i].run(&r);
+		bench_show(m, benches[i].name, &r);
+	}
+	return 0;
+}
+
+static int lguest_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lguest_bench_show, NULL);
+}
+
+static const struct file_operations lguest_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lguest_bench_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init lguest_bench_init(void)
+{
+	debugfs_create_file("lguest_bench", 0400, NULL, NULL,
+			    &lguest_bench_fops);
+	return 0;
+}
+late_initcall(lguest_bench_init);
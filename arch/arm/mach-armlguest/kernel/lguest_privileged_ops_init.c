@@ -2,6 +2,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/hardirq.h>
+#include <linux/percpu.h>
 #include <asm/lguest_privileged_fp.h>
 #include <asm/unified.h>
 #include <asm/lguest-native.h>
@@ -9,14 +10,19 @@
 #include <asm/lguest-hooks.h>
 
 /*
- * The lazy hypercall has not been implemented by now.
- * we just return AVM_LAZY_NONE, so lazy_hcall works the same
- * way as immediate_hcall. 
+ * The Guest sets this while it is inside arch_enter_lazy_mmu_mode(): then
+ * lazy_hcall() just queues the hypercall in the ring and the Host runs the
+ * lot when we leave (or when the ring fills up).  Interrupt handlers never
+ * batch: they expect their page table changes to take effect immediately.
  */
+DEFINE_PER_CPU(enum avm_lazy_mode, avm_lazy_mode) = AVM_LAZY_NONE;
+
 enum avm_lazy_mode avm_get_lazy_mode(void)
 {
 	/* AVM_LAZY_NONE is defined in linux/arch/arm/include/asm/lguest_privileged_fp.h */
-	return AVM_LAZY_NONE;
+	if (in_interrupt())
+		return AVM_LAZY_NONE;
+	return __get_cpu_var(avm_lazy_mode);
 }
 
 /* Define initial versions of hookable functions. */
@@ -57,6 +63,9 @@ HOOK(copy_pmd);
 HOOK(pmd_clear);
 HOOK(pte_clear);
 HOOK(set_pte_at);
+HOOK(arch_enter_lazy_mmu_mode);
+HOOK(arch_leave_lazy_mmu_mode);
+HOOK(arch_flush_lazy_mmu_mode);
 
 /* arch/arm/include/asm/proc-fns.h */
 HOOK(cpu_get_pgd);
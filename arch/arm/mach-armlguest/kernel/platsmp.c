@@ -0,0 +1,79 @@
+/*
+ *  linux/arch/arm/mach-armlguest/kernel/platsmp.c
+ *
+ *  SMP support for the ARM Lguest Guest.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/init.h>
+#include <linux/errno.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+
+#include <asm/smp.h>
+#include <asm/memory.h>
+#include <asm/pgtable.h>
+#include <asm/lguest_hcall.h>
+#include <asm/lguest.h>
+
+extern void *lguest_page_base;
+
+extern void immediate_hcall(unsigned long arg1, unsigned long arg2,
+				unsigned long arg3, unsigned long call);
+
+extern void lguest_clockevent_init(void);
+
+/*G:060
+ * The Guest has no interrupt controller to raise IPIs with, so it asks the
+ * Host.  All the IPIs come in on LGUEST_IPI_IRQ; see lguest_do_IPI().
+ */
+static void lguest_cross_call(const struct cpumask *mask, unsigned int ipi)
+{
+	immediate_hcall(cpumask_bits(mask)[0], ipi, 0, LHCALL_SEND_IPI);
+}
+
+/*
+ * Initialise the CPU possible map early.  The Launcher told the Host how
+ * many CPUs we have before we booted, and the Host put it in our page.
+ */
+void __init smp_init_cpus(void)
+{
+	struct lguest_regs *lgregs = (struct lguest_regs *)lguest_page_base;
+	unsigned int i, ncores = lgregs->guest_nr_cpus;
+
+	/* sanity check */
+	if (ncores > nr_cpu_ids) {
+		pr_warn("SMP: %u cores greater than maximum (%u), clipping\n",
+			ncores, nr_cpu_ids);
+		ncores = nr_cpu_ids;
+	}
+
+	for (i = 0; i < ncores; i++)
+		set_cpu_possible(i, true);
+
+	set_smp_cross_call(lguest_cross_call);
+}
+
+/* There's nothing to switch on: the Host keeps the CPUs for us. */
+void __init platform_smp_prepare_cpus(unsigned int max_cpus)
+{
+}
+
+/*
+ * The Host starts the CPU on its idle thread's stack and our kernel page
+ * table; it gets its own registers page, so there's no pen to release.
+ */
+int __cpuinit boot_secondary(unsigned int cpu, struct task_struct *idle)
+{
+	immediate_hcall(cpu, (unsigned long)secondary_data.stack,
+			virt_to_phys(swapper_pg_dir), LHCALL_CPU_UP);
+	return 0;
+}
+
+void __cpuinit platform_secondary_init(unsigned int cpu)
+{
+	/* Each CPU has its own timer from the Host. */
+	lguest_clockevent_init();
+}
@@ -138,6 +138,9 @@ static void skb_xmit_done(struct virtqueue *svq)
 
 	/* We were probably waiting for more output buffers. */
 	netif_wake_queue(vi->dev);
+
+	/* Or Byte Queue Limits were waiting for these to complete. */
+	napi_schedule(&vi->napi);
 }
 
 static void set_skb_frag(struct sk_buff *skb, struct page *page,
@@ -504,12 +507,54 @@ static void refill_work(struct work_struct *work)
 		schedule_delayed_work(&vi->refill, HZ/2);
 }
 
+static unsigned int free_old_xmit_skbs(struct virtnet_info *vi)
+{
+	struct sk_buff *skb;
+	unsigned int len, tot_sgs = 0, bytes = 0, pkts = 0;
+	struct virtnet_stats __percpu *stats = this_cpu_ptr(vi->stats);
+
+	while ((skb = virtqueue_get_buf(vi->svq, &len)) != NULL) {
+		pr_debug("Sent skb %p\n", skb);
+
+		u64_stats_update_begin(&stats->syncp);
+		stats->tx_bytes += skb->len;
+		stats->tx_packets++;
+		u64_stats_update_end(&stats->syncp);
+
+		bytes += skb->len;
+		pkts++;
+		tot_sgs += skb_vnet_hdr(skb)->num_sg;
+		dev_kfree_skb_any(skb);
+	}
+	netdev_completed_queue(vi->dev, pkts, bytes);
+	return tot_sgs;
+}
+
+/*
+ * We normally reap sent buffers at the start of start_xmit(), but once
+ * Byte Queue Limits think there's enough in flight the stack stops calling
+ * that.  Then skb_xmit_done() kicks our NAPI poll to reap them instead.
+ */
+static void virtnet_clean_tx(struct virtnet_info *vi)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(vi->dev, 0);
+
+	if (!netif_xmit_stopped(txq))
+		return;
+
+	__netif_tx_lock(txq, raw_smp_processor_id());
+	free_old_xmit_skbs(vi);
+	__netif_tx_unlock(txq);
+}
+
 static int virtnet_poll(struct napi_struct *napi, int budget)
 {
 	struct virtnet_info *vi = container_of(napi, struct virtnet_info, napi);
 	void *buf;
 	unsigned int len, received = 0;
 
+	virtnet_clean_tx(vi);
+
 again:
 	while (received < budget &&
 	       (buf = virtqueue_get_buf(vi->rvq, &len)) != NULL) {
@@ -537,26 +582,6 @@ again:
 	return received;
 }
 
-static unsigned int free_old_xmit_skbs(struct virtnet_info *vi)
-{
-	struct sk_buff *skb;
-	unsigned int len, tot_sgs = 0;
-	struct virtnet_stats __percpu *stats = this_cpu_ptr(vi->stats);
-
-	while ((skb = virtqueue_get_buf(vi->svq, &len)) != NULL) {
-		pr_debug("Sent skb %p\n", skb);
-
-		u64_stats_update_begin(&stats->syncp);
-		stats->tx_bytes += skb->len;
-		stats->tx_packets++;
-		u64_stats_update_end(&stats->syncp);
-
-		tot_sgs += skb_vnet_hdr(skb)->num_sg;
-		dev_kfree_skb_any(skb);
-	}
-	return tot_sgs;
-}
-
 static int xmit_skb(struct virtnet_info *vi, struct sk_buff *skb)
 {
 	struct skb_vnet_hdr *hdr = skb_vnet_hdr(skb);
@@ -607,6 +632,7 @@ static int xmit_skb(struct virtnet_info *vi, struct sk_buff *skb)
 static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct virtnet_info *vi = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
 	int capacity;
 
 	/* Free up any pending old buffers before queueing new ones. */
@@ -632,6 +658,7 @@ static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
 		kfree_skb(skb);
 		return NETDEV_TX_OK;
 	}
+	netdev_tx_sent_queue(txq, skb->len);
 	virtqueue_kick(vi->svq);
 
 	/* Don't wait up for transmitted skbs to be freed. */
@@ -650,6 +677,17 @@ static netdev_tx_t start_xmit(struct sk_buff *skb, struct net_device *dev)
 				virtqueue_disable_cb(vi->svq);
 			}
 		}
+	} else if (unlikely(netif_xmit_stopped(txq))) {
+		/* Byte Queue Limits stopped us: no more start_xmit() calls
+		 * will come to reap, so ask to hear of the next completion,
+		 * unless some already happened and let us start again. */
+		while (unlikely(!virtqueue_enable_cb(vi->svq))) {
+			free_old_xmit_skbs(vi);
+			if (!netif_xmit_stopped(txq)) {
+				virtqueue_disable_cb(vi->svq);
+				break;
+			}
+		}
 	}
 
 	return NETDEV_TX_OK;
@@ -1101,6 +1139,7 @@ static void free_unused_bufs(struct virtnet_info *vi)
 			break;
 		dev_kfree_skb(buf);
 	}
+	netdev_reset_queue(vi->dev);
 	while (1) {
 		buf = virtqueue_detach_unused_buf(vi->rvq);
 		if (!buf)
@@ -33,6 +33,8 @@
 #include <linux/bitops.h>
 #include <linux/mutex.h>
 #include <linux/anon_inodes.h>
+#include <linux/net.h>
+#include <net/busy_poll.h>
 #include <asm/uaccess.h>
 #include <asm/system.h>
 #include <asm/io.h>
@@ -197,6 +199,11 @@ struct eventpoll {
 
 	/* The user that created the eventpoll descriptor */
 	struct user_struct *user;
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	/* NAPI context of the last socket found ready, to busy poll */
+	unsigned int napi_id;
+#endif
 };
 
 /* Wait structure used by the poll hooks */
@@ -337,6 +344,55 @@ static inline int ep_events_available(struct eventpoll *ep)
 	return !list_empty(&ep->rdllist) || ep->ovflist != EP_UNACTIVE_PTR;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+static bool ep_busy_loop_end(void *p)
+{
+	struct eventpoll *ep = p;
+
+	return ep_events_available(ep);
+}
+
+/*
+ * Busy poll the NAPI context that last brought data to one of our sockets,
+ * for up to net.core.busy_poll usecs or until something is ready.
+ */
+static void ep_busy_loop(struct eventpoll *ep)
+{
+	unsigned int napi_id = ACCESS_ONCE(ep->napi_id);
+
+	if (napi_id && net_busy_loop_on())
+		napi_busy_loop(napi_id, busy_loop_end_time(),
+			       ep_busy_loop_end, ep);
+}
+
+/* If @epi is a socket which can be busy polled, busy poll its queue next */
+static void ep_set_busy_poll_napi_id(struct epitem *epi)
+{
+	struct socket *sock;
+	unsigned int napi_id;
+	int err;
+
+	if (!net_busy_loop_on())
+		return;
+
+	sock = sock_from_file(epi->ffd.file, &err);
+	if (!sock || !sock->sk)
+		return;
+
+	napi_id = ACCESS_ONCE(sock->sk->sk_napi_id);
+	if (napi_id && epi->ep->napi_id != napi_id)
+		epi->ep->napi_id = napi_id;
+}
+#else
+static inline void ep_busy_loop(struct eventpoll *ep)
+{
+}
+
+static inline void ep_set_busy_poll_napi_id(struct epitem *epi)
+{
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 /**
  * ep_call_nested - Perform a bound (possibly) nested call, by checking
  *                  that the recursion limit is not exceeded, and that
@@ -966,6 +1022,7 @@ static int ep_insert(struct eventpoll *ep, struct epoll_event *event,
 	 * the new item.
 	 */
 	revents = tfile->f_op->poll(tfile, &epq.pt);
+	ep_set_busy_poll_napi_id(epi);
 
 	/*
 	 * We have to check if something went wrong during the poll wait queue
@@ -1108,6 +1165,7 @@ static int ep_send_events_proc(struct eventpoll *ep, struct list_head *head,
 		 * can change the item.
 		 */
 		if (revents) {
+			ep_set_busy_poll_napi_id(epi);
 			if (__put_user(revents, &uevent->events) ||
 			    __put_user(epi->event.data, &uevent->data)) {
 				list_add(&epi->rdllink, head);
@@ -1202,6 +1260,9 @@ static int ep_poll(struct eventpoll *ep, struct epoll_event __user *events,
 	}
 
 fetch_events:
+	if (!ep_events_available(ep))
+		ep_busy_loop(ep);
+
 	spin_lock_irqsave(&ep->lock, flags);
 
 	if (!ep_events_available(ep)) {
@@ -28,6 +28,8 @@
 #define POLLRDHUP       0x2000
 #endif
 
+#define POLL_BUSY_LOOP	0x8000	/* in-kernel: caller would busy poll sockets */
+
 struct pollfd {
 	int fd;
 	short events;
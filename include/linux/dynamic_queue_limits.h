@@ -0,0 +1,79 @@
+/*
+ * Dynamic queue limits (dql) - Definitions
+ *
+ * dql bounds how much is outstanding in a producer/consumer queue, such
+ * as a NIC's transmit ring, to no more than it needs not to run dry
+ * between two completion events.  The producer reports what it queues
+ * with dql_queued() and asks dql_avail() whether it may queue more; the
+ * consumer reports what it finished with dql_completed(), which is where
+ * the limit is recalculated:
+ *
+ *  - if the queue was over its limit and then ran empty (starved), the
+ *    limit was too small, and grows by what completed in the interval;
+ *  - if it stayed busy through several intervals with bytes to spare
+ *    (slack), the limit shrinks by the least slack seen over
+ *    slack_hold_time.
+ *
+ * Queuing and completion each touch only their own cacheline of struct
+ * dql.  Each must be serialized against itself by the caller, but the two
+ * may run concurrently.
+ *
+ * For the algorithm, see lib/dynamic_queue_limits.c.
+ */
+#ifndef _LINUX_DQL_H
+#define _LINUX_DQL_H
+
+#ifdef __KERNEL__
+
+#include <linux/bug.h>
+#include <linux/cache.h>
+#include <linux/kernel.h>
+
+struct dql {
+	/* Fields accessed in enqueue path (dql_queued) */
+	unsigned int	num_queued;		/* Total ever queued */
+	unsigned int	adj_limit;		/* limit + num_completed */
+	unsigned int	last_obj_cnt;		/* Count at last queuing */
+
+	/* Fields accessed only by completion path (dql_completed) */
+	unsigned int	limit ____cacheline_aligned_in_smp; /* Current limit */
+	unsigned int	num_completed;		/* Total ever completed */
+
+	unsigned int	prev_ovlimit;		/* Previous over limit */
+	unsigned int	prev_num_queued;	/* Previous queue total */
+	unsigned int	prev_last_obj_cnt;	/* Previous queuing cnt */
+
+	unsigned int	lowest_slack;		/* Lowest slack found */
+	unsigned long	slack_start_time;	/* Time slacks seen */
+
+	/* Configuration */
+	unsigned int	max_limit;		/* Max limit */
+	unsigned int	min_limit;		/* Minimum limit */
+	unsigned int	slack_hold_time;	/* Time to measure slack */
+};
+
+/* Keep the counters' differences unambiguous across wraparound. */
+#define DQL_MAX_OBJECT (UINT_MAX / 16)
+#define DQL_MAX_LIMIT ((UINT_MAX / 2) - DQL_MAX_OBJECT)
+
+/* Record @count more objects (eg. bytes) handed to the consumer. */
+static inline void dql_queued(struct dql *dql, unsigned int count)
+{
+	BUG_ON(count > DQL_MAX_OBJECT);
+
+	dql->num_queued += count;
+	dql->last_obj_cnt = count;
+}
+
+/* How many more objects may be queued; negative means over the limit. */
+static inline int dql_avail(const struct dql *dql)
+{
+	return dql->adj_limit - dql->num_queued;
+}
+
+extern void dql_completed(struct dql *dql, unsigned int count);
+extern void dql_reset(struct dql *dql);
+extern int dql_init(struct dql *dql, unsigned hold_time);
+
+#endif /* __KERNEL__ */
+#endif /* _LINUX_DQL_H */
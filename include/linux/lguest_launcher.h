@@ -63,6 +63,11 @@ enum lguest_req
 	LHREQ_IRQ, /* + irq */
 	LHREQ_BREAK, /* No longer used */
 	LHREQ_EVENTFD, /* + address, fd. */
+	LHREQ_NEWCPU, /* at offset = the new CPU's id */
+	LHREQ_IRQFD, /* + fd, irq */
+	LHREQ_RELEASE_PAGES, /* + pfn, num */
+	LHREQ_SAVECPU, /* + buffer, length */
+	LHREQ_RESTORECPU, /* + buffer, length */
 };
 
 /*
@@ -603,4 +603,74 @@ struct tc_qfq_stats {
 	__u32 lmax;
 };
 
+/* CODEL */
+
+enum {
+	TCA_CODEL_UNSPEC,
+	TCA_CODEL_TARGET,	/* us */
+	TCA_CODEL_LIMIT,	/* packets */
+	TCA_CODEL_INTERVAL,	/* us */
+	TCA_CODEL_ECN,
+	__TCA_CODEL_MAX
+};
+
+#define TCA_CODEL_MAX	(__TCA_CODEL_MAX - 1)
+
+struct tc_codel_xstats {
+	__u32	maxpacket;	/* largest packet we've seen so far */
+	__u32	count;		/* drops since we last entered dropping state */
+	__u32	lastcount;	/* count at entry to dropping state */
+	__u32	ldelay;		/* sojourn time of last dequeued packet, us */
+	__s32	drop_next;	/* time to drop next packet, us from now */
+	__u32	drop_overlimit;	/* times the packet limit was hit */
+	__u32	ecn_mark;	/* packets ECN marked instead of dropped */
+	__u32	dropping;	/* are we in dropping state ? */
+};
+
+/* FQ_CODEL */
+
+enum {
+	TCA_FQ_CODEL_UNSPEC,
+	TCA_FQ_CODEL_TARGET,	/* us */
+	TCA_FQ_CODEL_LIMIT,	/* packets */
+	TCA_FQ_CODEL_INTERVAL,	/* us */
+	TCA_FQ_CODEL_ECN,
+	TCA_FQ_CODEL_FLOWS,	/* number of flow queues, only at creation */
+	TCA_FQ_CODEL_QUANTUM,	/* bytes per DRR round */
+	__TCA_FQ_CODEL_MAX
+};
+
+#define TCA_FQ_CODEL_MAX	(__TCA_FQ_CODEL_MAX - 1)
+
+enum {
+	TCA_FQ_CODEL_XSTATS_QDISC,
+	TCA_FQ_CODEL_XSTATS_CLASS,
+};
+
+struct tc_fq_codel_qd_stats {
+	__u32	maxpacket;	/* largest packet we've seen so far */
+	__u32	drop_overlimit;	/* times the packet limit was hit */
+	__u32	ecn_mark;	/* packets ECN marked instead of dropped */
+	__u32	new_flow_count;	/* times a packet started a new flow */
+	__u32	new_flows_len;	/* count of flows in new list */
+	__u32	old_flows_len;	/* count of flows in old list */
+};
+
+struct tc_fq_codel_cl_stats {
+	__s32	deficit;
+	__u32	ldelay;		/* sojourn time of last dequeued packet, us */
+	__u32	count;
+	__u32	lastcount;
+	__u32	dropping;
+	__s32	drop_next;
+};
+
+struct tc_fq_codel_xstats {
+	__u32	type;
+	union {
+		struct tc_fq_codel_qd_stats qdisc_stats;
+		struct tc_fq_codel_cl_stats class_stats;
+	};
+};
+
 #endif
@@ -224,11 +224,27 @@ enum {
  * The callback notifies userspace to release buffers when skb DMA is done in
  * lower device, the skb last reference should be 0 when calling this.
  * The desc is used to track userspace buffer index.
+ *
+ * A socket's MSG_ZEROCOPY sends use the second form instead, with
+ * sock_zerocopy_callback() dropping one of @refcnt, held by each skb
+ * data whose frags point at sends @id to @id + @len - 1.  The last one
+ * queues their completion on the socket's error queue.
  */
 struct ubuf_info {
 	void (*callback)(void *);
-	void *arg;
-	unsigned long desc;
+	union {
+		struct {
+			void *arg;
+			unsigned long desc;
+		};
+		struct {
+			u32 id;
+			u16 len;
+			u16 zerocopy:1;
+			u32 bytelen;
+		};
+	};
+	atomic_t refcnt;
 };
 
 /* This data is invariant across clones and lives at
@@ -354,6 +370,7 @@ typedef unsigned char *sk_buff_data_t;
  *		ports.
  *	@dma_cookie: a cookie to one of several possible DMA operations
  *		done by skb DMA functions
+ *	@napi_id: id of the NAPI context the packet was received by
  *	@secmark: security marking
  *	@mark: Generic packet mark
  *	@dropcount: total number of sk_receive_queue overflows
@@ -452,6 +469,9 @@ struct sk_buff {
 #ifdef CONFIG_NET_DMA
 	dma_cookie_t		dma_cookie;
 #endif
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	unsigned int		napi_id;
+#endif
 #ifdef CONFIG_NETWORK_SECMARK
 	__u32			secmark;
 #endif
@@ -557,6 +577,14 @@ extern bool skb_recycle_check(struct sk_buff *skb, int skb_size);
 
 extern struct sk_buff *skb_morph(struct sk_buff *dst, struct sk_buff *src);
 extern int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask);
+extern void sock_zerocopy_callback(void *arg);
+extern struct ubuf_info *sock_zerocopy_realloc(struct sock *sk, size_t size,
+					       struct ubuf_info *uarg);
+extern void sock_zerocopy_put(struct ubuf_info *uarg);
+extern void sock_zerocopy_put_abort(struct ubuf_info *uarg);
+extern int skb_zerocopy_from_user(struct sock *sk, struct sk_buff *skb,
+				  const void __user *from, int length,
+				  struct ubuf_info *uarg);
 extern struct sk_buff *skb_clone(struct sk_buff *skb,
 				 gfp_t priority);
 extern struct sk_buff *skb_copy(const struct sk_buff *skb,
@@ -1584,6 +1612,77 @@ static inline void skb_orphan(struct sk_buff *skb)
 	skb->sk		= NULL;
 }
 
+static inline struct ubuf_info *skb_zcopy(struct sk_buff *skb)
+{
+	bool is_zcopy = skb && skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY;
+
+	return is_zcopy ? skb_shinfo(skb)->destructor_arg : NULL;
+}
+
+static inline bool skb_zcopy_is_sock(const struct ubuf_info *uarg)
+{
+	return uarg->callback == sock_zerocopy_callback;
+}
+
+static inline void sock_zerocopy_get(struct ubuf_info *uarg)
+{
+	atomic_inc(&uarg->refcnt);
+}
+
+/* Make @skb's data, whose frags now include user pages of the
+ * MSG_ZEROCOPY send @uarg, hold a reference on it.
+ */
+static inline void skb_zcopy_set(struct sk_buff *skb, struct ubuf_info *uarg)
+{
+	if (skb && uarg && !skb_zcopy(skb)) {
+		sock_zerocopy_get(uarg);
+		skb_shinfo(skb)->destructor_arg = uarg;
+		skb_shinfo(skb)->tx_flags |= SKBTX_DEV_ZEROCOPY;
+	}
+}
+
+/* Release the user buffers @skb's data points at; @zerocopy is false
+ * when they had to be copied after all.
+ */
+static inline void skb_zcopy_clear(struct sk_buff *skb, bool zerocopy)
+{
+	struct ubuf_info *uarg = skb_zcopy(skb);
+
+	if (uarg) {
+		if (skb_zcopy_is_sock(uarg))
+			uarg->zerocopy = uarg->zerocopy && zerocopy;
+		if (uarg->callback)
+			uarg->callback(uarg);
+		skb_shinfo(skb)->tx_flags &= ~SKBTX_DEV_ZEROCOPY;
+	}
+}
+
+/**
+ *	skb_orphan_frags - copy user frags of a buffer about to be shared
+ *	@skb: buffer to orphan frags from
+ *	@gfp_mask: allocation priority
+ *
+ *	Zerocopy frags must be copied into kernel pages before their skb
+ *	data is shared, unless they belong to a socket's MSG_ZEROCOPY
+ *	send, whose completion is reference counted.
+ */
+static inline int skb_orphan_frags(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	struct ubuf_info *uarg = skb_zcopy(skb);
+
+	if (likely(!uarg) || skb_zcopy_is_sock(uarg))
+		return 0;
+	return skb_copy_ubufs(skb, gfp_mask);
+}
+
+/* Frags must be orphaned, even if refcounted, if skb might loop to rx path */
+static inline int skb_orphan_frags_rx(struct sk_buff *skb, gfp_t gfp_mask)
+{
+	if (likely(!skb_zcopy(skb)))
+		return 0;
+	return skb_copy_ubufs(skb, gfp_mask);
+}
+
 /**
  *	__skb_queue_purge - empty a list
  *	@list: list to empty
@@ -2497,7 +2596,7 @@ static inline bool skb_is_recycleable(const struct sk_buff *skb, int skb_size)
 	if (irqs_disabled())
 		return false;
 
-	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY)
+	if (skb_zcopy(skb))
 		return false;
 
 	if (skb_is_nonlinear(skb) || skb->fclone != SKB_FCLONE_UNAVAILABLE)
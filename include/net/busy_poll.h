@@ -0,0 +1,111 @@
+/*
+ * net/busy_poll.h: Low latency socket busy polling
+ *
+ * Rather than sleep until the interrupt, softirq and wakeup path delivers
+ * its data, a socket with nothing to read may spin for a few tens of
+ * microseconds, calling the NAPI poll routine of the device queue it last
+ * received on itself.
+ *
+ * Each NAPI context gets an id when it is added; the packets it delivers
+ * carry that id, and the socket they land on remembers the last one.
+ * recvmsg() busy polls for up to SO_BUSY_POLL usecs (by default
+ * net.core.busy_read), and select, poll and epoll for up to
+ * net.core.busy_poll usecs.  Both default to 0, which is off.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#ifndef _LINUX_NET_BUSY_POLL_H
+#define _LINUX_NET_BUSY_POLL_H
+
+#include <linux/netdevice.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+
+#ifdef CONFIG_NET_RX_BUSY_POLL
+
+extern unsigned int sysctl_net_busy_read __read_mostly;
+extern unsigned int sysctl_net_busy_poll __read_mostly;
+
+/* How many packets one call of a driver's poll may deliver while we spin */
+#define BUSY_POLL_BUDGET 8
+
+static inline bool net_busy_loop_on(void)
+{
+	return sysctl_net_busy_poll;
+}
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return sk->sk_ll_usec && sk->sk_napi_id && !signal_pending(current);
+}
+
+/* A cheap clock good enough for a budget of microseconds: ns >> 10. */
+static inline unsigned long busy_loop_us_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+static inline unsigned long sk_busy_loop_end_time(const struct sock *sk)
+{
+	return busy_loop_us_clock() + ACCESS_ONCE(sk->sk_ll_usec);
+}
+
+static inline unsigned long busy_loop_end_time(void)
+{
+	return busy_loop_us_clock() + ACCESS_ONCE(sysctl_net_busy_poll);
+}
+
+static inline bool busy_loop_timeout(unsigned long end_time)
+{
+	unsigned long now = busy_loop_us_clock();
+
+	return time_after(now, end_time);
+}
+
+extern bool napi_busy_loop(unsigned int napi_id, unsigned long end_time,
+			   bool (*loop_end)(void *), void *arg);
+extern bool sk_busy_loop(struct sock *sk, int nonblock);
+
+/* Remember which NAPI context last brought @sk data. */
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+	sk->sk_napi_id = skb->napi_id;
+}
+
+#else /* CONFIG_NET_RX_BUSY_POLL */
+
+static inline bool net_busy_loop_on(void)
+{
+	return false;
+}
+
+static inline bool sk_can_busy_loop(const struct sock *sk)
+{
+	return false;
+}
+
+static inline unsigned long busy_loop_end_time(void)
+{
+	return 0;
+}
+
+static inline bool busy_loop_timeout(unsigned long end_time)
+{
+	return true;
+}
+
+static inline bool sk_busy_loop(struct sock *sk, int nonblock)
+{
+	return false;
+}
+
+static inline void sk_mark_napi_id(struct sock *sk, const struct sk_buff *skb)
+{
+}
+
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+#endif /* _LINUX_NET_BUSY_POLL_H */
@@ -40,6 +40,17 @@ struct inet_peer {
 	u32			pmtu_orig;
 	u32			pmtu_learned;
 	struct inetpeer_addr_base redirect_learned;
+	/*
+	 * TCP Fast Open: the cookie this peer gave us and the MSS it offered,
+	 * under tcp_fastopen.c's seqlock.  A zero tfo_cookie_len means we
+	 * have none.  tfo_syn_loss counts Fast Open SYNs in a row which got
+	 * no answer, the last at tfo_last_syn_loss (jiffies).
+	 */
+	u16			tfo_mss;
+	u8			tfo_cookie_len;
+	u8			tfo_syn_loss;
+	u8			tfo_cookie[16];
+	unsigned long		tfo_last_syn_loss;
 	/*
 	 * Once inet_peer is queued for deletion (refcnt == -1), following fields
 	 * are not available: rid, ip_id_count, tcp_ts, tcp_ts_stamp
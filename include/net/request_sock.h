@@ -106,12 +106,31 @@ struct listen_sock {
 	struct request_sock	*syn_table[0];
 };
 
+/** struct fastopen_queue - TCP Fast Open children of a listener
+ *
+ * @lock - protects @qlen and the req->sk/listener handoff between
+ *	   accept() and reqsk_fastopen_remove()
+ * @qlen - children whose handshake has not yet completed
+ * @max_qlen - limit on @qlen, set by the TCP_FASTOPEN socket option
+ *
+ * A Fast Open child is put on the accept queue as soon as its SYN arrives,
+ * and keeps its request_sock until the final ACK of the handshake.  Until
+ * then it counts against @max_qlen, which bounds how much a forged SYN
+ * flood with valid cookies can make us hold.
+ */
+struct fastopen_queue {
+	spinlock_t	lock;
+	int		qlen;
+	int		max_qlen;
+};
+
 /** struct request_sock_queue - queue of request_socks
  *
  * @rskq_accept_head - FIFO head of established children
  * @rskq_accept_tail - FIFO tail of established children
  * @rskq_defer_accept - User waits for some data after accept()
  * @syn_wait_lock - serializer
+ * @fastopenq - Fast Open state, allocated when first enabled on a listener
  *
  * %syn_wait_lock is necessary only to avoid proc interface having to grab the main
  * lock sock while browsing the listening hash (otherwise it's deadlock prone).
@@ -129,6 +148,7 @@ struct request_sock_queue {
 	u8			rskq_defer_accept;
 	/* 3 bytes hole, try to pack */
 	struct listen_sock	*listen_opt;
+	struct fastopen_queue	*fastopenq;
 };
 
 extern int reqsk_queue_alloc(struct request_sock_queue *queue,
@@ -136,6 +156,8 @@ extern int reqsk_queue_alloc(struct request_sock_queue *queue,
 
 extern void __reqsk_queue_destroy(struct request_sock_queue *queue);
 extern void reqsk_queue_destroy(struct request_sock_queue *queue);
+extern void reqsk_fastopen_remove(struct sock *sk,
+				  struct request_sock *req);
 
 static inline struct request_sock *
 	reqsk_queue_yank_acceptq(struct request_sock_queue *queue)
@@ -55,6 +55,7 @@
 
 #include <net/checksum.h>
 #include <net/sock.h>
+#include <net/busy_poll.h>
 #include <net/tcp_states.h>
 #include <trace/events/skb.h>
 
@@ -196,6 +197,10 @@ struct sk_buff *__skb_recv_datagram(struct sock *sk, unsigned flags,
 		if (skb)
 			return skb;
 
+		if (sk_can_busy_loop(sk) &&
+		    sk_busy_loop(sk, flags & MSG_DONTWAIT))
+			continue;
+
 		/* User doesn't want to wait */
 		error = -EAGAIN;
 		if (!timeo)
@@ -137,6 +137,7 @@
 #include <linux/if_pppox.h>
 #include <linux/ppp_defs.h>
 #include <linux/net_tstamp.h>
+#include <net/busy_poll.h>
 
 #include "net-sysfs.h"
 
@@ -1570,12 +1571,10 @@ static inline bool is_skb_forwardable(struct net_device *dev,
  */
 int dev_forward_skb(struct net_device *dev, struct sk_buff *skb)
 {
-	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-		if (skb_copy_ubufs(skb, GFP_ATOMIC)) {
-			atomic_long_inc(&dev->rx_dropped);
-			kfree_skb(skb);
-			return NET_RX_DROP;
-		}
+	if (skb_orphan_frags_rx(skb, GFP_ATOMIC)) {
+		atomic_long_inc(&dev->rx_dropped);
+		kfree_skb(skb);
+		return NET_RX_DROP;
 	}
 
 	skb_orphan(skb);
@@ -1598,6 +1597,8 @@ static inline int deliver_skb(struct sk_buff *skb,
 			      struct packet_type *pt_prev,
 			      struct net_device *orig_dev)
 {
+	if (unlikely(skb_orphan_frags_rx(skb, GFP_ATOMIC)))
+		return -ENOMEM;
 	atomic_inc(&skb->users);
 	return pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
 }
@@ -1654,8 +1655,12 @@ static void dev_queue_xmit_nit(struct sk_buff *skb, struct net_device *dev)
 			pt_prev = ptype;
 		}
 	}
-	if (pt_prev)
-		pt_prev->func(skb2, skb->dev, pt_prev, skb->dev);
+	if (pt_prev) {
+		if (unlikely(skb_orphan_frags_rx(skb2, GFP_ATOMIC)))
+			kfree_skb(skb2);
+		else
+			pt_prev->func(skb2, skb->dev, pt_prev, skb->dev);
+	}
 	rcu_read_unlock();
 }
 
@@ -2084,25 +2089,6 @@ static int dev_gso_segment(struct sk_buff *skb, int features)
 	return 0;
 }
 
-/*
- * Try to orphan skb early, right before transmission by the device.
- * We cannot orphan skb if tx timestamp is requested or the sk-reference
- * is needed on driver level for other reasons, e.g. see net/can/raw.c
- */
-static inline void skb_orphan_try(struct sk_buff *skb)
-{
-	struct sock *sk = skb->sk;
-
-	if (sk && !skb_shinfo(skb)->tx_flags) {
-		/* skb_tx_hash() wont be able to get sk.
-		 * We copy sk_hash into skb->rxhash
-		 */
-		if (!skb->rxhash)
-			skb->rxhash = sk->sk_hash;
-		skb_orphan(skb);
-	}
-}
-
 static bool can_checksum_protocol(unsigned long features, __be16 protocol)
 {
 	return ((features & NETIF_F_GEN_CSUM) ||
@@ -2187,8 +2173,6 @@ int dev_hard_start_xmit(struct sk_buff *skb, struct net_device *dev,
 		if (!list_empty(&ptype_all))
 			dev_queue_xmit_nit(skb, dev);
 
-		skb_orphan_try(skb);
-
 		features = netif_skb_features(skb);
 
 		if (vlan_tx_tag_present(skb) &&
@@ -2256,7 +2240,7 @@ gso:
 			return rc;
 		}
 		txq_trans_update(txq);
-		if (unlikely(netif_tx_queue_stopped(txq) && skb->next))
+		if (unlikely(netif_xmit_stopped(txq) && skb->next))
 			return NETDEV_TX_BUSY;
 	} while (skb->next);
 
@@ -2530,7 +2514,7 @@ int dev_queue_xmit(struct sk_buff *skb)
 
 			HARD_TX_LOCK(dev, txq, cpu);
 
-			if (!netif_tx_queue_stopped(txq)) {
+			if (!netif_xmit_stopped(txq)) {
 				__this_cpu_inc(xmit_recursion);
 				rc = dev_hard_start_xmit(skb, dev, txq);
 				__this_cpu_dec(xmit_recursion);
@@ -3330,8 +3314,11 @@ ncls:
 	}
 
 	if (pt_prev) {
+		if (unlikely(skb_orphan_frags_rx(skb, GFP_ATOMIC)))
+			goto drop;
 		ret = pt_prev->func(skb, skb->dev, pt_prev, orig_dev);
 	} else {
+drop:
 		atomic_long_inc(&skb->dev->rx_dropped);
 		kfree_skb(skb);
 		/* Jamal, now you will not able to escape explaining
@@ -3345,6 +3332,30 @@ out:
 	return ret;
 }
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/* The id of the NAPI context this cpu is polling, for skb_mark_napi_id() */
+static DEFINE_PER_CPU(unsigned int, napi_rx_id);
+
+/* Note that this cpu is polling @napi, or no longer is if @napi is NULL */
+static inline void napi_set_rx(const struct napi_struct *napi)
+{
+	__this_cpu_write(napi_rx_id, napi ? napi->napi_id : 0);
+}
+
+static inline void skb_mark_napi_id(struct sk_buff *skb)
+{
+	skb->napi_id = __this_cpu_read(napi_rx_id);
+}
+#else
+static inline void napi_set_rx(const struct napi_struct *napi)
+{
+}
+
+static inline void skb_mark_napi_id(struct sk_buff *skb)
+{
+}
+#endif
+
 /**
  *	netif_receive_skb - process receive buffer from network
  *	@skb: buffer to process
@@ -3365,6 +3376,9 @@ int netif_receive_skb(struct sk_buff *skb)
 	if (netdev_tstamp_prequeue)
 		net_timestamp_check(skb);
 
+	/* Before RPS can move it to another cpu's backlog */
+	skb_mark_napi_id(skb);
+
 	if (skb_defer_rx_timestamp(skb))
 		return NET_RX_SUCCESS;
 
@@ -3853,6 +3867,138 @@ void napi_complete(struct napi_struct *n)
 }
 EXPORT_SYMBOL(napi_complete);
 
+#ifdef CONFIG_NET_RX_BUSY_POLL
+/*
+ * NAPI contexts by id, so that a busy polling socket can find the one its
+ * data last came in on.  An id of 0 means none.
+ */
+#define NAPI_HASH_BITS	8
+#define NAPI_HASH_SIZE	(1 << NAPI_HASH_BITS)
+
+static struct hlist_head napi_hash[NAPI_HASH_SIZE];
+static DEFINE_SPINLOCK(napi_hash_lock);
+static unsigned int napi_gen_id;
+
+/* Must be called under rcu_read_lock() or napi_hash_lock. */
+static struct napi_struct *napi_by_id(unsigned int napi_id)
+{
+	struct napi_struct *napi;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(napi, node,
+				 &napi_hash[napi_id & (NAPI_HASH_SIZE - 1)],
+				 napi_hash_node)
+		if (napi->napi_id == napi_id)
+			return napi;
+	return NULL;
+}
+
+static void napi_hash_add(struct napi_struct *napi)
+{
+	spin_lock(&napi_hash_lock);
+	do {
+		if (unlikely(++napi_gen_id == 0))
+			napi_gen_id = 1;
+	} while (napi_by_id(napi_gen_id));
+	napi->napi_id = napi_gen_id;
+	hlist_add_head_rcu(&napi->napi_hash_node,
+			   &napi_hash[napi->napi_id & (NAPI_HASH_SIZE - 1)]);
+	spin_unlock(&napi_hash_lock);
+}
+
+/* Returns true if @napi was hashed, and so may still be in use by a reader */
+static bool napi_hash_del(struct napi_struct *napi)
+{
+	bool hashed = false;
+
+	spin_lock(&napi_hash_lock);
+	if (!hlist_unhashed(&napi->napi_hash_node)) {
+		hlist_del_init_rcu(&napi->napi_hash_node);
+		hashed = true;
+	}
+	spin_unlock(&napi_hash_lock);
+	return hashed;
+}
+
+/**
+ *	napi_busy_loop - poll a NAPI context from process context
+ *	@napi_id: the context, as recorded in a socket's sk_napi_id
+ *	@end_time: busy_loop_us_clock() to give up at, or 0 for a single pass
+ *	@loop_end: returns true once the caller has something to do
+ *	@arg: argument to @loop_end
+ *
+ *	We only call ->poll() when we can take NAPI_STATE_SCHED, exactly as
+ *	the interrupt handler would, so drivers need no changes: if the driver
+ *	completes, the context is idle again with its interrupt enabled, and
+ *	if it used the whole budget we leave it scheduled for net_rx_action().
+ *	Returns the last value of @loop_end.
+ */
+bool napi_busy_loop(unsigned int napi_id, unsigned long end_time,
+		    bool (*loop_end)(void *), void *arg)
+{
+	struct napi_struct *napi;
+	bool rc = false;
+
+	rcu_read_lock();
+	napi = napi_by_id(napi_id);
+	if (!napi)
+		goto out;
+
+	for (;;) {
+		int work;
+
+		local_bh_disable();
+		if (napi_schedule_prep(napi)) {
+			void *have = netpoll_poll_lock(napi);
+
+			/* Ours now, but not on any poll_list for
+			 * napi_complete() to take it off.
+			 */
+			INIT_LIST_HEAD(&napi->poll_list);
+
+			napi_set_rx(napi);
+			work = napi->poll(napi, BUSY_POLL_BUDGET);
+			napi_set_rx(NULL);
+			trace_napi_poll(napi);
+
+			WARN_ON_ONCE(work > BUSY_POLL_BUDGET);
+			if (work == BUSY_POLL_BUDGET) {
+				if (unlikely(napi_disable_pending(napi)))
+					napi_complete(napi);
+				else
+					__napi_schedule(napi);
+			}
+			netpoll_poll_unlock(have);
+
+			if (work > 0)
+				NET_ADD_STATS_BH(dev_net(napi->dev),
+						 LINUX_MIB_BUSYPOLLRXPACKETS,
+						 work);
+		}
+		local_bh_enable();
+
+		rc = loop_end(arg);
+		if (rc || !end_time || busy_loop_timeout(end_time) ||
+		    need_resched() || signal_pending(current))
+			break;
+		cpu_relax();
+	}
+out:
+	rcu_read_unlock();
+	return rc;
+}
+EXPORT_SYMBOL(napi_busy_loop);
+#else
+static inline void napi_hash_add(struct napi_struct *napi)
+{
+}
+
+static inline bool napi_hash_del(struct napi_struct *napi)
+{
+	return false;
+}
+#endif /* CONFIG_NET_RX_BUSY_POLL */
+
 void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 		    int (*poll)(struct napi_struct *, int), int weight)
 {
@@ -3869,6 +4015,7 @@ void netif_napi_add(struct net_device *dev, struct napi_struct *napi,
 	napi->poll_owner = -1;
 #endif
 	set_bit(NAPI_STATE_SCHED, &napi->state);
+	napi_hash_add(napi);
 }
 EXPORT_SYMBOL(netif_napi_add);
 
@@ -3876,6 +4023,9 @@ void netif_napi_del(struct napi_struct *napi)
 {
 	struct sk_buff *skb, *next;
 
+	might_sleep();
+	if (napi_hash_del(napi))
+		synchronize_net();
 	list_del_init(&napi->dev_list);
 	napi_free_frags(napi);
 
@@ -3931,7 +4081,9 @@ static void net_rx_action(struct softirq_action *h)
 		 */
 		work = 0;
 		if (test_bit(NAPI_STATE_SCHED, &n->state)) {
+			napi_set_rx(n);
 			work = n->poll(n, weight);
+			napi_set_rx(NULL);
 			trace_napi_poll(n);
 		}
 
@@ -5548,6 +5700,9 @@ static void netdev_init_one_queue(struct net_device *dev,
 	queue->xmit_lock_owner = -1;
 	netdev_queue_numa_node_write(queue, NUMA_NO_NODE);
 	queue->dev = dev;
+#ifdef CONFIG_BQL
+	dql_init(&queue->dql, HZ);
+#endif
 }
 
 static int netif_alloc_netdev_queues(struct net_device *dev)
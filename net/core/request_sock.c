@@ -18,6 +18,7 @@
 #include <linux/vmalloc.h>
 
 #include <net/request_sock.h>
+#include <net/tcp.h>
 
 /*
  * Maximum number of SYN_RECV sockets in queue per LISTEN socket.
@@ -129,3 +130,28 @@ void reqsk_queue_destroy(struct request_sock_queue *queue)
 		kfree(lopt);
 }
 
+/*
+ * A Fast Open child @sk no longer needs @req: the handshake completed, or
+ * the connection is being torn down before it did.  Give back its slot in
+ * the listener's Fast Open queue, and free @req unless accept() has not
+ * yet taken the child off the accept queue, in which case accept() frees
+ * it.  Called with @sk locked.
+ */
+void reqsk_fastopen_remove(struct sock *sk, struct request_sock *req)
+{
+	struct sock *lsk = tcp_rsk(req)->listener;
+	struct fastopen_queue *fastopenq =
+		inet_csk(lsk)->icsk_accept_queue.fastopenq;
+	bool accepted;
+
+	tcp_sk(sk)->fastopen_rsk = NULL;
+	spin_lock_bh(&fastopenq->lock);
+	fastopenq->qlen--;
+	tcp_rsk(req)->listener = NULL;
+	accepted = req->sk == NULL;
+	spin_unlock_bh(&fastopenq->lock);
+
+	sock_put(lsk);
+	if (accepted)
+		reqsk_free(req);
+}
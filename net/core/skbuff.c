@@ -344,13 +344,7 @@ static void skb_release_data(struct sk_buff *skb)
 		 * If skb buf is from userspace, we need to notify the caller
 		 * the lower device DMA has done;
 		 */
-		if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-			struct ubuf_info *uarg;
-
-			uarg = skb_shinfo(skb)->destructor_arg;
-			if (uarg->callback)
-				uarg->callback(uarg);
-		}
+		skb_zcopy_clear(skb, true);
 
 		if (skb_has_frag_list(skb))
 			skb_drop_fraglist(skb);
@@ -571,6 +565,9 @@ static void __copy_skb_header(struct sk_buff *new, const struct sk_buff *old)
 #endif
 #endif
 	new->vlan_tci		= old->vlan_tci;
+#ifdef CONFIG_NET_RX_BUSY_POLL
+	new->napi_id		= old->napi_id;
+#endif
 
 	skb_copy_secmark(new, old);
 }
@@ -642,10 +639,19 @@ EXPORT_SYMBOL_GPL(skb_morph);
 int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask)
 {
 	int i;
-	int num_frags = skb_shinfo(skb)->nr_frags;
+	int num_frags;
 	struct page *page, *head = NULL;
 	struct ubuf_info *uarg = skb_shinfo(skb)->destructor_arg;
 
+	/* MSG_ZEROCOPY data may be shared with clones: get our own */
+	if (skb_zcopy_is_sock(uarg)) {
+		if (skb_shared(skb))
+			return -EINVAL;
+		if (skb_cloned(skb) && pskb_expand_head(skb, 0, 0, gfp_mask))
+			return -ENOMEM;
+	}
+
+	num_frags = skb_shinfo(skb)->nr_frags;
 	for (i = 0; i < num_frags; i++) {
 		u8 *vaddr;
 		skb_frag_t *f = &skb_shinfo(skb)->frags[i];
@@ -671,8 +677,6 @@ int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask)
 	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
 		skb_frag_unref(skb, i);
 
-	uarg->callback(uarg);
-
 	/* skb frags point to kernel buffers */
 	for (i = skb_shinfo(skb)->nr_frags; i > 0; i--) {
 		__skb_fill_page_desc(skb, i-1, head, 0,
@@ -680,7 +684,278 @@ int skb_copy_ubufs(struct sk_buff *skb, gfp_t gfp_mask)
 		head = (struct page *)head->private;
 	}
 
-	skb_shinfo(skb)->tx_flags &= ~SKBTX_DEV_ZEROCOPY;
+	skb_zcopy_clear(skb, false);
+	return 0;
+}
+
+static inline struct sk_buff *skb_from_uarg(struct ubuf_info *uarg)
+{
+	return container_of((void *)uarg, struct sk_buff, cb);
+}
+
+/*
+ * MSG_ZEROCOPY: the ubuf_info of a send lives in the cb of the skb which
+ * will carry its completion on the socket's error queue, so completing
+ * never has to allocate.  Sends whose ids follow on share one ubuf_info,
+ * and so one completion, while they fit in a few TSO packets.
+ */
+static struct ubuf_info *sock_zerocopy_alloc(struct sock *sk, size_t size)
+{
+	struct ubuf_info *uarg;
+	struct sk_buff *skb;
+
+	skb = sock_omalloc(sk, 0, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	BUILD_BUG_ON(sizeof(*uarg) > sizeof(skb->cb));
+	uarg = (void *)skb->cb;
+
+	uarg->callback = sock_zerocopy_callback;
+	uarg->id = ((u32)atomic_inc_return(&sk->sk_zckey)) - 1;
+	uarg->len = 1;
+	uarg->bytelen = size;
+	uarg->zerocopy = 1;
+	atomic_set(&uarg->refcnt, 1);
+	sock_hold(sk);
+
+	return uarg;
+}
+
+/**
+ *	sock_zerocopy_realloc - start a MSG_ZEROCOPY send
+ *	@sk: stream socket, locked by the caller
+ *	@size: bytes to send
+ *	@uarg: ubuf_info of the socket's previous send, if any
+ *
+ *	Returns a ubuf_info holding a reference for the caller, to be
+ *	dropped with sock_zerocopy_put(), or with sock_zerocopy_put_abort()
+ *	if none of the data could be queued.  Returns %NULL if out of
+ *	option memory.
+ */
+struct ubuf_info *sock_zerocopy_realloc(struct sock *sk, size_t size,
+					struct ubuf_info *uarg)
+{
+	if (uarg) {
+		const u32 byte_limit = 1 << 19;	/* limit to a few TSO */
+		u32 bytelen, next;
+
+		/* realloc only when socket is locked, so uarg->len and
+		 * sk_zckey access is serialized
+		 */
+		if (!sock_owned_by_user(sk)) {
+			WARN_ON_ONCE(1);
+			return NULL;
+		}
+
+		bytelen = uarg->bytelen + size;
+		if (uarg->len == USHRT_MAX - 1 || bytelen > byte_limit)
+			goto new_alloc;
+
+		next = (u32)atomic_read(&sk->sk_zckey);
+		if ((u32)(uarg->id + uarg->len) == next) {
+			uarg->len++;
+			uarg->bytelen = bytelen;
+			atomic_set(&sk->sk_zckey, ++next);
+			sock_zerocopy_get(uarg);
+			return uarg;
+		}
+	}
+
+new_alloc:
+	return sock_zerocopy_alloc(sk, size);
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_realloc);
+
+/* Merge the completion of sends lo..lo + len - 1 into @skb, the last one
+ * still queued, if it directly precedes them and reports the same code.
+ */
+static bool skb_zerocopy_notify_extend(struct sk_buff *skb, u32 lo, u16 len,
+				       u8 code)
+{
+	struct sock_exterr_skb *serr = SKB_EXT_ERR(skb);
+	u32 old_lo, old_hi;
+	u64 sum_len;
+
+	if (serr->ee.ee_errno || serr->ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+	    serr->ee.ee_code != code)
+		return false;
+
+	old_lo = serr->ee.ee_info;
+	old_hi = serr->ee.ee_data;
+	sum_len = old_hi - old_lo + 1ULL + len;
+
+	if (sum_len >= (1ULL << 32))
+		return false;
+
+	if (lo != old_hi + 1)
+		return false;
+
+	serr->ee.ee_data += len;
+	return true;
+}
+
+static void sock_zerocopy_notify(struct ubuf_info *uarg)
+{
+	struct sk_buff *tail, *skb = skb_from_uarg(uarg);
+	struct sock_exterr_skb *serr;
+	struct sock *sk = skb->sk;
+	struct sk_buff_head *q;
+	unsigned long flags;
+	u32 lo, hi;
+	u16 len;
+	u8 code;
+
+	/* if !len, there was only 1 call, and it was aborted
+	 * so do not queue a completion notification
+	 */
+	if (!uarg->len || sock_flag(sk, SOCK_DEAD))
+		goto release;
+
+	len = uarg->len;
+	lo = uarg->id;
+	hi = uarg->id + len - 1;
+	code = uarg->zerocopy ? 0 : SO_EE_CODE_ZEROCOPY_COPIED;
+
+	/* the completion overwrites uarg, in the same cb */
+	serr = SKB_EXT_ERR(skb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_errno = 0;
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_code = code;
+	serr->ee.ee_info = lo;
+	serr->ee.ee_data = hi;
+
+	q = &sk->sk_error_queue;
+	spin_lock_irqsave(&q->lock, flags);
+	tail = skb_peek_tail(q);
+	if (!tail || !skb_zerocopy_notify_extend(tail, lo, len, code)) {
+		__skb_queue_tail(q, skb);
+		skb = NULL;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	sk->sk_error_report(sk);
+
+release:
+	consume_skb(skb);
+	sock_put(sk);
+}
+
+/**
+ *	sock_zerocopy_callback - ubuf_info callback of MSG_ZEROCOPY sends
+ *	@arg: the ubuf_info
+ *
+ *	Called as skb data holding the send's user pages is released.
+ */
+void sock_zerocopy_callback(void *arg)
+{
+	sock_zerocopy_put(arg);
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_callback);
+
+void sock_zerocopy_put(struct ubuf_info *uarg)
+{
+	if (uarg && atomic_dec_and_test(&uarg->refcnt))
+		sock_zerocopy_notify(uarg);
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_put);
+
+void sock_zerocopy_put_abort(struct ubuf_info *uarg)
+{
+	if (uarg) {
+		struct sock *sk = skb_from_uarg(uarg)->sk;
+
+		atomic_dec(&sk->sk_zckey);
+		uarg->len--;
+
+		sock_zerocopy_put(uarg);
+	}
+}
+EXPORT_SYMBOL_GPL(sock_zerocopy_put_abort);
+
+/**
+ *	skb_zerocopy_from_user - append user memory to a stream skb's frags
+ *	@sk: stream socket @skb is queued on
+ *	@skb: buffer to append to
+ *	@from: user address of the data
+ *	@length: bytes to append
+ *	@uarg: the MSG_ZEROCOPY send the data belongs to
+ *
+ *	Pins the user pages instead of copying them, charging them to the
+ *	socket's send queue.  Returns how many bytes were appended, fewer
+ *	than @length if @skb ran out of frags, -EMSGSIZE if it has none
+ *	left, -EEXIST if it holds data of another send, or -EFAULT.
+ */
+int skb_zerocopy_from_user(struct sock *sk, struct sk_buff *skb,
+			   const void __user *from, int length,
+			   struct ubuf_info *uarg)
+{
+	struct ubuf_info *orig_uarg = skb_zcopy(skb);
+	struct page *pages[MAX_SKB_FRAGS];
+	unsigned long base = (unsigned long)from;
+	int frag = skb_shinfo(skb)->nr_frags;
+	int off = base & ~PAGE_MASK;
+	int copied, truesize, nr_pages, n, i;
+
+	/* An skb can only point to one uarg */
+	if (orig_uarg && orig_uarg != uarg)
+		return -EEXIST;
+
+	if (frag == MAX_SKB_FRAGS)
+		return -EMSGSIZE;
+
+	nr_pages = min_t(int, PAGE_ALIGN(off + length) >> PAGE_SHIFT,
+			 MAX_SKB_FRAGS - frag);
+	n = get_user_pages_fast(base, nr_pages, 0, pages);
+	if (n <= 0)
+		return -EFAULT;
+
+	copied = min_t(int, length, n * PAGE_SIZE - off);
+	truesize = PAGE_ALIGN(off + copied);
+
+	skb->data_len += copied;
+	skb->len += copied;
+	skb->truesize += truesize;
+	sk->sk_wmem_queued += truesize;
+	sk_mem_charge(sk, truesize);
+
+	length = copied;
+	for (i = 0; i < n; i++) {
+		int size = min_t(int, length, PAGE_SIZE - off);
+
+		skb_fill_page_desc(skb, frag++, pages[i], off, size);
+		length -= size;
+		off = 0;
+	}
+
+	skb_zcopy_set(skb, uarg);
+	return copied;
+}
+EXPORT_SYMBOL_GPL(skb_zerocopy_from_user);
+
+/* Make @nskb, which now shares frags with @orig, hold its MSG_ZEROCOPY
+ * send too.  @gfp_mask may be 0 only if @nskb has no user frags.
+ */
+static int skb_zerocopy_clone(struct sk_buff *nskb, struct sk_buff *orig,
+			      gfp_t gfp_mask)
+{
+	struct ubuf_info *uarg = skb_zcopy(orig);
+
+	if (!uarg)
+		return 0;
+
+	if (skb_zcopy(nskb)) {
+		if (skb_zcopy(nskb) == uarg)
+			return 0;
+		if (!gfp_mask) {
+			WARN_ON_ONCE(1);
+			return -ENOMEM;
+		}
+		if (skb_copy_ubufs(nskb, gfp_mask))
+			return -EIO;
+	}
+	skb_zcopy_set(nskb, uarg);
 	return 0;
 }
 
@@ -703,10 +978,8 @@ struct sk_buff *skb_clone(struct sk_buff *skb, gfp_t gfp_mask)
 {
 	struct sk_buff *n;
 
-	if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-		if (skb_copy_ubufs(skb, gfp_mask))
-			return NULL;
-	}
+	if (skb_orphan_frags(skb, gfp_mask))
+		return NULL;
 
 	n = skb + 1;
 	if (skb->fclone == SKB_FCLONE_ORIG &&
@@ -825,18 +1098,17 @@ struct sk_buff *pskb_copy(struct sk_buff *skb, gfp_t gfp_mask)
 	if (skb_shinfo(skb)->nr_frags) {
 		int i;
 
-		if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-			if (skb_copy_ubufs(skb, gfp_mask)) {
-				kfree_skb(n);
-				n = NULL;
-				goto out;
-			}
+		if (skb_orphan_frags(skb, gfp_mask)) {
+			kfree_skb(n);
+			n = NULL;
+			goto out;
 		}
 		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
 			skb_shinfo(n)->frags[i] = skb_shinfo(skb)->frags[i];
 			skb_frag_ref(skb, i);
 		}
 		skb_shinfo(n)->nr_frags = i;
+		skb_zcopy_set(n, skb_zcopy(skb));
 	}
 
 	if (skb_has_frag_list(skb)) {
@@ -907,6 +1179,10 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 	if (!data)
 		goto nodata;
 
+	/* copy this zero copy skb frags, before the new shinfo takes them */
+	if (!fastpath && skb_orphan_frags(skb, gfp_mask))
+		goto nofrags;
+
 	/* Copy only real data... and, alas, header. This should be
 	 * optimized for the cases when header is void.
 	 */
@@ -919,11 +1195,9 @@ int pskb_expand_head(struct sk_buff *skb, int nhead, int ntail,
 	if (fastpath) {
 		kfree(skb->head);
 	} else {
-		/* copy this zero copy skb frags */
-		if (skb_shinfo(skb)->tx_flags & SKBTX_DEV_ZEROCOPY) {
-			if (skb_copy_ubufs(skb, gfp_mask))
-				goto nofrags;
-		}
+		/* both the old and the new data hold the zerocopy send */
+		if (skb_zcopy(skb))
+			sock_zerocopy_get(skb_zcopy(skb));
 		for (i = 0; i < skb_shinfo(skb)->nr_frags; i++)
 			skb_frag_ref(skb, i);
 
@@ -2207,6 +2481,8 @@ void skb_split(struct sk_buff *skb, struct sk_buff *skb1, const u32 len)
 {
 	int pos = skb_headlen(skb);
 
+	/* skb1 is fresh, so this cannot fail */
+	skb_zerocopy_clone(skb1, skb, 0);
 	if (len < pos)	/* Split line is inside header. */
 		skb_split_inside_header(skb, skb1, len, pos);
 	else		/* Second chunk has no header, nothing to copy. */
@@ -2249,6 +2525,10 @@ int skb_shift(struct sk_buff *tgt, struct sk_buff *skb, int shiftlen)
 	BUG_ON(shiftlen > skb->len);
 	BUG_ON(skb_headlen(skb));	/* Would corrupt stream */
 
+	/* Each skb can only point to the user buffers of one send */
+	if (skb_zcopy(tgt) || skb_zcopy(skb))
+		return 0;
+
 	todo = shiftlen;
 	from = 0;
 	to = skb_shinfo(tgt)->nr_frags;
@@ -2718,6 +2998,10 @@ struct sk_buff *skb_segment(struct sk_buff *skb, u32 features)
 			continue;
 		}
 
+		if (unlikely(skb_orphan_frags(skb, GFP_ATOMIC) ||
+			     skb_zerocopy_clone(nskb, skb, GFP_ATOMIC)))
+			goto err;
+
 		frag = skb_shinfo(nskb)->frags;
 
 		skb_copy_from_linear_data_offset(skb, offset,
@@ -0,0 +1,148 @@
+/*
+ * TCP Fast Open (draft-ietf-tcpm-fastopen)
+ *
+ * A client holding a cookie from a server may put data on its SYN, and the
+ * server hands that data to the application before the handshake is done.
+ *
+ * The server's cookie is a hash of the client's address under a secret of
+ * ours, much as a SYN cookie is, so it costs no state to hand out or check.
+ * The client keeps what each server gave it in that server's inet_peer
+ * entry, along with the MSS the server offered, so the next connect() can
+ * size its SYN without waiting to hear it again.
+ *
+ *	This program is free software; you can redistribute it and/or
+ *	modify it under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation; either version
+ *	2 of the License, or (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/random.h>
+#include <linux/cryptohash.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/slab.h>
+#include <net/inetpeer.h>
+#include <net/tcp.h>
+
+int sysctl_tcp_fastopen __read_mostly = TFO_DEFAULT;
+
+/* Stop counting lost Fast Open SYNs here; 60s << 10 is most of a day. */
+#define TFO_MAX_SYN_LOSS	10
+
+static u32 tcp_fastopen_secret[16 - 1 + SHA_DIGEST_WORDS] __read_mostly;
+
+static __init int tcp_fastopen_init(void)
+{
+	get_random_bytes(tcp_fastopen_secret, sizeof(tcp_fastopen_secret));
+	return 0;
+}
+__initcall(tcp_fastopen_init);
+
+static DEFINE_PER_CPU(__u32 [16 + 5 + SHA_WORKSPACE_WORDS],
+		      tcp_fastopen_scratch);
+
+/* The cookie we give the client at @addr.  Called from softirq. */
+void tcp_fastopen_cookie_gen(__be32 addr, struct tcp_fastopen_cookie *foc)
+{
+	__u32 *tmp = __get_cpu_var(tcp_fastopen_scratch);
+
+	BUILD_BUG_ON(TCP_FASTOPEN_COOKIE_SIZE > SHA_DIGEST_WORDS * 4);
+
+	memcpy(tmp + 1, tcp_fastopen_secret, sizeof(tcp_fastopen_secret));
+	tmp[0] = (__force u32)addr;
+	sha_transform(tmp + 16, (__u8 *)tmp, tmp + 16 + 5);
+
+	memcpy(foc->val, tmp + 16, TCP_FASTOPEN_COOKIE_SIZE);
+	foc->len = TCP_FASTOPEN_COOKIE_SIZE;
+}
+
+/* Guards the tfo_* fields of every inet_peer. */
+static DEFINE_SEQLOCK(tcp_fastopen_seqlock);
+
+/*
+ * What we know of the server @sk is connecting to.  @cookie is left alone,
+ * and so asks for a cookie, if we know nothing; @mss only changes if the
+ * server has told us one.
+ */
+void tcp_fastopen_cache_get(struct sock *sk, u16 *mss,
+			    struct tcp_fastopen_cookie *cookie,
+			    int *syn_loss, unsigned long *last_syn_loss)
+{
+	struct inet_peer *peer;
+	bool release_it;
+	unsigned int seq;
+
+	peer = inet_csk(sk)->icsk_af_ops->get_peer(sk, &release_it);
+	if (!peer)
+		return;
+
+	do {
+		seq = read_seqbegin(&tcp_fastopen_seqlock);
+		if (peer->tfo_mss)
+			*mss = peer->tfo_mss;
+		cookie->len = peer->tfo_cookie_len;
+		memcpy(cookie->val, peer->tfo_cookie, cookie->len);
+		*syn_loss = peer->tfo_syn_loss;
+		*last_syn_loss = peer->tfo_last_syn_loss;
+	} while (read_seqretry(&tcp_fastopen_seqlock, seq));
+
+	if (release_it)
+		inet_putpeer(peer);
+}
+
+/*
+ * Remember the SYN-ACK to a Fast Open SYN: the server's MSS, its cookie if
+ * it sent one, and whether our SYN with data seems to have been dropped on
+ * the way, in which case tcp_send_syn_data() backs off Fast Open to this
+ * server for a while.
+ */
+void tcp_fastopen_cache_set(struct sock *sk, u16 mss,
+			    struct tcp_fastopen_cookie *cookie, bool syn_lost)
+{
+	struct inet_peer *peer;
+	bool release_it;
+
+	peer = inet_csk(sk)->icsk_af_ops->get_peer(sk, &release_it);
+	if (!peer)
+		return;
+
+	write_seqlock_bh(&tcp_fastopen_seqlock);
+	peer->tfo_mss = mss;
+	if (cookie->len > 0 && cookie->len <= sizeof(peer->tfo_cookie)) {
+		peer->tfo_cookie_len = cookie->len;
+		memcpy(peer->tfo_cookie, cookie->val, cookie->len);
+	}
+	if (syn_lost) {
+		if (peer->tfo_syn_loss < TFO_MAX_SYN_LOSS)
+			peer->tfo_syn_loss++;
+		peer->tfo_last_syn_loss = jiffies;
+	} else {
+		peer->tfo_syn_loss = 0;
+	}
+	write_sequnlock_bh(&tcp_fastopen_seqlock);
+
+	if (release_it)
+		inet_putpeer(peer);
+}
+
+/*
+ * Enable Fast Open on listener @sk, allowing @backlog children at a time
+ * to be waiting for the final ACK of their handshake.  The queue lives
+ * until the listener is freed, since children still point at it.
+ */
+int tcp_fastopen_init_queue(struct sock *sk, int backlog)
+{
+	struct request_sock_queue *queue = &inet_csk(sk)->icsk_accept_queue;
+
+	if (queue->fastopenq == NULL) {
+		queue->fastopenq = kzalloc(sizeof(struct fastopen_queue),
+					   sk->sk_allocation);
+		if (queue->fastopenq == NULL)
+			return -ENOMEM;
+		spin_lock_init(&queue->fastopenq->lock);
+	}
+	queue->fastopenq->max_qlen = backlog;
+	return 0;
+}
@@ -72,6 +72,7 @@
 #include <net/timewait_sock.h>
 #include <net/xfrm.h>
 #include <net/netdma.h>
+#include <net/busy_poll.h>
 #include <net/secure_seq.h>
 
 #include <linux/inet.h>
@@ -754,8 +755,12 @@ static void tcp_v4_timewait_ack(struct sock *sk, struct sk_buff *skb)
 static void tcp_v4_reqsk_send_ack(struct sock *sk, struct sk_buff *skb,
 				  struct request_sock *req)
 {
-	tcp_v4_send_ack(skb, tcp_rsk(req)->snt_isn + 1,
-			tcp_rsk(req)->rcv_isn + 1, req->rcv_wnd,
+	/* sk is either the listener or, for a Fast Open request, the child
+	 * socket, which may already have sent data beyond the SYN-ACK.
+	 */
+	tcp_v4_send_ack(skb, (sk->sk_state == TCP_LISTEN) ?
+			tcp_rsk(req)->snt_isn + 1 : tcp_sk(sk)->snd_nxt,
+			tcp_rsk(req)->rcv_nxt, req->rcv_wnd,
 			req->ts_recent,
 			0,
 			tcp_v4_md5_do_lookup(sk, ip_hdr(skb)->daddr),
@@ -770,7 +775,8 @@ static void tcp_v4_reqsk_send_ack(struct sock *sk, struct sk_buff *skb,
  */
 static int tcp_v4_send_synack(struct sock *sk, struct dst_entry *dst,
 			      struct request_sock *req,
-			      struct request_values *rvp)
+			      struct request_values *rvp,
+			      struct tcp_fastopen_cookie *foc)
 {
 	const struct inet_request_sock *ireq = inet_rsk(req);
 	struct flowi4 fl4;
@@ -781,7 +787,7 @@ static int tcp_v4_send_synack(struct sock *sk, struct dst_entry *dst,
 	if (!dst && (dst = inet_csk_route_req(sk, &fl4, req)) == NULL)
 		return -1;
 
-	skb = tcp_make_synack(sk, dst, req, rvp);
+	skb = tcp_make_synack(sk, dst, req, rvp, foc);
 
 	if (skb) {
 		__tcp_v4_send_check(skb, ireq->loc_addr, ireq->rmt_addr);
@@ -800,7 +806,7 @@ static int tcp_v4_rtx_synack(struct sock *sk, struct request_sock *req,
 			      struct request_values *rvp)
 {
 	TCP_INC_STATS_BH(sock_net(sk), TCP_MIB_RETRANSSEGS);
-	return tcp_v4_send_synack(sk, NULL, req, rvp);
+	return tcp_v4_send_synack(sk, NULL, req, rvp, NULL);
 }
 
 /*
@@ -1247,6 +1253,138 @@ static const struct tcp_request_sock_ops tcp_request_sock_ipv4_ops = {
 };
 #endif
 
+/*
+ * Decide whether the data on this SYN can go straight to the application.
+ * On the way, fill in @valid_foc with the cookie to put on our SYN-ACK if
+ * the client asked for one or sent one we don't believe.
+ */
+static bool tcp_fastopen_check(struct sock *sk, struct sk_buff *skb,
+			       struct request_sock *req,
+			       struct tcp_fastopen_cookie *foc,
+			       struct tcp_fastopen_cookie *valid_foc)
+{
+	struct fastopen_queue *fastopenq;
+	bool skip_cookie = false;
+
+	if (likely(!fastopen_cookie_present(foc))) {
+		if ((sysctl_tcp_fastopen & TFO_SERVER_COOKIE_NOT_REQD) &&
+		    TCP_SKB_CB(skb)->end_seq != TCP_SKB_CB(skb)->seq + 1)
+			skip_cookie = true;
+		else
+			return false;
+	}
+	NET_INC_STATS_BH(sock_net(sk), LINUX_MIB_TCPFASTOPENPASSIVE);
+
+	fastopenq = inet_csk(sk)->icsk_accept_queue.fastopenq;
+	if (!(sysctl_tcp_fastopen & TFO_SERVER_ENABLE) ||
+	    fastopenq == NULL || fastopenq->max_qlen == 0)
+		return false;
+
+	/* Racy, but the limit is only a defence against a flood of valid
+	 * cookies tying up child sockets: one too many does no harm.
+	 */
+	if (fastopenq->qlen >= fastopenq->max_qlen) {
+		NET_INC_STATS_BH(sock_net(sk),
+				 LINUX_MIB_TCPFASTOPENLISTENOVERFLOW);
+		return false;
+	}
+
+	if (!skip_cookie) {
+		if (foc->len != TCP_FASTOPEN_COOKIE_SIZE) {
+			/* A request (zero length), or a cookie which can't be
+			 * ours: either way, give the client the right one.
+			 */
+			if (foc->len == 0)
+				NET_INC_STATS_BH(sock_net(sk),
+					LINUX_MIB_TCPFASTOPENCOOKIEREQD);
+			tcp_fastopen_cookie_gen(ip_hdr(skb)->saddr, valid_foc);
+			return false;
+		}
+		if (!(sysctl_tcp_fastopen & TFO_SERVER_COOKIE_NOT_CHKED)) {
+			tcp_fastopen_cookie_gen(ip_hdr(skb)->saddr, valid_foc);
+			if (memcmp(foc->val, valid_foc->val,
+				   TCP_FASTOPEN_COOKIE_SIZE) != 0)
+				return false;
+			/* It was right, so there's no need to send it back. */
+			valid_foc->len = -1;
+		}
+	}
+
+	/* Acknowledge the data on the SYN along with the SYN. */
+	tcp_rsk(req)->rcv_nxt = TCP_SKB_CB(skb)->end_seq;
+	return true;
+}
+
+/*
+ * Create the child socket for a Fast Open SYN now, rather than when the
+ * handshake completes, put it straight on the accept queue and give it the
+ * SYN's data.  The request_sock hangs off the child until the final ACK
+ * arrives, so that the child can retransmit the SYN-ACK itself.
+ *
+ * Returns false, with nothing changed, if the child can't be created.
+ */
+static bool tcp_v4_conn_req_fastopen(struct sock *sk, struct sk_buff *skb,
+				     struct request_sock *req)
+{
+	struct request_sock_queue *queue = &inet_csk(sk)->icsk_accept_queue;
+	struct tcp_sock *tp;
+	struct sock *child;
+
+	req->retrans = 0;
+	req->sk = NULL;
+
+	child = inet_csk(sk)->icsk_af_ops->syn_recv_sock(sk, skb, req, NULL);
+	if (child == NULL) {
+		NET_INC_STATS_BH(sock_net(sk),
+				 LINUX_MIB_TCPFASTOPENPASSIVEFAIL);
+		return false;
+	}
+
+	spin_lock(&queue->fastopenq->lock);
+	queue->fastopenq->qlen++;
+	spin_unlock(&queue->fastopenq->lock);
+
+	tp = tcp_sk(child);
+	tp->fastopen_rsk = req;
+	/* The child may be accepted and outlive the listener, but still
+	 * needs the listener's fastopenq lock to drop its request_sock.
+	 */
+	sock_hold(sk);
+	tcp_rsk(req)->listener = sk;
+
+	/* RFC1323: the window in a SYN is never scaled. */
+	tp->snd_wnd = ntohs(tcp_hdr(skb)->window);
+
+	/* The SYN-ACK is retransmitted by the child's own timer, since the
+	 * request_sock is not in the listener's SYN table.
+	 */
+	inet_csk_reset_xmit_timer(child, ICSK_TIME_RETRANS,
+				  TCP_TIMEOUT_INIT, TCP_RTO_MAX);
+
+	inet_csk_reqsk_queue_add(sk, req, child);
+
+	tcp_init_congestion_control(child);
+	tp->lsndtime = tcp_time_stamp;
+	tcp_init_buffer_space(child);
+
+	/* Queue the SYN's data, if it has any: our caller frees the skb, so
+	 * the receive queue needs a reference of its own.
+	 */
+	if (TCP_SKB_CB(skb)->end_seq != TCP_SKB_CB(skb)->seq + 1) {
+		skb = skb_get(skb);
+		skb_dst_drop(skb);
+		__skb_pull(skb, tcp_hdr(skb)->doff * 4);
+		skb_set_owner_r(skb, child);
+		__skb_queue_tail(&child->sk_receive_queue, skb);
+		tp->rcv_nxt = TCP_SKB_CB(skb)->end_seq;
+		tp->rcv_wup = tp->rcv_nxt;
+	}
+	sk->sk_data_ready(sk, 0);
+	bh_unlock_sock(child);
+	sock_put(child);
+	return true;
+}
+
 int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 {
 	struct tcp_extend_values tmp_ext;
@@ -1260,6 +1398,10 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	__be32 daddr = ip_hdr(skb)->daddr;
 	__u32 isn = TCP_SKB_CB(skb)->when;
 	int want_cookie = 0;
+	struct tcp_fastopen_cookie foc = { .len = -1 };
+	struct tcp_fastopen_cookie valid_foc = { .len = -1 };
+	bool do_fastopen = false;
+	int err;
 
 	/* Never answer to SYNs send to broadcast or multicast */
 	if (skb_rtable(skb)->rt_flags & (RTCF_BROADCAST | RTCF_MULTICAST))
@@ -1294,7 +1436,8 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	tcp_clear_options(&tmp_opt);
 	tmp_opt.mss_clamp = TCP_MSS_DEFAULT;
 	tmp_opt.user_mss  = tp->rx_opt.user_mss;
-	tcp_parse_options(skb, &tmp_opt, &hash_location, 0);
+	tcp_parse_options(skb, &tmp_opt, &hash_location, 0,
+			  want_cookie ? NULL : &foc);
 
 	if (tmp_opt.cookie_plus > 0 &&
 	    tmp_opt.saw_tstamp &&
@@ -1400,9 +1543,22 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	tcp_rsk(req)->snt_isn = isn;
 	tcp_rsk(req)->snt_synack = tcp_time_stamp;
 
-	if (tcp_v4_send_synack(sk, dst, req,
-			       (struct request_values *)&tmp_ext) ||
-	    want_cookie)
+	if (!want_cookie &&
+	    tcp_fastopen_check(sk, skb, req, &foc, &valid_foc)) {
+		do_fastopen = tcp_v4_conn_req_fastopen(sk, skb, req);
+		if (!do_fastopen)
+			tcp_rsk(req)->rcv_nxt = tcp_rsk(req)->rcv_isn + 1;
+	}
+
+	err = tcp_v4_send_synack(sk, dst, req,
+				 (struct request_values *)&tmp_ext,
+				 fastopen_cookie_present(&valid_foc) ?
+				 &valid_foc : NULL);
+
+	/* A Fast Open child owns the request and retransmits for it. */
+	if (do_fastopen)
+		return 0;
+	if (err || want_cookie)
 		goto drop_and_free;
 
 	inet_csk_reqsk_queue_hash_add(sk, req, TCP_TIMEOUT_INIT);
@@ -1527,7 +1683,7 @@ static struct sock *tcp_v4_hnd_req(struct sock *sk, struct sk_buff *skb)
 	struct request_sock *req = inet_csk_search_req(sk, &prev, th->source,
 						       iph->saddr, iph->daddr);
 	if (req)
-		return tcp_check_req(sk, skb, req, prev);
+		return tcp_check_req(sk, skb, req, prev, false);
 
 	nsk = inet_lookup_established(sock_net(sk), &tcp_hashinfo, iph->saddr,
 			th->source, iph->daddr, th->dest, inet_iif(skb));
@@ -1708,6 +1864,7 @@ process:
 	if (sk_filter(sk, skb))
 		goto discard_and_relse;
 
+	sk_mark_napi_id(sk, skb);
 	skb->dev = NULL;
 
 	bh_lock_sock_nested(sk);
@@ -1771,6 +1928,7 @@ do_time_wait:
 	case TCP_TW_SYN: {
 		struct sock *sk2 = inet_lookup_listener(dev_net(skb->dev),
 							&tcp_hashinfo,
+							iph->saddr, th->source,
 							iph->daddr, th->dest,
 							inet_iif(skb));
 		if (sk2) {
@@ -1840,6 +1998,7 @@ const struct inet_connection_sock_af_ops ipv4_specific = {
 	.addr2sockaddr	   = inet_csk_addr2sockaddr,
 	.sockaddr_len	   = sizeof(struct sockaddr_in),
 	.bind_conflict	   = inet_csk_bind_conflict,
+	.recv_error	   = ip_recv_error,
 #ifdef CONFIG_COMPAT
 	.compat_setsockopt = compat_ip_setsockopt,
 	.compat_getsockopt = compat_ip_getsockopt,
@@ -1865,6 +2024,7 @@ static int tcp_v4_init_sock(struct sock *sk)
 	struct tcp_sock *tp = tcp_sk(sk);
 
 	skb_queue_head_init(&tp->out_of_order_queue);
+	INIT_LIST_HEAD(&tp->tsq_node);
 	tcp_init_xmit_timers(sk);
 	tcp_prequeue_init(tp);
 
@@ -1972,6 +2132,13 @@ void tcp_v4_destroy_sock(struct sock *sk)
 		tp->cookie_values = NULL;
 	}
 
+	/* A Fast Open child torn down before its handshake completed */
+	if (tp->fastopen_rsk != NULL)
+		reqsk_fastopen_remove(sk, tp->fastopen_rsk);
+
+	/* If socket is aborted during connect operation */
+	tcp_free_fastopen_req(tp);
+
 	percpu_counter_dec(&tcp_sockets_allocated);
 }
 EXPORT_SYMBOL(tcp_v4_destroy_sock);
@@ -2611,6 +2778,7 @@ struct proto tcp_prot = {
 	.sendmsg		= tcp_sendmsg,
 	.sendpage		= tcp_sendpage,
 	.backlog_rcv		= tcp_v4_do_rcv,
+	.release_cb		= tcp_release_cb,
 	.hash			= inet_hash,
 	.unhash			= inet_unhash,
 	.get_port		= inet_csk_get_port,